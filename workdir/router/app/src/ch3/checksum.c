@@ -18,6 +18,11 @@
 #include <netinet/icmp6.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSUM_X86
+#endif
+#include "checksum.h"
 
 struct pseudo_ip
 {
@@ -39,113 +44,223 @@ struct pseudo_ip6_hdr
 };
 
 /**
- * @brief チェックサム計算関数
- * @details チェックサムを計算する @n
- * 1. 対象のパケットに対して, 16ビットごとの1の補数和を計算 @n
- * 2. 計算結果の1の補数を取る @n
+ * @brief 1の補数和の計算(64ビット整数, 8バイトずつ)
+ * @details 2^16 ≡ 1 (mod 0xFFFF) なので, 32ビット単位で64ビットに足し込んでから16ビットに畳んでも @n
+ * 16ビットずつ足した場合と同じ値になる. 桁あふれの確認はループの外で1回だけ行う
  *
- * @param [in] data : パケットデータ
- * @param [in] len : パケットデータ長
- * @return チェックサム
+ * @param [in] data : データ
+ * @param [in] len : データ長
+ * @return 畳む前の和
  */
-u_int16_t checksum(u_char *data, int len)
+static u_int64_t csumScalar(const u_char *data, int len)
 {
-    register u_int32_t sum;
-    register u_int16_t *ptr;
-    register int c;
+    u_int64_t sum = 0, q;
+    u_int32_t w;
+    u_int16_t h;
 
-    sum = 0;
-    ptr = (u_int16_t *)data;
-    // 2byte(16bit)ずつ加算
-    for (c = len; c > 1; c -= 2)
+    for (; len >= 8; data += 8, len -= 8)
     {
-        sum += (*ptr);
-        if (sum & 0x80000000)
-        {
-            sum = (sum & 0xFFFF) + (sum >> 16);
-        }
-        ptr++;
+        memcpy(&q, data, sizeof(q));
+        sum += (q & 0xFFFFFFFF) + (q >> 32);
     }
-    // cが奇数byteだと, 8bit分を0埋めして16bitにして加算
-    if (c == 1)
+    if (len >= 4)
     {
-        u_int16_t val;
-        val = 0;
-        memcpy(&val, ptr, sizeof(u_int8_t));
-        sum += val;
+        memcpy(&w, data, sizeof(w));
+        sum += w;
+        data += 4;
+        len -= 4;
     }
-    while (sum >> 16)
+    if (len >= 2)
     {
-        sum = (sum & 0xFFFF) + (sum >> 16);
+        memcpy(&h, data, sizeof(h));
+        sum += h;
+        data += 2;
+        len -= 2;
     }
-    return ~sum;
+    if (len == 1)
+    { // 奇数byteだと, 8bit分を0埋めして16bitにして加算
+        h = 0;
+        memcpy(&h, data, sizeof(u_int8_t));
+        sum += h;
+    }
+    return sum;
 }
 
+#ifdef CSUM_X86
 /**
- * @brief 2つのデータ data1 と data2 のチェックサム計算関数
+ * @brief 1の補数和の計算(SSE2, 16バイトずつ)
+ * @details 32ビットの4レーンを64ビットに広げて2つのアキュムレータに足し込む
  *
- * @param [in] data1 : パケットデータ1
- * @param [in] len1 : パケットデータ1長
- * @param [in] data2 : パケットデータ2
- * @param [in] len2 : パケットデータ2長
- * @return チェックサム
+ * @param [in] data : データ
+ * @param [in] len : データ長
+ * @return 畳む前の和
  */
-u_int16_t checksum2(u_char *data1, int len1, u_char *data2, int len2)
+__attribute__((target("sse2"))) static u_int64_t csumSse2(const u_char *data, int len)
 {
-    register u_int32_t sum;
-    register u_int16_t *ptr;
-    register int c;
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero, v;
+    u_int64_t lane[2];
 
-    sum = 0;
-    ptr = (u_int16_t *)data1;
-    // 2byte(16bit)ずつ加算
-    for (c = len1; c > 1; c -= 2)
+    if (len < 16)
     {
-        sum += (*ptr);
-        if (sum & 0x80000000)
-        {
-            sum = (sum & 0xFFFF) + (sum >> 16);
-        }
-        ptr++;
-    }
-    if (c == 1)
-    { // data1が奇数byte長の場合, data2の先頭1byteを16bitにして加算
-        u_int16_t val;
-        val = ((*ptr) << 8) + (*data2);
-        sum += val;
-        if (sum & 0x80000000)
-        {
-            sum = (sum & 0xFFFF) + (sum >> 16);
-        }
-        ptr = (u_int16_t *)(data2 + 1);
-        len2--;
+        return csumScalar(data, len);
     }
-    else
+    for (; len >= 16; data += 16, len -= 16)
+    {
+        v = _mm_loadu_si128((const __m128i *)data);
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v, zero));
+    }
+    _mm_storeu_si128((__m128i *)lane, _mm_add_epi64(acc0, acc1));
+    return lane[0] + lane[1] + csumScalar(data, len);
+}
+
+/**
+ * @brief 1の補数和の計算(AVX2, 32バイトずつ)
+ *
+ * @param [in] data : データ
+ * @param [in] len : データ長
+ * @return 畳む前の和
+ */
+__attribute__((target("avx2"))) static u_int64_t csumAvx2(const u_char *data, int len)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero, v;
+    u_int64_t lane[4];
+
+    if (len < 32)
     {
-        ptr = (u_int16_t *)data2;
+        return csumScalar(data, len);
     }
-    // 残りのdata2を16bitごとに加算
-    for (c = len2; c > 1; c -= 2)
+    for (; len >= 32; data += 32, len -= 32)
     {
-        sum += (*ptr);
-        if (sum & 0x80000000)
+        v = _mm256_loadu_si256((const __m256i *)data);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+    }
+    _mm256_storeu_si256((__m256i *)lane, _mm256_add_epi64(acc0, acc1));
+    return lane[0] + lane[1] + lane[2] + lane[3] + csumScalar(data, len);
+}
+#endif
+
+// 1の補数和の計算に使う関数. 起動時にCPUに合わせて選ぶ
+static u_int64_t (*CsumKernel)(const u_char *data, int len) = csumScalar;
+static int CsumKernelNo = CSUM_KERNEL_SCALAR;
+
+/**
+ * @brief 1の補数和の計算に使う関数を選ぶ
+ *
+ * @param [in] kernel : CSUM_KERNEL_SCALAR, CSUM_KERNEL_SSE2, CSUM_KERNEL_AVX2
+ * @return 0 : 正常終了, -1 : このCPUでは使えない
+ */
+int checksumSelect(int kernel)
+{
+    switch (kernel)
+    {
+    case CSUM_KERNEL_SCALAR:
+        CsumKernel = csumScalar;
+        break;
+#ifdef CSUM_X86
+    case CSUM_KERNEL_SSE2:
+        if (!__builtin_cpu_supports("sse2"))
+        {
+            return -1;
+        }
+        CsumKernel = csumSse2;
+        break;
+    case CSUM_KERNEL_AVX2:
+        if (!__builtin_cpu_supports("avx2"))
         {
-            sum = (sum & 0xFFFF) + (sum >> 16);
+            return -1;
         }
-        ptr++;
+        CsumKernel = csumAvx2;
+        break;
+#endif
+    default:
+        return -1;
     }
-    if (c == 1)
+    CsumKernelNo = kernel;
+    return 0;
+}
+
+/**
+ * @brief 選ばれている1の補数和の計算関数の名前
+ *
+ * @return 名前
+ */
+const char *checksumKernelName()
+{
+    static const char *names[] = {"scalar", "sse2", "avx2"};
+
+    return names[CsumKernelNo];
+}
+
+/**
+ * @brief 起動時にCPUIDを調べ, 使える中で最も速い計算関数を選ぶ
+ *
+ */
+__attribute__((constructor)) static void checksumInit()
+{
+#ifdef CSUM_X86
+    __builtin_cpu_init();
+#endif
+    if (checksumSelect(CSUM_KERNEL_AVX2) == -1 && checksumSelect(CSUM_KERNEL_SSE2) == -1)
     {
-        u_int16_t val;
-        val = 0;
-        memcpy(&val, ptr, sizeof(u_int8_t));
-        sum += val;
+        checksumSelect(CSUM_KERNEL_SCALAR);
     }
+}
+
+/**
+ * @brief 1の補数和を16ビットに畳む
+ *
+ * @param [in] sum : 畳む前の和
+ * @return 16ビットの1の補数和
+ */
+static u_int16_t csumFold(u_int64_t sum)
+{
     while (sum >> 16)
     {
         sum = (sum & 0xFFFF) + (sum >> 16);
     }
-    return ~sum;
+    return sum;
+}
+
+/**
+ * @brief チェックサム計算関数
+ * @details チェックサムを計算する @n
+ * 1. 対象のパケットに対して, 16ビットごとの1の補数和を計算 @n
+ * 2. 計算結果の1の補数を取る @n
+ * 和の計算は checksumSelect() で選ばれた関数で行う
+ *
+ * @param [in] data : パケットデータ
+ * @param [in] len : パケットデータ長
+ * @return チェックサム
+ */
+u_int16_t checksum(u_char *data, int len)
+{
+    return ~csumFold(CsumKernel(data, len));
+}
+
+/**
+ * @brief 2つのデータ data1 と data2 のチェックサム計算関数
+ * @details data1 と data2 をつなげたデータの checksum() と同じ値を返す. @n
+ * data1が奇数byte長の場合, data2は16ビット語の途中から始まるので, data2の和のバイトを入れ替えて足す
+ *
+ * @param [in] data1 : パケットデータ1
+ * @param [in] len1 : パケットデータ1長
+ * @param [in] data2 : パケットデータ2
+ * @param [in] len2 : パケットデータ2長
+ * @return チェックサム
+ */
+u_int16_t checksum2(u_char *data1, int len1, u_char *data2, int len2)
+{
+    u_int16_t sum2 = csumFold(CsumKernel(data2, len2));
+
+    if (len1 & 1)
+    {
+        sum2 = (sum2 << 8) | (sum2 >> 8);
+    }
+    return ~csumFold(CsumKernel(data1, len1) + sum2);
 }
 
 /**
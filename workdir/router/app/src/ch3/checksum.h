@@ -1,3 +1,10 @@
+// チェックサムの1の補数和の計算方式
+#define CSUM_KERNEL_SCALAR 0 // 64ビット整数で8バイトずつ
+#define CSUM_KERNEL_SSE2 1   // SSE2で16バイトずつ
+#define CSUM_KERNEL_AVX2 2   // AVX2で32バイトずつ
+
+int checksumSelect(int kernel);
+const char *checksumKernelName();
 u_int16_t checksum(u_char *data, int len);
 u_int16_t checksum2(u_char *data1, int len1, u_char *data2, int len2);
 int checkIPchecksum(struct iphdr *iphdr, u_char *option, int optionLen);
@@ -0,0 +1,539 @@
+/**
+ * @file filter.c
+ * @brief Chapter 3-1 キャプチャのメイン処理 - サンプルソース5: キャプチャフィルタ
+ * @details フィルタ式をBPF(classic BPF)の命令列に変換する. @n
+ * ソケットに SO_ATTACH_FILTER で設定すると, 条件に合わないフレームはカーネル内で捨てられ, ユーザー空間にコピーされない. @n
+ * 使える式 : arp, ip, ip6, icmp, tcp, udp, host IPv4アドレス, port ポート番号, ether host MACアドレス @n
+ * これらを and, or, not と括弧で組み合わせる
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <net/ethernet.h>
+#include <netinet/ether.h>
+#include <netinet/in.h>
+#include <linux/filter.h>
+#include "filter.h"
+
+#define FILTER_CODE_MAX 512   // 命令数の最大
+#define FILTER_LABEL_MAX 512  // ラベル数の最大
+#define FILTER_TOKEN_MAX 128  // トークン数の最大
+#define FILTER_TOKEN_LEN 64   // トークンの最大長
+#define FILTER_SNAPLEN 0x40000 // 受け取るフレームの最大長
+
+#define LABEL_NEXT -1 // 次の命令
+
+/**
+ * @brief フィルタ式の変換中の状態
+ * @details 分岐先はラベルで表し, 最後にラベルの位置から相対オフセットを求める. @n
+ * BPFの分岐は前方にしか飛べないが, 分岐先は常に変換中の位置より後ろになる
+ *
+ */
+typedef struct
+{
+    struct sock_filter code[FILTER_CODE_MAX];
+    int jt[FILTER_CODE_MAX]; // 真のときの分岐先ラベル
+    int jf[FILTER_CODE_MAX]; // 偽のときの分岐先ラベル
+    int n;
+    int labelPos[FILTER_LABEL_MAX];   // ラベルの位置(-1は未定)
+    int labelAlias[FILTER_LABEL_MAX]; // 別のラベルと同じ位置の場合はそのラベル(-1はなし)
+    int labelNo;
+    char token[FILTER_TOKEN_MAX][FILTER_TOKEN_LEN];
+    int tokenNo;
+    int pos; // 次に読むトークン
+} FILTER_CC;
+
+static int ParseOr(FILTER_CC *cc, int t, int f);
+
+/**
+ * @brief ラベルを作る
+ *
+ * @param [in,out] cc : 変換中の状態
+ * @return ラベル, -1 : 異常終了
+ */
+static int NewLabel(FILTER_CC *cc)
+{
+    if (cc->labelNo == FILTER_LABEL_MAX)
+    {
+        fprintf(stderr, "filter:too complex\n");
+        return -1;
+    }
+    cc->labelPos[cc->labelNo] = -1;
+    cc->labelAlias[cc->labelNo] = -1;
+    return cc->labelNo++;
+}
+
+/**
+ * @brief ラベルの位置を次の命令にする
+ *
+ */
+static void SetLabel(FILTER_CC *cc, int label)
+{
+    cc->labelPos[label] = cc->n;
+}
+
+/**
+ * @brief ラベルを別のラベルと同じ位置にする
+ *
+ */
+static void AliasLabel(FILTER_CC *cc, int label, int to)
+{
+    cc->labelAlias[label] = to;
+}
+
+/**
+ * @brief 命令を追加する
+ *
+ * @param [in,out] cc : 変換中の状態
+ * @param [in] code : 命令
+ * @param [in] k : 定数
+ * @param [in] jt : 真のときの分岐先ラベル(条件分岐, 無条件分岐のとき)
+ * @param [in] jf : 偽のときの分岐先ラベル(条件分岐のとき)
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+static int Emit(FILTER_CC *cc, u_int16_t code, u_int32_t k, int jt, int jf)
+{
+    if (cc->n == FILTER_CODE_MAX)
+    {
+        fprintf(stderr, "filter:too long\n");
+        return -1;
+    }
+    cc->code[cc->n].code = code;
+    cc->code[cc->n].k = k;
+    cc->jt[cc->n] = jt;
+    cc->jf[cc->n] = jf;
+    cc->n++;
+    return 0;
+}
+
+/**
+ * @brief 読み込み命令を追加する
+ *
+ */
+static int Load(FILTER_CC *cc, u_int16_t code, u_int32_t k)
+{
+    return Emit(cc, code, k, LABEL_NEXT, LABEL_NEXT);
+}
+
+/**
+ * @brief Ethernetタイプの一致を調べる命令を追加する(一致しなければfへ)
+ *
+ */
+static int EtherType(FILTER_CC *cc, u_int16_t type, int f)
+{
+    if (Load(cc, BPF_LD | BPF_H | BPF_ABS, 12) == -1)
+    {
+        return -1;
+    }
+    return Emit(cc, BPF_JMP | BPF_JEQ | BPF_K, type, LABEL_NEXT, f);
+}
+
+/**
+ * @brief IPv4のプロトコルの一致を調べる命令を追加する(一致しなければfへ)
+ *
+ */
+static int IpProto(FILTER_CC *cc, u_int8_t proto, int f)
+{
+    if (EtherType(cc, ETHERTYPE_IP, f) == -1 || Load(cc, BPF_LD | BPF_B | BPF_ABS, 23) == -1)
+    {
+        return -1;
+    }
+    return Emit(cc, BPF_JMP | BPF_JEQ | BPF_K, proto, LABEL_NEXT, f);
+}
+
+/**
+ * @brief 次のトークンを取り出す
+ *
+ * @return トークン, NULL : 終わり
+ */
+static char *NextToken(FILTER_CC *cc)
+{
+    if (cc->pos == cc->tokenNo)
+    {
+        return NULL;
+    }
+    return cc->token[cc->pos++];
+}
+
+/**
+ * @brief 次のトークンが指定した文字列なら取り出す
+ *
+ * @return 1 : 取り出した, 0 : 違う
+ */
+static int Accept(FILTER_CC *cc, char *word)
+{
+    if (cc->pos < cc->tokenNo && strcmp(cc->token[cc->pos], word) == 0)
+    {
+        cc->pos++;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 1つの条件(arp, host 10.0.0.1 など)を変換する
+ * @details 条件が成り立てばt, 成り立たなければfへ分岐する命令列を追加する
+ *
+ * @param [in,out] cc : 変換中の状態
+ * @param [in] t : 真のときの分岐先ラベル
+ * @param [in] f : 偽のときの分岐先ラベル
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+static int ParsePrimitive(FILTER_CC *cc, int t, int f)
+{
+    char *word, *arg;
+    struct in_addr addr;
+    struct ether_addr *ea;
+    u_int32_t hi, lo;
+    char *end;
+    long port;
+    int match, src, l4;
+
+    if ((word = NextToken(cc)) == NULL)
+    {
+        fprintf(stderr, "filter:unexpected end\n");
+        return -1;
+    }
+    if (strcmp(word, "arp") == 0)
+    {
+        return EtherType(cc, ETHERTYPE_ARP, f) == -1 ? -1 : Emit(cc, BPF_JMP | BPF_JA, 0, t, LABEL_NEXT);
+    }
+    if (strcmp(word, "ip") == 0)
+    {
+        return EtherType(cc, ETHERTYPE_IP, f) == -1 ? -1 : Emit(cc, BPF_JMP | BPF_JA, 0, t, LABEL_NEXT);
+    }
+    if (strcmp(word, "ip6") == 0)
+    {
+        return EtherType(cc, ETHERTYPE_IPV6, f) == -1 ? -1 : Emit(cc, BPF_JMP | BPF_JA, 0, t, LABEL_NEXT);
+    }
+    if (strcmp(word, "icmp") == 0 || strcmp(word, "tcp") == 0 || strcmp(word, "udp") == 0)
+    {
+        int proto = word[0] == 'i' ? IPPROTO_ICMP : (word[0] == 't' ? IPPROTO_TCP : IPPROTO_UDP);
+
+        return IpProto(cc, proto, f) == -1 ? -1 : Emit(cc, BPF_JMP | BPF_JA, 0, t, LABEL_NEXT);
+    }
+    if (strcmp(word, "host") == 0)
+    { // 送信元または宛先のIPv4アドレス
+        if ((arg = NextToken(cc)) == NULL || inet_aton(arg, &addr) == 0)
+        {
+            fprintf(stderr, "filter:host needs an IPv4 address\n");
+            return -1;
+        }
+        if ((match = NewLabel(cc)) == -1 || EtherType(cc, ETHERTYPE_IP, f) == -1 ||
+            Load(cc, BPF_LD | BPF_W | BPF_ABS, 26) == -1 ||
+            Emit(cc, BPF_JMP | BPF_JEQ | BPF_K, ntohl(addr.s_addr), match, LABEL_NEXT) == -1 ||
+            Load(cc, BPF_LD | BPF_W | BPF_ABS, 30) == -1 ||
+            Emit(cc, BPF_JMP | BPF_JEQ | BPF_K, ntohl(addr.s_addr), LABEL_NEXT, f) == -1)
+        {
+            return -1;
+        }
+        SetLabel(cc, match);
+        return Emit(cc, BPF_JMP | BPF_JA, 0, t, LABEL_NEXT);
+    }
+    if (strcmp(word, "port") == 0)
+    { // IPv4のTCP, UDPの送信元または宛先のポート番号(先頭以外のフラグメントは対象外)
+        if ((arg = NextToken(cc)) == NULL || (port = strtol(arg, &end, 10)) < 0 || port > 65535 || *end != '\0')
+        {
+            fprintf(stderr, "filter:port needs a port number\n");
+            return -1;
+        }
+        if ((match = NewLabel(cc)) == -1 || (l4 = NewLabel(cc)) == -1 ||
+            EtherType(cc, ETHERTYPE_IP, f) == -1 ||
+            Load(cc, BPF_LD | BPF_B | BPF_ABS, 23) == -1 ||
+            Emit(cc, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, l4, LABEL_NEXT) == -1 ||
+            Emit(cc, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, LABEL_NEXT, f) == -1)
+        {
+            return -1;
+        }
+        SetLabel(cc, l4);
+        if (Load(cc, BPF_LD | BPF_H | BPF_ABS, 20) == -1 ||
+            Emit(cc, BPF_JMP | BPF_JSET | BPF_K, 0x1FFF, f, LABEL_NEXT) == -1 ||
+            Load(cc, BPF_LDX | BPF_B | BPF_MSH, 14) == -1 ||
+            Load(cc, BPF_LD | BPF_H | BPF_IND, 14) == -1 ||
+            Emit(cc, BPF_JMP | BPF_JEQ | BPF_K, port, match, LABEL_NEXT) == -1 ||
+            Load(cc, BPF_LD | BPF_H | BPF_IND, 16) == -1 ||
+            Emit(cc, BPF_JMP | BPF_JEQ | BPF_K, port, LABEL_NEXT, f) == -1)
+        {
+            return -1;
+        }
+        SetLabel(cc, match);
+        return Emit(cc, BPF_JMP | BPF_JA, 0, t, LABEL_NEXT);
+    }
+    if (strcmp(word, "ether") == 0 && Accept(cc, "host"))
+    { // 送信元または宛先のMACアドレス
+        if ((arg = NextToken(cc)) == NULL || (ea = ether_aton(arg)) == NULL)
+        {
+            fprintf(stderr, "filter:ether host needs a MAC address\n");
+            return -1;
+        }
+        hi = (u_int32_t)ea->ether_addr_octet[0] << 24 | ea->ether_addr_octet[1] << 16 | ea->ether_addr_octet[2] << 8 | ea->ether_addr_octet[3];
+        lo = ea->ether_addr_octet[4] << 8 | ea->ether_addr_octet[5];
+        if ((match = NewLabel(cc)) == -1 || (src = NewLabel(cc)) == -1 ||
+            Load(cc, BPF_LD | BPF_W | BPF_ABS, 0) == -1 ||
+            Emit(cc, BPF_JMP | BPF_JEQ | BPF_K, hi, LABEL_NEXT, src) == -1 ||
+            Load(cc, BPF_LD | BPF_H | BPF_ABS, 4) == -1 ||
+            Emit(cc, BPF_JMP | BPF_JEQ | BPF_K, lo, match, src) == -1)
+        {
+            return -1;
+        }
+        SetLabel(cc, src);
+        if (Load(cc, BPF_LD | BPF_W | BPF_ABS, 6) == -1 ||
+            Emit(cc, BPF_JMP | BPF_JEQ | BPF_K, hi, LABEL_NEXT, f) == -1 ||
+            Load(cc, BPF_LD | BPF_H | BPF_ABS, 10) == -1 ||
+            Emit(cc, BPF_JMP | BPF_JEQ | BPF_K, lo, LABEL_NEXT, f) == -1)
+        {
+            return -1;
+        }
+        SetLabel(cc, match);
+        return Emit(cc, BPF_JMP | BPF_JA, 0, t, LABEL_NEXT);
+    }
+    fprintf(stderr, "filter:unknown primitive '%s'\n", word);
+    return -1;
+}
+
+/**
+ * @brief not, 括弧, 1つの条件を変換する
+ *
+ */
+static int ParseFactor(FILTER_CC *cc, int t, int f)
+{
+    if (Accept(cc, "not") || Accept(cc, "!"))
+    {
+        return ParseFactor(cc, f, t);
+    }
+    if (Accept(cc, "("))
+    {
+        if (ParseOr(cc, t, f) == -1)
+        {
+            return -1;
+        }
+        if (!Accept(cc, ")"))
+        {
+            fprintf(stderr, "filter:missing ')'\n");
+            return -1;
+        }
+        return 0;
+    }
+    return ParsePrimitive(cc, t, f);
+}
+
+/**
+ * @brief and でつないだ条件を変換する
+ * @details 各条件が真なら次の条件へ, 偽ならfへ分岐する. 最後の条件が真ならtへ分岐する
+ *
+ */
+static int ParseAnd(FILTER_CC *cc, int t, int f)
+{
+    int next;
+
+    while (1)
+    {
+        if ((next = NewLabel(cc)) == -1 || ParseFactor(cc, next, f) == -1)
+        {
+            return -1;
+        }
+        if (!Accept(cc, "and") && !Accept(cc, "&&"))
+        {
+            AliasLabel(cc, next, t);
+            return 0;
+        }
+        SetLabel(cc, next);
+    }
+}
+
+/**
+ * @brief or でつないだ条件を変換する
+ * @details 各条件が偽なら次の条件へ, 真ならtへ分岐する. 最後の条件が偽ならfへ分岐する
+ *
+ */
+static int ParseOr(FILTER_CC *cc, int t, int f)
+{
+    int next;
+
+    while (1)
+    {
+        if ((next = NewLabel(cc)) == -1 || ParseAnd(cc, t, next) == -1)
+        {
+            return -1;
+        }
+        if (!Accept(cc, "or") && !Accept(cc, "||"))
+        {
+            AliasLabel(cc, next, f);
+            return 0;
+        }
+        SetLabel(cc, next);
+    }
+}
+
+/**
+ * @brief ラベルから分岐のオフセットを求める
+ *
+ * @param [in] cc : 変換中の状態
+ * @param [in] i : 分岐命令の位置
+ * @param [in] label : 分岐先ラベル
+ * @return オフセット
+ */
+static int Offset(FILTER_CC *cc, int i, int label)
+{
+    if (label == LABEL_NEXT)
+    {
+        return 0;
+    }
+    while (cc->labelAlias[label] != -1)
+    {
+        label = cc->labelAlias[label];
+    }
+    return cc->labelPos[label] - (i + 1);
+}
+
+/**
+ * @brief フィルタ式を空白と括弧で区切る
+ *
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+static int Tokenize(FILTER_CC *cc, char *expr)
+{
+    char *p = expr;
+    int len;
+
+    while (*p != '\0')
+    {
+        if (isspace((unsigned char)*p))
+        {
+            p++;
+            continue;
+        }
+        if (cc->tokenNo == FILTER_TOKEN_MAX)
+        {
+            fprintf(stderr, "filter:too many tokens\n");
+            return -1;
+        }
+        if (*p == '(' || *p == ')')
+        {
+            len = 1;
+        }
+        else
+        {
+            for (len = 0; p[len] != '\0' && !isspace((unsigned char)p[len]) && p[len] != '(' && p[len] != ')'; len++)
+                ;
+        }
+        if (len >= FILTER_TOKEN_LEN)
+        {
+            fprintf(stderr, "filter:token too long\n");
+            return -1;
+        }
+        memcpy(cc->token[cc->tokenNo], p, len);
+        cc->token[cc->tokenNo][len] = '\0';
+        cc->tokenNo++;
+        p += len;
+    }
+    return 0;
+}
+
+/**
+ * @brief フィルタ式を変換し, ラベルを相対オフセットに置き換える
+ *
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+static int Compile(FILTER_CC *cc, char *expr)
+{
+    int t, f, i, jt, jf;
+
+    if (Tokenize(cc, expr) == -1 || (t = NewLabel(cc)) == -1 || (f = NewLabel(cc)) == -1 || ParseOr(cc, t, f) == -1)
+    {
+        return -1;
+    }
+    if (cc->pos != cc->tokenNo)
+    {
+        fprintf(stderr, "filter:unexpected '%s'\n", cc->token[cc->pos]);
+        return -1;
+    }
+    SetLabel(cc, t);
+    if (Emit(cc, BPF_RET | BPF_K, FILTER_SNAPLEN, LABEL_NEXT, LABEL_NEXT) == -1)
+    {
+        return -1;
+    }
+    SetLabel(cc, f);
+    if (Emit(cc, BPF_RET | BPF_K, 0, LABEL_NEXT, LABEL_NEXT) == -1)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < cc->n; i++)
+    {
+        if (BPF_CLASS(cc->code[i].code) != BPF_JMP)
+        {
+            continue;
+        }
+        jt = Offset(cc, i, cc->jt[i]);
+        if (BPF_OP(cc->code[i].code) == BPF_JA)
+        {
+            cc->code[i].k = jt;
+            continue;
+        }
+        jf = Offset(cc, i, cc->jf[i]);
+        if (jt > 255 || jf > 255)
+        { // 条件分岐のオフセットは8ビット
+            fprintf(stderr, "filter:too long\n");
+            return -1;
+        }
+        cc->code[i].jt = jt;
+        cc->code[i].jf = jf;
+    }
+    return 0;
+}
+
+/**
+ * @brief フィルタ式をBPFの命令列に変換する
+ * @details 命令列はmallocした領域に格納するので, 使い終わったら prog->filter を free() する
+ *
+ * @param [in] expr : フィルタ式(例 "tcp and port 80", "arp or icmp")
+ * @param [out] prog : SO_ATTACH_FILTER に渡すプログラム
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int CompileFilter(char *expr, struct sock_fprog *prog)
+{
+    FILTER_CC *cc;
+    int ret = -1;
+
+    if ((cc = (FILTER_CC *)calloc(1, sizeof(FILTER_CC))) == NULL)
+    {
+        perror("calloc");
+        return -1;
+    }
+    if (Compile(cc, expr) == 0)
+    {
+        if ((prog->filter = (struct sock_filter *)malloc(cc->n * sizeof(struct sock_filter))) == NULL)
+        {
+            perror("malloc");
+        }
+        else
+        {
+            memcpy(prog->filter, cc->code, cc->n * sizeof(struct sock_filter));
+            prog->len = cc->n;
+            ret = 0;
+        }
+    }
+    free(cc);
+    return ret;
+}
+
+/**
+ * @brief BPFの命令列を表示する(tcpdump -dd と同じ形式)
+ *
+ * @param [in] fp : 出力先
+ * @param [in] prog : プログラム
+ */
+void DumpFilter(FILE *fp, struct sock_fprog *prog)
+{
+    int i;
+
+    for (i = 0; i < prog->len; i++)
+    {
+        fprintf(fp, "{ 0x%x, %d, %d, 0x%08x },\n",
+                prog->filter[i].code, prog->filter[i].jt, prog->filter[i].jf, prog->filter[i].k);
+    }
+}
@@ -0,0 +1,2 @@
+int CompileFilter(char *expr, struct sock_fprog *prog);
+void DumpFilter(FILE *fp, struct sock_fprog *prog);
@@ -4,6 +4,7 @@
  * @details RAWソケットを使ってデータリンク層のパケットを受信, 標準出力にEthernetヘッダを表示する
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
@@ -14,21 +15,27 @@
 #include <netpacket/packet.h>
 #include <netinet/if_ether.h>
 #include <netinet/ip.h>
+#include <linux/filter.h>
 #include "analyze.h"
+#include "filter.h"
 
 /**
  * @brief RAWソケットの準備
  * @details 以下の処理によりRAWソケットを準備する @n
  * 1. ソケットのファイルディスクリプタを作成 @n
- * 2. ネットワークインターフェースのインデックス番号を取得 @n
- * 3. ソケットにネットワークインターフェースをバインド @n
+ * 2. 受信フィルタを設定(filterを指定した場合) @n
+ * 3. ネットワークインターフェースのインデックス番号を取得 @n
+ * 4. ソケットにネットワークインターフェースとプロトコルをバインド @n
+ * ソケットはプロトコル0で作成してバインドまで受信を止めておき, フィルタはバインドより前に設定する. @n
+ * これにより他のインターフェースのフレームやフィルタ設定前のフレームがソケットに溜まらない
  *
  * @param [in] device : ネットワークインターフェース名
  * @param [in] promiscFlag : プロミスキャスモードにするかどうかのフラグ
  * @param [in] ipOnly : IPパケットのみを対象とするかどうかのフラグ
+ * @param [in] filter : BPFフィルタ(NULLならすべてのパケット)
  * @return soc : ソケットのファイルディスクリプタ
  */
-int InitRawSocket(char *device, int promiscFlag, int ipOnly)
+int InitRawSocket(char *device, int promiscFlag, int ipOnly, struct sock_fprog *filter)
 {
     // ifreq 構造体 : ネットワークインターフェースの情報を格納する構造体 (net/if.h で定義)
     // struct ifreq
@@ -67,21 +74,19 @@ int InitRawSocket(char *device, int promiscFlag, int ipOnly)
     int soc;
     // ソケット soc のファイルディスクリプタを作成
     // データリンク層のパケットを扱うために第一引数(プロトコルファミリー)に PF_PACKET を指定, 第二引数(通信方式)に SOCK_RAW を指定
-    if (ipOnly)
-    { // IPパケットのみを対象とする場合は, 第三引数(プロトコル)に ETH_P_IP を指定
-        if ((soc = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_IP))) < 0)
-        {
-            perror("socket");
-            return -1;
-        }
+    // 第三引数(プロトコル)を 0 にすると bind するまでフレームを受信しない
+    // 対象のプロトコルは bind で指定する
+    if ((soc = socket(PF_PACKET, SOCK_RAW, 0)) < 0)
+    {
+        perror("socket");
+        return -1;
     }
-    else
-    { // すべてのパケットを対象とする場合は, 第三引数(プロトコル)に ETH_P_ALL を指定
-        if ((soc = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0)
-        {
-            perror("socket");
-            return -1;
-        }
+    // 受信フィルタの設定. 条件に合わないパケットはカーネル内で捨てられる
+    if (filter != NULL && setsockopt(soc, SOL_SOCKET, SO_ATTACH_FILTER, filter, sizeof(struct sock_fprog)) < 0)
+    {
+        perror("setsockopt:SO_ATTACH_FILTER");
+        close(soc);
+        return -1;
     }
     // ifreq のメモリ領域をクリア
     memset(&ifreq, 0, sizeof(struct ifreq));
@@ -138,7 +143,10 @@ int InitRawSocket(char *device, int promiscFlag, int ipOnly)
 
 /**
  * @brief キャプチャ処理
- * @details キャプチャしたパケットを標準出力に表示
+ * @details キャプチャしたパケットを標準出力に表示 @n
+ * pcap [-d] device-name [expression] @n
+ * expression : フィルタ式(例 "tcp and port 80"). 条件に合うパケットだけを受信する @n
+ * -d : フィルタ式から作ったBPFの命令列を表示して終了
  *
  * @param [in] argc :
  * @param [in] argv :
@@ -146,18 +154,54 @@ int InitRawSocket(char *device, int promiscFlag, int ipOnly)
  */
 int main(int argc, char *argv[], char *envp[])
 {
-    int soc, size;
+    int soc, size, i, dump = 0;
     u_char buf[65535];
+    char expr[1024];
+    struct sock_fprog filter;
+    char *device;
 
+    if (argc > 1 && strcmp(argv[1], "-d") == 0)
+    {
+        dump = 1;
+        argc--;
+        argv++;
+    }
     if (argc <= 1)
     {
-        fprintf(stderr, "pcap device-name\n");
+        fprintf(stderr, "pcap [-d] device-name [expression]\n");
         return 1;
     }
+    device = argv[1];
+
+    // 残りの引数をつないでフィルタ式にする
+    expr[0] = '\0';
+    for (i = 2; i < argc; i++)
+    {
+        if (strlen(expr) + strlen(argv[i]) + 2 > sizeof(expr))
+        {
+            fprintf(stderr, "expression too long\n");
+            return 1;
+        }
+        strcat(expr, " ");
+        strcat(expr, argv[i]);
+    }
+    if (argc > 2 && CompileFilter(expr, &filter) == -1)
+    {
+        fprintf(stderr, "CompileFilter:error:%s\n", expr);
+        return 1;
+    }
+    if (dump)
+    {
+        if (argc > 2)
+        {
+            DumpFilter(stdout, &filter);
+        }
+        return 0;
+    }
 
-    if ((soc = InitRawSocket(argv[1], 0, 0)) == -1)
+    if ((soc = InitRawSocket(device, 0, 0, argc > 2 ? &filter : NULL)) == -1)
     {
-        fprintf(stderr, "InitRawSocket:error:%s\n", argv[1]);
+        fprintf(stderr, "InitRawSocket:error:%s\n", device);
         return 1;
     }
 
@@ -4,57 +4,156 @@
  *
  */
 
+// 扱えるネットワークインターフェースの最大数
+#define DEVICE_MAX 16
+
 /**
  * @brief ネットワークインターフェースの情報
+ * @details デバイスごとに別のキャッシュラインに置く
  *
  */
 typedef struct
 {
     int soc;
+    char *name; // ネットワークインターフェース名
     u_char hwaddr[6];
     struct in_addr addr, subnet, netmask;
-} DEVICE;
+} __attribute__((aligned(64))) DEVICE;
+
+/**
+ * @brief ワーカーが1つのデバイスを送受信するための状態
+ * @details ワーカーごとに別のソケットを持ち, PACKET_FANOUTで受信フレームを分配する
+ *
+ */
+typedef struct
+{
+    int soc;        // 受信用ソケット(ワーカー0はDEVICE.socと同じ)
+    RX_RING rx;     // PACKET_MMAP受信リング(RX_MODE_RINGの場合のみ使用)
+    TX_RING tx;     // PACKET_MMAP送信リング(TX_MODE_RINGの場合のみ使用)
+    MMSG_BATCH rxm; // recvmmsg()の受信バッチ(RX_MODE_MMSGの場合のみ使用)
+    MMSG_BATCH txm; // sendmmsg()の送信バッチ(TX_MODE_MMSGの場合のみ使用)
+    XSK_PORT xsk;   // AF_XDPソケット(RX_MODE_XDPの場合のみ使用)
+    URING_BUFS rxb; // io_uringの受信バッファ(RX_MODE_URINGの場合のみ使用)
+} __attribute__((aligned(64))) IO_PORT;
+
+/**
+ * @brief スレッドごとのカウンタ. 所有するスレッドだけが更新する
+ *
+ */
+typedef struct
+{
+    unsigned long rxPackets;
+    unsigned long txPackets;
+    unsigned long gsoPackets; // 受信したGROのフレーム数(-Gの場合のみ)
+} STATS;
+
+// 転送遅延のヒストグラムの分解能: 2のべき乗の区間をさらに 2^LAT_SUB_BITS 等分する(誤差12.5%以内)
+#define LAT_SUB_BITS 3
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+/**
+ * @brief スレッドごとの転送遅延(ns)のヒストグラム. 所有するスレッドだけが更新する
+ *
+ */
+typedef struct
+{
+    unsigned long count[LAT_BUCKETS];
+} LAT_HIST;
+
+/**
+ * @brief 受信処理を行うワーカースレッド
+ * @details ワーカー同士が同じキャッシュラインを共有しないようにアラインする
+ *
+ */
+typedef struct
+{
+    int no;  // ワーカー番号
+    int cpu; // 割り当てるCPU番号(-1なら割り当てない)
+    pthread_t tid;
+    int efd; // 自分のポートの受信を待つepollディスクリプタ
+    IO_PORT port[DEVICE_MAX];
+    URING uring; // 送受信とタイマを待つio_uring(RX_MODE_URINGの場合のみ使用)
+    STATS stats;
+    LAT_HIST lat; // 転送遅延(-Lの場合のみ記録)
+    u_char *vnetBuf; // virtio_net_hdr付きの受信バッファ(-Gの場合のみ使用)
+} __attribute__((aligned(64))) WORKER;
 
 #define FLAG_FREE 0
 #define FLAG_OK 1
 #define FLAG_NG -1
 
+// パケットバッファ1つのデータ領域のサイズ(受信バッファと同じ)
+#define PKT_BUF_SIZE 2048
+
 /**
- * @brief 送信待ちデータの構造体. 双方向リストで管理する
+ * @brief 送信待ちデータの構造体
+ * @details パケットバッファプールのスロットの先頭に置き, dataは同じスロットのデータ領域を指す. @n
+ * nextはプールの空きリストでつなぐときだけ使う
  *
  */
 typedef struct _data_buf_
 {
     struct _data_buf_ *next;
-    struct _data_buf_ *before;
     time_t t;
     int size;
     unsigned char *data;
 } DATA_BUF;
 
+#define SEND_DROP_TAIL 0   // キューが一杯なら新しいパケットを捨てる
+#define SEND_DROP_OLDEST 1 // キューが一杯なら一番古いパケットを捨てて新しいパケットを入れる
+
 /**
  * @brief 送信待ちデータを管理するQUEUE
+ * @details 長さが固定のリングで, 追加する側(ワーカー)と取り出す側(BufferSend)はロックを取らずに head, tail だけで同期する. @n
+ * prodMutex はワーカー同士, consMutex は取り出す側同士(BufferSend, タイマ処理, 古いパケットの破棄)を排他する
  *
  */
 typedef struct
 {
-    DATA_BUF *top;
-    DATA_BUF *bottom;
-    unsigned long dno;
-    unsigned long inBucketSize;
-    pthread_mutex_t mutex;
+    DATA_BUF **ring;           // 送信待ちデータのリング(最初の追加時に確保し, エントリを再利用しても解放しない)
+    unsigned int head;         // 次に取り出す位置(取り出す側だけが進める)
+    unsigned int tail;         // 次に追加する位置(追加する側だけが進める)
+    unsigned long drops;       // 一杯で捨てたパケット数
+    pthread_mutex_t prodMutex;
+    pthread_mutex_t consMutex;
 } SEND_DATA;
 
 /**
  * @brief ARPテーブルのエントリ
+ * @details 転送処理が毎回参照する項目だけを持ち, 1エントリ32バイトで1キャッシュラインに2つ入る. @n
+ * 送信待ちキューやタイマの管理情報は IP2MAC_COLD に分け, 未解決時やタイマ処理でのみ参照する. @n
+ * rewrite は転送時にフレームの先頭へそのまま書き込むEthernetヘッダ(宛先MAC, 送信元MAC, タイプ)で, @n
+ * 宛先MACアドレス(hwaddr)はその先頭6バイトを共有する
  *
  */
 typedef struct
 {
-    int flag;
-    int deviceNo;
+    union
+    {
+        unsigned char rewrite[16]; // 書き換え用Ethernetヘッダ(14バイト+未使用2バイト)
+        unsigned char hwaddr[6];   // 宛先MACアドレス
+    } __attribute__((aligned(16)));
     in_addr_t addr;
-    unsigned char hwaddr[6];
-    time_t lastTime;
-    SEND_DATA sd;
+    signed char flag;
+    unsigned char used;     // 前回のタイマ処理以降に参照されたかどうか
+    unsigned char pending;  // 送信待ちデータがあるかどうか(IP2MAC_COLD.sdを見ずに判定するため)
+    unsigned char deviceNo;
+    int no;                 // エントリの添字(IP2MAC_COLDの参照に使う)
 } IP2MAC;
+
+/**
+ * @brief ARPテーブルのエントリのうち, 転送処理の通常経路では参照しない情報
+ *
+ */
+typedef struct
+{
+    SEND_DATA sd;
+    int scheduled;        // BufferSend()の処理待ちリストに入っているかどうか
+    int ref;              // Ip2Mac()などで得て, まだ Ip2MacRelease() していない参照の数
+    int readyNext;        // 処理待ちリストの次のエントリ(添字*DEVICE_MAX+デバイス番号, -1は終端)
+    int retry;            // ARPリクエストの再送回数
+    int timerNext;        // タイマホイールの同じスロットの次のエントリ(-1は終端)
+    int timerPrev;        // タイマホイールの同じスロットの前のエントリ(-1は先頭)
+    int timerSlot;        // 登録されているタイマホイールのスロット(-1は未登録)
+    unsigned long expire; // タイムアウトするティック
+} IP2MAC_COLD;
@@ -0,0 +1,196 @@
+/**
+ * @file checksumBench.c
+ * @brief チェックサム計算のマイクロベンチマーク
+ * @details 16ビットずつ足す従来の実装と, checksumSelect() で選べる各計算関数について, @n
+ * 20, 64, 1500, 9000バイトの checksum() 1回あたりの時間を測る. @n
+ * 計測の前に, 長さ0〜9000バイト, 開始位置のずれ0〜7バイトのすべてで従来の実装と同じ値になることを確かめる. @n
+ * make bench で実行する
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <pthread.h>
+#include "netutil.h"
+
+#define BENCH_BYTES (256 * 1024 * 1024) // 1回の計測で処理するバイト数
+#define BENCH_MAX_LEN 9000              // 検証と計測に使う最大の長さ
+
+/**
+ * @brief ルーター本体のデバッグ出力の代わり. 何も出力しない
+ *
+ */
+int DebugPrintf(char *fmt, ...)
+{
+    return 0;
+}
+
+/**
+ * @brief ルーター本体のperror()の代わり
+ *
+ */
+int DebugPerror(char *msg)
+{
+    perror(msg);
+    return 0;
+}
+
+/**
+ * @brief ルーター本体のデバイス送信の代わり. 何も送信しない
+ *
+ */
+int DeviceWrite(int deviceNo, u_char *data, int size)
+{
+    return size;
+}
+
+/**
+ * @brief 従来のチェックサム計算関数(16ビットずつ加算). 検証の基準と計測の比較に使う
+ *
+ * @param [in] data : データ
+ * @param [in] len : データ長
+ * @return チェックサム
+ */
+static u_int16_t checksumRef(u_char *data, int len)
+{
+    register u_int32_t sum;
+    register u_int16_t *ptr;
+    register int c;
+
+    sum = 0;
+    ptr = (u_int16_t *)data;
+    for (c = len; c > 1; c -= 2)
+    {
+        sum += (*ptr);
+        if (sum & 0x80000000)
+        {
+            sum = (sum & 0xFFFF) + (sum >> 16);
+        }
+        ptr++;
+    }
+    if (c == 1)
+    {
+        u_int16_t val;
+        val = 0;
+        memcpy(&val, ptr, sizeof(u_int8_t));
+        sum += val;
+    }
+    while (sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+/**
+ * @brief 選ばれている計算関数が従来の実装と同じ値を返すか確かめる
+ * @details checksum2() は分割位置を変えながら checksum() と比べる
+ *
+ * @param [in] buf : 乱数で埋めたバッファ(BENCH_MAX_LEN + 8バイト以上)
+ * @return 一致しなかった数
+ */
+static int Verify(u_char *buf)
+{
+    int len, off, split, bad = 0;
+
+    for (off = 0; off < 8; off++)
+    {
+        for (len = 0; len <= BENCH_MAX_LEN; len++)
+        {
+            if (checksum(buf + off, len) != checksumRef(buf + off, len))
+            {
+                bad++;
+            }
+        }
+    }
+    for (len = 0; len <= 1500; len++)
+    {
+        for (split = 0; split <= len; split += 7)
+        {
+            if (checksum2(buf, split, buf + split, len - split) != checksumRef(buf, len))
+            {
+                bad++;
+            }
+        }
+    }
+    return bad;
+}
+
+/**
+ * @brief 1回あたりの時間を測る
+ *
+ * @param [in] buf : データ
+ * @param [in] len : データ長
+ * @param [in] ref : 1なら従来の実装, 0なら checksum() を測る
+ * @return 1回あたりの時間(ns)
+ */
+static double Measure(u_char *buf, int len, int ref)
+{
+    struct timespec start, end;
+    int i, n = BENCH_BYTES / len;
+    volatile u_int16_t sink = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i++)
+    {
+        sink += ref ? checksumRef(buf, len) : checksum(buf, len);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / n;
+}
+
+int main(int argc, char *argv[])
+{
+    static int lens[] = {20, 64, 1500, 9000};
+    static u_char buf[BENCH_MAX_LEN + 8];
+    int i, k, n, fail = 0;
+
+    srand(1);
+    for (i = 0; i < sizeof(buf); i++)
+    {
+        buf[i] = rand();
+    }
+
+    printf("%-8s", "kernel");
+    for (n = 0; n < 4; n++)
+    {
+        printf(" %8dB", lens[n]);
+    }
+    printf("   (ns/call)\n");
+
+    printf("%-8s", "ref16");
+    for (n = 0; n < 4; n++)
+    {
+        printf(" %9.1f", Measure(buf, lens[n], 1));
+    }
+    printf("\n");
+
+    for (k = CSUM_KERNEL_SCALAR; k <= CSUM_KERNEL_AVX2; k++)
+    {
+        if (checksumSelect(k) == -1)
+        {
+            printf("%-8d not supported\n", k);
+            continue;
+        }
+        if ((i = Verify(buf)) != 0)
+        {
+            printf("%-8s MISMATCH %d\n", checksumKernelName(), i);
+            fail = 1;
+            continue;
+        }
+        printf("%-8s", checksumKernelName());
+        for (n = 0; n < 4; n++)
+        {
+            printf(" %9.1f", Measure(buf, lens[n], 0));
+        }
+        printf("\n");
+    }
+
+    return fail;
+}
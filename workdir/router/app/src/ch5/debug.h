@@ -0,0 +1,36 @@
+/**
+ * @file debug.h
+ * @brief デバッグ出力のレベル
+ * @details DEBUG_LEVEL_MAX より詳しいレベルの出力はコンパイル時に取り除かれる(make DEBUG_LEVEL_MAX=0 で全て除く). @n
+ * 残った出力も実行時の DebugLevel を先に調べ, 出力するときだけ引数を評価する. @n
+ * そのため出力しないときは in_addr_t2str() などの文字列化も行われない
+ *
+ */
+
+#define DEBUG_LEVEL_NONE 0 // 出力しない
+#define DEBUG_LEVEL_INFO 1 // 起動・終了, エラー, ARPテーブルの変化
+#define DEBUG_LEVEL_PKT 2  // パケットごとの処理
+
+#ifndef DEBUG_LEVEL_MAX
+#define DEBUG_LEVEL_MAX DEBUG_LEVEL_PKT // コンパイル時に残す最も詳しいレベル
+#endif
+
+extern int DebugLevel; // 実行時のデバッグ出力レベル
+extern int DebugPrintf(char *fmt, ...);
+
+/**
+ * @brief レベルを指定したデバッグ出力
+ * @details 条件が偽なら引数は評価されない. 出力しない場合を分岐予測の既定とする
+ *
+ */
+#define DebugLog(level, ...)                                                           \
+    do                                                                                 \
+    {                                                                                  \
+        if ((level) <= DEBUG_LEVEL_MAX && __builtin_expect((level) <= DebugLevel, 0)) \
+        {                                                                              \
+            DebugPrintf(__VA_ARGS__);                                                  \
+        }                                                                              \
+    } while (0)
+
+#define DebugInfo(...) DebugLog(DEBUG_LEVEL_INFO, __VA_ARGS__)
+#define DebugPkt(...) DebugLog(DEBUG_LEVEL_PKT, __VA_ARGS__)
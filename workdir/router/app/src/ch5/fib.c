@@ -0,0 +1,390 @@
+/**
+ * @file fib.c
+ * @brief 経路表(最長一致検索)
+ * @details DIR-24-8方式で, 宛先の上位24ビットで引く表(tbl24)と, /25より長い経路がある /24 だけに @n
+ * 下位8ビットで引く表(tbl8)を持つ. 1回の検索で表を引くのは最大2回である. @n
+ * 表の要素は16ビットで, 最上位ビットが立っていれば残りはtbl8のグループ番号, @n
+ * そうでなければ次ホップ番号(0は経路なし)を表す. @n
+ * 経路は FibAdd() で登録しておき, FibBuild() で短いプレフィックスから順に書き込んで表を作る. @n
+ * 作った表はポインタの差し替えで公開し, 古い表は RcuSynchronize() で読み手がいなくなってから解放する. @n
+ * そのため転送中でも, 検索側はロックを取らずに経路を入れ替えられる
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "fib.h"
+#include "rcu.h"
+
+extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+
+#define FIB_TBL24_SIZE (1 << 24) // tbl24の要素数
+#define FIB_TBL8_SIZE 256        // tbl8の1グループの要素数
+#define FIB_EXT 0x8000           // tbl24の要素がtbl8のグループ番号であることを示すビット
+#define FIB_INDEX_MAX 0x7FFF     // 次ホップ番号, tbl8のグループ番号の最大値
+#define FIB_ROUTE_INIT 1024      // 登録待ちの経路配列の初期サイズ
+
+/**
+ * @brief 登録された経路
+ *
+ */
+typedef struct
+{
+    u_int32_t prefix; // プレフィックス(ホストバイトオーダー)
+    int len;          // プレフィックス長
+    int nh;           // 次ホップ番号
+    int no;           // 登録順(同じ経路は後から登録したものを優先する)
+} FIB_ROUTE;
+
+/**
+ * @brief 経路表. 公開後は書き換えない
+ *
+ */
+typedef struct
+{
+    u_int16_t *tbl24;
+    u_int16_t *tbl8;                   // FIB_INDEX_MAX グループ分の領域を予約し, 使う分だけ触る
+    int tbl8No;                        // 使用中のtbl8のグループ数(グループ0は使わない)
+    FIB_NEXTHOP nh[FIB_INDEX_MAX + 1]; // 次ホップ(0番は使わない)
+} FIB_TABLE;
+
+static FIB_TABLE *FibCur; // 検索に使う経路表
+
+/**
+ * @brief 次に作る経路表に登録された経路
+ *
+ */
+static struct
+{
+    FIB_NEXTHOP nh[FIB_INDEX_MAX + 1]; // 次ホップ(0番は使わない)
+    int nhNo;                          // 使用中の次ホップ数
+    FIB_ROUTE *routes;                 // 登録された経路
+    int routeNo, routeSize;
+} Fib;
+
+/**
+ * @brief 経路の登録を始める
+ * @details 前回 FibBuild() までに登録した経路は消える. 検索に使っている経路表はそのまま
+ *
+ * @return 0 : 正常終了
+ */
+int FibInit()
+{
+    Fib.nhNo = 1;
+    Fib.routeNo = 0;
+    return 0;
+}
+
+/**
+ * @brief 経路表の確保
+ * @details 表はmmap()で確保し, 実際に書き込んだページだけがメモリを使う
+ *
+ * @return 経路表, NULL : 異常終了
+ */
+static FIB_TABLE *FibTableAlloc()
+{
+    FIB_TABLE *t;
+
+    if ((t = (FIB_TABLE *)malloc(sizeof(FIB_TABLE))) == NULL)
+    {
+        DebugPerror("malloc");
+        return NULL;
+    }
+    t->tbl24 = mmap(NULL, FIB_TBL24_SIZE * sizeof(u_int16_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (t->tbl24 == MAP_FAILED)
+    {
+        DebugPerror("mmap");
+        free(t);
+        return NULL;
+    }
+    t->tbl8 = mmap(NULL, (FIB_INDEX_MAX + 1) * FIB_TBL8_SIZE * sizeof(u_int16_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (t->tbl8 == MAP_FAILED)
+    {
+        DebugPerror("mmap");
+        munmap(t->tbl24, FIB_TBL24_SIZE * sizeof(u_int16_t));
+        free(t);
+        return NULL;
+    }
+    t->tbl8No = 1;
+    return t;
+}
+
+/**
+ * @brief 経路表の解放
+ *
+ * @param[in] t : 経路表
+ */
+static void FibTableFree(FIB_TABLE *t)
+{
+    munmap(t->tbl24, FIB_TBL24_SIZE * sizeof(u_int16_t));
+    munmap(t->tbl8, (FIB_INDEX_MAX + 1) * FIB_TBL8_SIZE * sizeof(u_int16_t));
+    free(t);
+}
+
+/**
+ * @brief 次ホップ番号を得る. 同じ次ホップが登録済みならその番号を返す
+ *
+ * @param[in] gw : 次ホップのIPアドレス
+ * @param[in] deviceNo : 送信先デバイス番号
+ * @return 次ホップ番号, -1 : 異常終了
+ */
+static int FibNexthop(in_addr_t gw, int deviceNo)
+{
+    int i;
+
+    for (i = 1; i < Fib.nhNo; i++)
+    {
+        if (Fib.nh[i].gw == gw && Fib.nh[i].deviceNo == deviceNo)
+        {
+            return i;
+        }
+    }
+    if (Fib.nhNo > FIB_INDEX_MAX)
+    {
+        DebugPrintf("FibNexthop:too many nexthops\n");
+        return -1;
+    }
+    Fib.nh[Fib.nhNo].gw = gw;
+    Fib.nh[Fib.nhNo].deviceNo = deviceNo;
+    return Fib.nhNo++;
+}
+
+/**
+ * @brief 経路を登録する
+ * @details 表に反映するのは FibBuild() を呼んだとき
+ *
+ * @param[in] prefix : プレフィックス
+ * @param[in] len : プレフィックス長(0〜32)
+ * @param[in] gw : 次ホップのIPアドレス(0なら直接接続)
+ * @param[in] deviceNo : 送信先デバイス番号
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int FibAdd(in_addr_t prefix, int len, in_addr_t gw, int deviceNo)
+{
+    FIB_ROUTE *r;
+    int nh;
+
+    if (len < 0 || len > 32)
+    {
+        DebugPrintf("FibAdd:invalid prefix length(%d)\n", len);
+        return -1;
+    }
+    if ((nh = FibNexthop(gw, deviceNo)) == -1)
+    {
+        return -1;
+    }
+    if (Fib.routeNo == Fib.routeSize)
+    {
+        int size = Fib.routeSize ? Fib.routeSize * 2 : FIB_ROUTE_INIT;
+        if ((r = (FIB_ROUTE *)realloc(Fib.routes, size * sizeof(FIB_ROUTE))) == NULL)
+        {
+            DebugPerror("realloc");
+            return -1;
+        }
+        Fib.routes = r;
+        Fib.routeSize = size;
+    }
+    r = &Fib.routes[Fib.routeNo];
+    r->len = len;
+    r->prefix = len ? ntohl(prefix) & (0xFFFFFFFF << (32 - len)) : 0;
+    r->nh = nh;
+    r->no = Fib.routeNo++;
+    return 0;
+}
+
+/**
+ * @brief 経路ファイルを読み込んで登録する
+ * @details 1行に「プレフィックス/長さ 次ホップ デバイス名」を書く. @n
+ * 次ホップが「-」なら直接接続の経路とする. 「#」以降はコメント. 例: @n
+ * 10.0.1.0/24 - eth1 @n
+ * 0.0.0.0/0 10.0.1.1 eth1
+ *
+ * @param[in] path : 経路ファイル名
+ * @param[in] devices : デバイス名の配列(添字がデバイス番号)
+ * @param[in] deviceNum : デバイス数
+ * @return 登録した経路数, -1 : 異常終了
+ */
+int FibLoad(char *path, char *devices[], int deviceNum)
+{
+    FILE *fp;
+    char line[256], prefix[64], gw[64], dev[64], *p, *end;
+    struct in_addr addr, gwAddr;
+    int lineNo = 0, n = 0, len, i;
+
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        DebugPerror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineNo++;
+        if ((p = strchr(line, '#')) != NULL)
+        {
+            *p = '\0';
+        }
+        if (sscanf(line, "%63s %63s %63s", prefix, gw, dev) != 3)
+        {
+            continue;
+        }
+        len = 32;
+        if ((p = strchr(prefix, '/')) != NULL)
+        {
+            *p = '\0';
+            len = (int)strtol(p + 1, &end, 10);
+            if (end == p + 1 || *end != '\0' || len < 0 || len > 32)
+            { // 長さが空, 数字以外を含む, または範囲外
+                DebugPrintf("FibLoad:%s:%d: invalid prefix length\n", path, lineNo);
+                fclose(fp);
+                return -1;
+            }
+        }
+        gwAddr.s_addr = 0;
+        if (inet_aton(prefix, &addr) == 0 || (strcmp(gw, "-") != 0 && inet_aton(gw, &gwAddr) == 0))
+        {
+            DebugPrintf("FibLoad:%s:%d: invalid address\n", path, lineNo);
+            fclose(fp);
+            return -1;
+        }
+        for (i = 0; i < deviceNum; i++)
+        {
+            if (strcmp(dev, devices[i]) == 0)
+            {
+                break;
+            }
+        }
+        if (i == deviceNum)
+        {
+            DebugPrintf("FibLoad:%s:%d: unknown device %s\n", path, lineNo, dev);
+            fclose(fp);
+            return -1;
+        }
+        if (FibAdd(addr.s_addr, len, gwAddr.s_addr, i) == -1)
+        {
+            DebugPrintf("FibLoad:%s:%d: cannot add route\n", path, lineNo);
+            fclose(fp);
+            return -1;
+        }
+        n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+/**
+ * @brief 経路の並べ替え用比較関数(プレフィックス長, 登録順)
+ *
+ */
+static int FibRouteCmp(const void *a, const void *b)
+{
+    const FIB_ROUTE *ra = (const FIB_ROUTE *)a, *rb = (const FIB_ROUTE *)b;
+
+    if (ra->len != rb->len)
+    {
+        return ra->len - rb->len;
+    }
+    return ra->no - rb->no;
+}
+
+/**
+ * @brief 登録された経路から表を作る
+ * @details プレフィックスの短い経路から順に, 範囲内の要素を上書きしていく. @n
+ * /25以上の経路は, その /24 のtbl8グループを(なければ作って)上書きする. @n
+ * グループを作るときは, それまでのtbl24の値で埋めておく. @n
+ * 作った表を公開した後, 読み手が古い表を参照し終わるのを待って解放する. 表が作れなかった場合は古い表を使い続ける
+ *
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int FibBuild()
+{
+    FIB_TABLE *t, *old;
+    FIB_ROUTE *r;
+    u_int16_t *ent;
+    u_int32_t i24, g, n;
+    int i;
+
+    if ((t = FibTableAlloc()) == NULL)
+    {
+        return -1;
+    }
+    memcpy(t->nh, Fib.nh, Fib.nhNo * sizeof(FIB_NEXTHOP));
+    qsort(Fib.routes, Fib.routeNo, sizeof(FIB_ROUTE), FibRouteCmp);
+
+    for (i = 0; i < Fib.routeNo; i++)
+    {
+        r = &Fib.routes[i];
+        if (r->len <= 24)
+        {
+            ent = &t->tbl24[r->prefix >> 8];
+            n = 1 << (24 - r->len);
+        }
+        else
+        {
+            i24 = r->prefix >> 8;
+            if (!(t->tbl24[i24] & FIB_EXT))
+            {
+                if (t->tbl8No > FIB_INDEX_MAX)
+                {
+                    DebugPrintf("FibBuild:too many tbl8 groups\n");
+                    FibTableFree(t);
+                    return -1;
+                }
+                g = t->tbl8No++;
+                for (n = 0; n < FIB_TBL8_SIZE; n++)
+                {
+                    t->tbl8[g * FIB_TBL8_SIZE + n] = t->tbl24[i24];
+                }
+                t->tbl24[i24] = FIB_EXT | g;
+            }
+            g = t->tbl24[i24] & FIB_INDEX_MAX;
+            ent = &t->tbl8[g * FIB_TBL8_SIZE + (r->prefix & 0xFF)];
+            n = 1 << (32 - r->len);
+        }
+        while (n-- > 0)
+        {
+            *ent++ = r->nh;
+        }
+    }
+    DebugPrintf("FibBuild:%d routes, %d nexthops, %d tbl8 groups\n", Fib.routeNo, Fib.nhNo - 1, t->tbl8No - 1);
+
+    old = __atomic_exchange_n(&FibCur, t, __ATOMIC_SEQ_CST);
+    if (old != NULL)
+    {
+        RcuSynchronize();
+        FibTableFree(old);
+    }
+    return 0;
+}
+
+/**
+ * @brief 宛先IPアドレスの経路を検索する(最長一致)
+ *
+ * @param[in] daddr : 宛先IPアドレス
+ * @return 転送先(次に RcuOffline() を呼ぶまで有効), NULL : 経路なし
+ */
+FIB_NEXTHOP *FibLookup(in_addr_t daddr)
+{
+    FIB_TABLE *t = __atomic_load_n(&FibCur, __ATOMIC_ACQUIRE);
+    u_int32_t addr = ntohl(daddr);
+    u_int16_t ent;
+
+    if (t == NULL)
+    {
+        return NULL;
+    }
+    ent = t->tbl24[addr >> 8];
+    if (ent & FIB_EXT)
+    {
+        ent = t->tbl8[(ent & FIB_INDEX_MAX) * FIB_TBL8_SIZE + (addr & 0xFF)];
+    }
+    if (ent == 0)
+    {
+        return NULL;
+    }
+    return &t->nh[ent];
+}
@@ -0,0 +1,21 @@
+/**
+ * @file fib.h
+ * @brief 経路表(最長一致検索)
+ *
+ */
+
+/**
+ * @brief 経路の転送先
+ *
+ */
+typedef struct
+{
+    in_addr_t gw; // 次ホップのIPアドレス(0なら直接接続で, 宛先に直接送る)
+    int deviceNo; // 送信先デバイス番号
+} FIB_NEXTHOP;
+
+int FibInit();
+int FibAdd(in_addr_t prefix, int len, in_addr_t gw, int deviceNo);
+int FibLoad(char *path, char *devices[], int deviceNum);
+int FibBuild();
+FIB_NEXTHOP *FibLookup(in_addr_t daddr);
@@ -0,0 +1,256 @@
+/**
+ * @file fibBench.c
+ * @brief 経路表検索のマイクロベンチマーク
+ * @details インターネットの経路表に近いプレフィックス長の分布で約90万経路を登録し, @n
+ * ランダムな100万アドレスを FibLookup() したときの1回あたりの時間を測る. @n
+ * 計測の前に, プレフィックス長ごとの整列済み配列を長い順に二分探索する単純な実装と結果が一致することを確かめる. @n
+ * make bench で実行する
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "fib.h"
+
+#define BENCH_ROUTES 900000   // 登録する経路数
+#define BENCH_LOOKUPS 1000000 // 検索するアドレス数
+#define BENCH_NEXTHOPS 64     // 次ホップの種類
+#define BENCH_REPEAT 10       // 計測の繰り返し回数
+
+/**
+ * @brief ルーター本体のデバッグ出力の代わり. 何も出力しない
+ *
+ */
+int DebugPrintf(char *fmt, ...)
+{
+    return 0;
+}
+
+/**
+ * @brief ルーター本体のperror()の代わり
+ *
+ */
+int DebugPerror(char *msg)
+{
+    perror(msg);
+    return 0;
+}
+
+/**
+ * @brief 検証用の経路
+ *
+ */
+typedef struct
+{
+    u_int32_t prefix; // プレフィックス(ホストバイトオーダー)
+    int nh;           // 次ホップ番号(gwの下位ビット)
+    int no;           // 登録順
+} REF_ROUTE;
+
+static REF_ROUTE *Ref[33]; // プレフィックス長ごとの経路
+static int RefNo[33];
+
+/**
+ * @brief 検証用の並べ替え用比較関数(プレフィックス, 登録順)
+ *
+ */
+static int RefCmp(const void *a, const void *b)
+{
+    const REF_ROUTE *ra = (const REF_ROUTE *)a, *rb = (const REF_ROUTE *)b;
+
+    if (ra->prefix != rb->prefix)
+    {
+        return ra->prefix < rb->prefix ? -1 : 1;
+    }
+    return ra->no - rb->no;
+}
+
+/**
+ * @brief 単純な実装での最長一致検索
+ *
+ * @param[in] addr : 宛先IPアドレス(ホストバイトオーダー)
+ * @return 次ホップ番号, -1 : 経路なし
+ */
+static int RefLookup(u_int32_t addr)
+{
+    int len, lo, hi, mid;
+    u_int32_t key;
+
+    for (len = 32; len >= 0; len--)
+    {
+        key = len ? addr & (0xFFFFFFFF << (32 - len)) : 0;
+        lo = 0;
+        hi = RefNo[len];
+        while (lo < hi)
+        {
+            mid = (lo + hi) / 2;
+            if (Ref[len][mid].prefix < key)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        if (lo < RefNo[len] && Ref[len][lo].prefix == key)
+        { // 同じ経路が複数あれば最後に登録したもの
+            while (lo + 1 < RefNo[len] && Ref[len][lo + 1].prefix == key)
+            {
+                lo++;
+            }
+            return Ref[len][lo].nh;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief プレフィックス長を経路表に近い分布で選ぶ
+ *
+ * @return プレフィックス長
+ */
+static int RandomLen()
+{
+    int r = rand() % 1000;
+
+    if (r < 580)
+    {
+        return 24;
+    }
+    if (r < 680)
+    {
+        return 23;
+    }
+    if (r < 770)
+    {
+        return 22;
+    }
+    if (r < 830)
+    {
+        return 21;
+    }
+    if (r < 870)
+    {
+        return 20;
+    }
+    if (r < 990)
+    {
+        return 8 + rand() % 12; // /8〜/19
+    }
+    return 25 + rand() % 8; // /25〜/32
+}
+
+/**
+ * @brief 32ビットの乱数
+ *
+ */
+static u_int32_t Random32()
+{
+    return ((u_int32_t)rand() << 16) ^ (u_int32_t)rand();
+}
+
+int main(int argc, char *argv[])
+{
+    static int size[33];
+    u_int32_t *addrs, prefix;
+    struct timespec start, end;
+    FIB_NEXTHOP *nh;
+    unsigned long sum = 0;
+    int i, k, len, want, got, bad = 0;
+    double ns;
+
+    srand(1);
+    if (FibInit() == -1)
+    {
+        return -1;
+    }
+    for (len = 0; len <= 32; len++)
+    {
+        size[len] = 1024;
+        Ref[len] = (REF_ROUTE *)malloc(size[len] * sizeof(REF_ROUTE));
+    }
+    addrs = (u_int32_t *)malloc(BENCH_LOOKUPS * sizeof(u_int32_t));
+
+    // デフォルト経路と, ランダムな経路を登録
+    FibAdd(0, 0, htonl(0xC0A80000), 0);
+    Ref[0][RefNo[0]++] = (REF_ROUTE){0, 0, 0};
+    for (i = 1; i < BENCH_ROUTES; i++)
+    {
+        len = RandomLen();
+        prefix = Random32() & (0xFFFFFFFF << (32 - len));
+        k = rand() % BENCH_NEXTHOPS;
+        if (FibAdd(htonl(prefix), len, htonl(0xC0A80000 + k), k % 2) == -1)
+        {
+            printf("FibAdd failed\n");
+            return -1;
+        }
+        if (RefNo[len] == size[len])
+        {
+            size[len] *= 2;
+            Ref[len] = (REF_ROUTE *)realloc(Ref[len], size[len] * sizeof(REF_ROUTE));
+        }
+        Ref[len][RefNo[len]++] = (REF_ROUTE){prefix, k, i};
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (FibBuild() == -1)
+    {
+        printf("FibBuild failed\n");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("routes=%d build=%.1fms\n", BENCH_ROUTES, ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / 1e6);
+    for (len = 0; len <= 32; len++)
+    {
+        qsort(Ref[len], RefNo[len], sizeof(REF_ROUTE), RefCmp);
+    }
+
+    // 半分は一様な乱数, 半分は登録した経路の範囲内のアドレス
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        if (i % 2)
+        {
+            addrs[i] = Random32();
+        }
+        else
+        {
+            len = RandomLen();
+            k = rand() % RefNo[len];
+            addrs[i] = Ref[len][k].prefix | (Random32() & (len ? ~(0xFFFFFFFF << (32 - len)) : 0xFFFFFFFF));
+        }
+        addrs[i] = htonl(addrs[i]);
+    }
+
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        want = RefLookup(ntohl(addrs[i]));
+        nh = FibLookup(addrs[i]);
+        got = nh ? (int)(ntohl(nh->gw) - 0xC0A80000) : -1;
+        if (want != got)
+        {
+            bad++;
+        }
+    }
+    printf("verify: %d lookups, %d mismatches\n", BENCH_LOOKUPS, bad);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (k = 0; k < BENCH_REPEAT; k++)
+    {
+        for (i = 0; i < BENCH_LOOKUPS; i++)
+        {
+            nh = FibLookup(addrs[i]);
+            sum += nh->deviceNo;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / ((double)BENCH_LOOKUPS * BENCH_REPEAT);
+    printf("FibLookup: %.1f ns/lookup (%.1f Mlookups/s)\n", ns, 1e3 / ns);
+    // 検索結果を使い, 最適化で検索ループが消えないようにする
+    fprintf(stderr, "checksum=%lu\n", sum);
+
+    return bad != 0;
+}
@@ -11,165 +11,819 @@
 #include <time.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <net/ethernet.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "netutil.h"
 #include "base.h"
 #include "ip2mac.h"
 #include "sendBuf.h"
+#include "debug.h"
+#include "trace.h"
 
 extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+extern int DeviceWrite(int deviceNo, u_char *data, int size);
+extern int DeviceFlush(int deviceNo);
 
 // ARPキャッシュのタイムアウト
 #define IP2MAC_TIMEOUT_SEC 60
 // ARP NGのタイムアウト
 #define IP2MAC_NG_TIMEOUT_SEC 1
 
+// ARP NGのエントリで送信待ちデータがある場合の, ARPリクエストの再送回数
+#define IP2MAC_NG_RETRY 3
+// ハッシュ表の初期サイズ(2のべき乗)
+#define IP2MAC_HASH_INIT_SIZE 2048
+// 1セグメントのエントリ数(2のべき乗)
+#define IP2MAC_SEG_SIZE 1024
+// セグメントの最大数(デバイスごとに最大 IP2MAC_SEG_SIZE * IP2MAC_SEG_MAX エントリ)
+#define IP2MAC_SEG_MAX 1024
+
+// タイマホイールの1ティック(ms). Router()のpoll()のタイムアウトに合わせる
+#define TIMER_TICK_MS 100
+// 1段目のスロット数(1ティック単位, 2のべき乗)
+#define TIMER_WHEEL0_SIZE 256
+// 2段目のスロット数(TIMER_WHEEL0_SIZEティック単位, 2のべき乗)
+#define TIMER_WHEEL1_SIZE 64
+// タイマに登録できる最大ティック数
+#define TIMER_MAX_TICKS (TIMER_WHEEL0_SIZE * TIMER_WHEEL1_SIZE - 1)
+
+/**
+ * @brief ハッシュ表の要素
+ * @details IPアドレスも持たせ, 検索中の比較でエントリ本体を参照しないようにする
+ *
+ */
+typedef struct
+{
+    in_addr_t addr;
+    int no; // エントリの添字. -1 は空き
+} IP2MAC_SLOT;
+
 /**
  * @brief ARPテーブルのエントリ
+ * @details エントリは IP2MAC_SEG_SIZE 個ずつのセグメントに格納し, 添字で参照する. @n
+ * 転送処理が参照する IP2MAC と, 送信待ちキューやタイマ情報の IP2MAC_COLD は別のセグメントに置く. @n
+ * セグメントは一度確保したら移動も解放もしないので, 別スレッドが保持しているエントリのアドレスは常に有効である. @n
+ * IPアドレスからエントリの添字へはハッシュ表(オープンアドレス法)で検索する. @n
+ * タイムアウトは2段のタイマホイールで管理する. スロットはエントリの添字でつないだ双方向リストで, 先頭の添字を持つ. @n
+ * 複数のワーカーから検索されるため rwlock で保護し, 検索は読み込みロックだけで行う. @n
+ * 検索で得たエントリはロックを外した後も使うので, IP2MAC_COLD.ref で参照を数え, 参照中は解放しない
  *
  */
 struct
 {
-    IP2MAC *data; // エントリの先頭アドレス
-    int size;
-    int no; // 現在のエントリ数
-} Ip2Macs[2];
+    IP2MAC *seg[IP2MAC_SEG_MAX];       // セグメントの先頭アドレス
+    IP2MAC_COLD *cold[IP2MAC_SEG_MAX]; // IP2MAC_COLDのセグメントの先頭アドレス
+    int size;           // 確保済みのエントリ数
+    int no;             // 使用したことのあるエントリ数
+    IP2MAC_SLOT *hash;  // ハッシュ表
+    int hashMask;   // ハッシュ表のサイズ - 1
+    int hashNo;     // ハッシュ表の登録数
+    int *freeStack; // 解放したエントリの添字
+    int freeNo;     // 解放したエントリ数
+    int wheel[TIMER_WHEEL0_SIZE + TIMER_WHEEL1_SIZE]; // タイマホイールの各スロットの先頭
+    unsigned long tick;                                 // タイマホイールが処理済みのティック
+    pthread_rwlock_t lock;
+} __attribute__((aligned(64))) Ip2Macs[DEVICE_MAX] = {[0 ... DEVICE_MAX - 1] = {.lock = PTHREAD_RWLOCK_INITIALIZER}};
 
-extern DEVICE Device[2];
-extern int ArpSoc[2];
+extern DEVICE Device[DEVICE_MAX];
+extern int DeviceNum;
 extern int EndFlag;
 
 /**
- * @brief ARPテーブルの検索
+ * @brief 添字からエントリのアドレスを得る
  *
- * @param deviceNo
- * @param addr
- * @param hwaddr
- * @return IP2MAC*
+ * @param deviceNo : デバイス番号
+ * @param no : エントリの添字
+ * @return エントリのアドレス
  */
-IP2MAC *Ip2MacSearch(int deviceNo, in_addr_t addr, u_char *hwaddr)
+static inline IP2MAC *Ip2MacEntry(int deviceNo, int no)
+{
+    return &Ip2Macs[deviceNo].seg[no / IP2MAC_SEG_SIZE][no % IP2MAC_SEG_SIZE];
+}
+
+/**
+ * @brief 添字からエントリの IP2MAC_COLD のアドレスを得る
+ *
+ * @param deviceNo : デバイス番号
+ * @param no : エントリの添字
+ * @return IP2MAC_COLDのアドレス
+ */
+static inline IP2MAC_COLD *Ip2MacCold(int deviceNo, int no)
+{
+    return &Ip2Macs[deviceNo].cold[no / IP2MAC_SEG_SIZE][no % IP2MAC_SEG_SIZE];
+}
+
+/**
+ * @brief エントリの参照を得る(ロックは呼び出し側で取得する)
+ * @details 参照はロックを取得している間だけ増やすので, 書き込みロック中に ref が0なら誰も参照していない
+ *
+ * @param deviceNo : デバイス番号
+ * @param no : エントリの添字
+ * @return エントリのアドレス
+ */
+static inline IP2MAC *Ip2MacHold(int deviceNo, int no)
+{
+    __atomic_add_fetch(&Ip2MacCold(deviceNo, no)->ref, 1, __ATOMIC_RELAXED);
+    return Ip2MacEntry(deviceNo, no);
+}
+
+/**
+ * @brief エントリの送信待ちキューを得る
+ * @details セグメントは移動しないので, ロックなしで参照してよい
+ *
+ * @param ip2mac : IP2MAC構造体
+ * @return 送信待ちキュー
+ */
+SEND_DATA *Ip2MacSendData(IP2MAC *ip2mac)
+{
+    return &Ip2MacCold(ip2mac->deviceNo, ip2mac->no)->sd;
+}
+
+/**
+ * @brief IPアドレスのハッシュ値
+ * @details 64ビットの積の上位32ビットを使う. 32ビットの積では65536を超えるハッシュ表で位置が偏る
+ *
+ * @param addr : IPアドレス
+ * @param mask : ハッシュ表のサイズ - 1
+ * @return ハッシュ表の位置
+ */
+static inline int Ip2MacHash(in_addr_t addr, int mask)
+{
+    return (int)(((u_int64_t)addr * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+/**
+ * @brief ハッシュ表からIPアドレスの位置を探す
+ *
+ * @param deviceNo : デバイス番号
+ * @param addr : IPアドレス
+ * @return ハッシュ表の位置, -1 : 見つからない
+ */
+static int Ip2MacHashFind(int deviceNo, in_addr_t addr)
+{
+    IP2MAC_SLOT *hash = Ip2Macs[deviceNo].hash;
+    int mask = Ip2Macs[deviceNo].hashMask;
+    int h;
+
+    if (hash == NULL)
+    {
+        return -1;
+    }
+    for (h = Ip2MacHash(addr, mask);; h = (h + 1) & mask)
+    {
+        if (hash[h].no == -1)
+        {
+            return -1;
+        }
+        if (hash[h].addr == addr)
+        {
+            return h;
+        }
+    }
+}
+
+/**
+ * @brief ハッシュ表の確保と再構築
+ * @details 登録済みのエントリを新しいサイズのハッシュ表に入れ直す. 確保できなければ元のハッシュ表をそのまま使う
+ *
+ * @param deviceNo : デバイス番号
+ * @param hashSize : 新しいハッシュ表のサイズ(2のべき乗)
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+static int Ip2MacHashResize(int deviceNo, int hashSize)
+{
+    IP2MAC_SLOT *old = Ip2Macs[deviceNo].hash;
+    IP2MAC_SLOT *hash;
+    int oldSize = (old == NULL) ? 0 : Ip2Macs[deviceNo].hashMask + 1;
+    int i, h, mask = hashSize - 1;
+
+    if ((hash = (IP2MAC_SLOT *)malloc(hashSize * sizeof(IP2MAC_SLOT))) == NULL)
+    {
+        DebugPerror("malloc");
+        return -1;
+    }
+    memset(hash, 0xFF, hashSize * sizeof(IP2MAC_SLOT));
+    Ip2Macs[deviceNo].hash = hash;
+    Ip2Macs[deviceNo].hashMask = mask;
+    for (i = 0; i < oldSize; i++)
+    {
+        if (old[i].no == -1)
+        {
+            continue;
+        }
+        for (h = Ip2MacHash(old[i].addr, mask); Ip2Macs[deviceNo].hash[h].no != -1; h = (h + 1) & mask)
+            ;
+        Ip2Macs[deviceNo].hash[h] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * @brief ハッシュ表にエントリを登録
+ * @details 登録数がサイズの半分を超える場合はハッシュ表を2倍に広げる. @n
+ * 広げられなくても元のハッシュ表は半分以下しか埋まっていないので, そのまま登録できる
+ *
+ * @param deviceNo : デバイス番号
+ * @param no : エントリの添字
+ * @return 0 : 正常終了, -1 : 異常終了(ハッシュ表がない)
+ */
+static int Ip2MacHashInsert(int deviceNo, int no)
+{
+    in_addr_t addr = Ip2MacEntry(deviceNo, no)->addr;
+    int h, mask;
+
+    if (Ip2Macs[deviceNo].hash == NULL && Ip2MacHashResize(deviceNo, IP2MAC_HASH_INIT_SIZE) == -1)
+    {
+        return -1;
+    }
+    else if ((Ip2Macs[deviceNo].hashNo + 1) * 2 > Ip2Macs[deviceNo].hashMask + 1)
+    {
+        Ip2MacHashResize(deviceNo, (Ip2Macs[deviceNo].hashMask + 1) * 2);
+    }
+    mask = Ip2Macs[deviceNo].hashMask;
+    for (h = Ip2MacHash(addr, mask); Ip2Macs[deviceNo].hash[h].no != -1; h = (h + 1) & mask)
+        ;
+    Ip2Macs[deviceNo].hash[h].addr = addr;
+    Ip2Macs[deviceNo].hash[h].no = no;
+    Ip2Macs[deviceNo].hashNo++;
+    return 0;
+}
+
+/**
+ * @brief ハッシュ表からエントリを削除
+ * @details 墓標を残さないよう, 後続のエントリを本来の位置に近づける(backward shift deletion)
+ *
+ * @param deviceNo : デバイス番号
+ * @param h : 削除するハッシュ表の位置
+ */
+static void Ip2MacHashDelete(int deviceNo, int h)
+{
+    IP2MAC_SLOT *hash = Ip2Macs[deviceNo].hash;
+    int mask = Ip2Macs[deviceNo].hashMask;
+    int i, home;
+
+    for (i = (h + 1) & mask; hash[i].no != -1; i = (i + 1) & mask)
+    {
+        home = Ip2MacHash(hash[i].addr, mask);
+        // home が (h, i] の範囲にない場合, i のエントリを h に移動できる
+        if (((i - home) & mask) >= ((i - h) & mask))
+        {
+            hash[h] = hash[i];
+            h = i;
+        }
+    }
+    hash[h].no = -1;
+    Ip2Macs[deviceNo].hashNo--;
+}
+
+/**
+ * @brief 現在のティック
+ *
+ * @return CLOCK_MONOTONICを TIMER_TICK_MS 単位にした値
+ */
+static unsigned long TimerNow()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * (1000 / TIMER_TICK_MS) + ts.tv_nsec / (TIMER_TICK_MS * 1000000L);
+}
+
+/**
+ * @brief タイマホイールの初期化
+ *
+ * @param deviceNo : デバイス番号
+ */
+static void TimerInit(int deviceNo)
+{
+    memset(Ip2Macs[deviceNo].wheel, 0xFF, sizeof(Ip2Macs[deviceNo].wheel));
+    Ip2Macs[deviceNo].tick = TimerNow();
+}
+
+/**
+ * @brief エントリをタイマホイールから外す
+ *
+ * @param deviceNo : デバイス番号
+ * @param no : エントリの添字
+ */
+static void TimerDel(int deviceNo, int no)
+{
+    IP2MAC_COLD *cold = Ip2MacCold(deviceNo, no);
+
+    if (cold->timerSlot == -1)
+    {
+        return;
+    }
+    if (cold->timerPrev == -1)
+    {
+        Ip2Macs[deviceNo].wheel[cold->timerSlot] = cold->timerNext;
+    }
+    else
+    {
+        Ip2MacCold(deviceNo, cold->timerPrev)->timerNext = cold->timerNext;
+    }
+    if (cold->timerNext != -1)
+    {
+        Ip2MacCold(deviceNo, cold->timerNext)->timerPrev = cold->timerPrev;
+    }
+    cold->timerSlot = cold->timerNext = cold->timerPrev = -1;
+}
+
+/**
+ * @brief エントリをタイマホイールに登録
+ * @details TIMER_WHEEL0_SIZE ティック以内にタイムアウトするものは1段目, それ以降は2段目のスロットに入れる. @n
+ * 2段目のスロットは1段目が一周するたびに1段目へ入れ直す
+ *
+ * @param deviceNo : デバイス番号
+ * @param no : エントリの添字
+ * @param expire : タイムアウトするティック
+ */
+static void TimerAdd(int deviceNo, int no, unsigned long expire)
+{
+    IP2MAC_COLD *cold = Ip2MacCold(deviceNo, no);
+    unsigned long now = Ip2Macs[deviceNo].tick;
+    int slot;
+
+    TimerDel(deviceNo, no);
+    if (expire < now)
+    {
+        expire = now;
+    }
+    else if (expire - now > TIMER_MAX_TICKS)
+    {
+        expire = now + TIMER_MAX_TICKS;
+    }
+    if (expire - now < TIMER_WHEEL0_SIZE)
+    {
+        slot = expire & (TIMER_WHEEL0_SIZE - 1);
+    }
+    else
+    {
+        slot = TIMER_WHEEL0_SIZE + ((expire / TIMER_WHEEL0_SIZE) & (TIMER_WHEEL1_SIZE - 1));
+    }
+    cold->expire = expire;
+    cold->timerSlot = slot;
+    cold->timerPrev = -1;
+    cold->timerNext = Ip2Macs[deviceNo].wheel[slot];
+    if (cold->timerNext != -1)
+    {
+        Ip2MacCold(deviceNo, cold->timerNext)->timerPrev = no;
+    }
+    Ip2Macs[deviceNo].wheel[slot] = no;
+}
+
+/**
+ * @brief スロットのリストを切り離す
+ *
+ * @param deviceNo : デバイス番号
+ * @param slot : スロット
+ * @return 切り離したリストの先頭の添字
+ */
+static int TimerTakeSlot(int deviceNo, int slot)
 {
-    register int i;
-    int freeNo, no;
-    time_t now;
+    int no, head = Ip2Macs[deviceNo].wheel[slot];
+
+    Ip2Macs[deviceNo].wheel[slot] = -1;
+    for (no = head; no != -1; no = Ip2MacCold(deviceNo, no)->timerNext)
+    {
+        Ip2MacCold(deviceNo, no)->timerSlot = -1;
+    }
+    return head;
+}
+
+/**
+ * @brief エントリを解放し, 送信待ちデータを破棄する
+ *
+ * @param deviceNo : デバイス番号
+ * @param no : エントリの添字
+ */
+static void Ip2MacFree(int deviceNo, int no)
+{
+    IP2MAC *ip2mac = Ip2MacEntry(deviceNo, no);
     char buf[80];
-    IP2MAC *ip2mac;
+    int h;
 
-    freeNo = -1;
-    now = time(NULL);
+    FreeSendData(ip2mac);
+    TimerDel(deviceNo, no);
+    if ((h = Ip2MacHashFind(deviceNo, ip2mac->addr)) != -1)
+    {
+        Ip2MacHashDelete(deviceNo, h);
+    }
+    ip2mac->flag = FLAG_FREE;
+    Ip2Macs[deviceNo].freeStack[Ip2Macs[deviceNo].freeNo++] = no;
+    DebugInfo("Ip2Mac FREE [%d] %s = %d\n", deviceNo, in_addr_t2str(ip2mac->addr, buf, sizeof(buf)), no);
+}
 
-    for (i = 0; i < Ip2Macs[deviceNo].no; i++)
-    { // ARPテーブルを検索
-        ip2mac = &Ip2Macs[deviceNo].data[i];
-        if (ip2mac->flag == FLAG_FREE)
-        { // 空きエントリ
-            if (freeNo == -1)
-            {
-                freeNo = i;
-            }
+/**
+ * @brief エントリの格納領域を広げる
+ * @details セグメント単位で追加するだけで, 既存のエントリは移動しない. @n
+ * 送信待ちキューのミューテックスはここで初期化し, エントリを再利用しても初期化し直さない
+ *
+ * @param deviceNo : デバイス番号
+ * @param size : 必要なエントリ数
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+static int Ip2MacGrow(int deviceNo, int size)
+{
+    int *freeStack;
+    int segNo, i;
+
+    if (size > IP2MAC_SEG_SIZE * IP2MAC_SEG_MAX)
+    {
+        DebugInfo("Ip2MacGrow:[%d] too many entries(%d)\n", deviceNo, size);
+        return -1;
+    }
+    freeStack = (int *)realloc(Ip2Macs[deviceNo].freeStack, ((size + IP2MAC_SEG_SIZE - 1) / IP2MAC_SEG_SIZE) * IP2MAC_SEG_SIZE * sizeof(int));
+    if (freeStack == NULL)
+    {
+        DebugPerror("realloc");
+        return -1;
+    }
+    Ip2Macs[deviceNo].freeStack = freeStack;
+    while (Ip2Macs[deviceNo].size < size)
+    {
+        segNo = Ip2Macs[deviceNo].size / IP2MAC_SEG_SIZE;
+        if ((Ip2Macs[deviceNo].seg[segNo] = (IP2MAC *)calloc(IP2MAC_SEG_SIZE, sizeof(IP2MAC))) == NULL)
+        {
+            DebugPerror("calloc");
+            return -1;
+        }
+        if ((Ip2Macs[deviceNo].cold[segNo] = (IP2MAC_COLD *)calloc(IP2MAC_SEG_SIZE, sizeof(IP2MAC_COLD))) == NULL)
+        {
+            DebugPerror("calloc");
+            free(Ip2Macs[deviceNo].seg[segNo]);
+            Ip2Macs[deviceNo].seg[segNo] = NULL;
+            return -1;
+        }
+        for (i = 0; i < IP2MAC_SEG_SIZE; i++)
+        {
+            InitSendDataMutex(&Ip2Macs[deviceNo].cold[segNo][i].sd);
+        }
+        Ip2Macs[deviceNo].size += IP2MAC_SEG_SIZE;
+    }
+    return 0;
+}
+
+/**
+ * @brief 空きエントリの確保
+ * @details 解放済みのエントリがあれば再利用し, なければ末尾に追加する
+ *
+ * @param deviceNo : デバイス番号
+ * @return エントリの添字, -1 : 異常終了
+ */
+static int Ip2MacAlloc(int deviceNo)
+{
+    int no;
+
+    if (Ip2Macs[deviceNo].freeNo > 0)
+    { // 空きエントリがある場合, そのエントリを使用
+        return Ip2Macs[deviceNo].freeStack[--Ip2Macs[deviceNo].freeNo];
+    }
+    // 空きエントリがない場合, エントリを追加
+    no = Ip2Macs[deviceNo].no;
+    if (no >= Ip2Macs[deviceNo].size && Ip2MacGrow(deviceNo, Ip2Macs[deviceNo].size + IP2MAC_SEG_SIZE) == -1)
+    {
+        return -1;
+    }
+    Ip2Macs[deviceNo].no++;
+    return no;
+}
+
+/**
+ * @brief BufferSend()の処理待ちリスト
+ * @details 送信待ちデータのあるエントリを IP2MAC_COLD.readyNext でつないだスタックで, @n
+ * 追加は複数のスレッドからCASで行い, BufferSend()はexchangeで丸ごと取り出す(MPSC). @n
+ * 同じエントリは IP2MAC_COLD.scheduled が立っている間は追加しないので, 重複の検査は不要. @n
+ * 空のリストに追加したときだけeventfdに書き込み, BufferSend()を起こす
+ *
+ */
+struct
+{
+    int head;  // 追加されたエントリ(添字*DEVICE_MAX+デバイス番号)の先頭, -1 は空
+    int local; // BufferSend()が取り出して追加順に並べ直したリストの先頭(BufferSend()だけが使う)
+    int efd;   // BufferSend()を起こすeventfd
+} SendReq = {-1, -1, -1};
+
+/**
+ * @brief BufferSend()の処理待ちリストの準備
+ *
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+static int SendReqInit()
+{
+    if (SendReq.efd == -1 && (SendReq.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    {
+        DebugPerror("eventfd");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief ARPテーブルの初期化
+ * @details 起動時に想定する近隣ノード数の分だけ, エントリとハッシュ表を事前に確保する. @n
+ * 事前に確保しておけば, 転送中にセグメントの追加やハッシュ表の再構築が起きない
+ *
+ * @param deviceNo : デバイス番号
+ * @param prealloc : 事前に確保するエントリ数
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int Ip2MacInit(int deviceNo, int prealloc)
+{
+    int hashSize;
+
+    if (SendReqInit() == -1)
+    {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&Ip2Macs[deviceNo].lock);
+    if (prealloc > 0 && Ip2MacGrow(deviceNo, prealloc) == -1)
+    {
+        pthread_rwlock_unlock(&Ip2Macs[deviceNo].lock);
+        return -1;
+    }
+    // 登録数がサイズの半分以下に収まるハッシュ表を用意
+    for (hashSize = IP2MAC_HASH_INIT_SIZE; hashSize < prealloc * 2; hashSize *= 2)
+        ;
+    if (Ip2Macs[deviceNo].hash == NULL)
+    {
+        TimerInit(deviceNo);
+    }
+    if (Ip2Macs[deviceNo].hashMask + 1 < hashSize && Ip2MacHashResize(deviceNo, hashSize) == -1)
+    {
+        pthread_rwlock_unlock(&Ip2Macs[deviceNo].lock);
+        return -1;
+    }
+    pthread_rwlock_unlock(&Ip2Macs[deviceNo].lock);
+
+    DebugPrintf("Ip2MacInit:[%d] %d entries, hash %d\n", deviceNo, Ip2Macs[deviceNo].size, hashSize);
+
+    return 0;
+}
+
+/**
+ * @brief タイムアウトしたエントリの処理
+ * @details FLAG_OKのエントリは, 前回のタイマ処理以降に参照されていれば延長し, されていなければ解放する. @n
+ * FLAG_NGのエントリは, 送信待ちデータがあればARPリクエストを再送して延長し, 再送回数を超えたら解放する. @n
+ * 転送処理が参照中のエントリは解放せず, 次のティックで判定し直す
+ *
+ * @param deviceNo : デバイス番号
+ * @param no : エントリの添字
+ */
+static void Ip2MacExpire(int deviceNo, int no)
+{
+    static u_char bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    IP2MAC *ip2mac = Ip2MacEntry(deviceNo, no);
+    IP2MAC_COLD *cold = Ip2MacCold(deviceNo, no);
+    unsigned long now = Ip2Macs[deviceNo].tick;
+    char buf[80];
+
+    if (ip2mac->flag == FLAG_OK && ip2mac->used)
+    { // 使用中のエントリは延長
+        ip2mac->used = 0;
+        TimerAdd(deviceNo, no, now + IP2MAC_TIMEOUT_SEC * (1000 / TIMER_TICK_MS));
+    }
+    else if (ip2mac->flag == FLAG_NG && ip2mac->pending && cold->retry < IP2MAC_NG_RETRY)
+    { // 解決待ちのエントリはARPリクエストを再送
+        cold->retry++;
+        DebugInfo("Ip2Mac RETRY [%d] %s = %d (%d)\n", deviceNo, in_addr_t2str(ip2mac->addr, buf, sizeof(buf)), no, cold->retry);
+        SendArpRequestB(deviceNo, ip2mac->addr, bcast, Device[deviceNo].addr.s_addr, Device[deviceNo].hwaddr);
+        TimerAdd(deviceNo, no, now + IP2MAC_NG_TIMEOUT_SEC * (1000 / TIMER_TICK_MS));
+    }
+    else if (__atomic_load_n(&cold->ref, __ATOMIC_ACQUIRE) > 0)
+    { // 参照中のエントリは解放できないので延期
+        TimerAdd(deviceNo, no, now + 1);
+    }
+    else
+    { // タイムアウトした場合, エントリを解放
+        Ip2MacFree(deviceNo, no);
+    }
+}
+
+/**
+ * @brief ARPテーブルのタイマ処理
+ * @details 前回の呼び出しから経過したティックの分だけタイマホイールを進め, タイムアウトしたエントリを処理する. @n
+ * 1ティックあたりの処理はスロット1つ分なので, エントリ数によらず償却O(1)となる. @n
+ * Router()のループから定期的に呼び出される
+ *
+ * @return 0 : 正常終了
+ */
+int Ip2MacTimer()
+{
+    unsigned long now = TimerNow();
+    int deviceNo, no, next, slot;
+
+    for (deviceNo = 0; deviceNo < DeviceNum; deviceNo++)
+    {
+        if (Ip2Macs[deviceNo].hash == NULL || Ip2Macs[deviceNo].tick >= now)
+        { // エントリが1つも登録されていない, または前回から1ティック経っていない
             continue;
         }
-        if (ip2mac->addr == addr)
-        { // 既存エントリにマッチした場合
-            if (ip2mac->flag == FLAG_OK)
-            {
-                ip2mac->lastTime = now;
-            }
-            if (hwaddr != NULL)
-            { // MACアドレスの更新
-                memcpy(ip2mac->hwaddr, hwaddr, 6);
-                ip2mac->flag = FLAG_OK;
-                if (ip2mac->sd.top != NULL)
-                { // 送信待ちデータがある場合
-                    AppendSendReqData(deviceNo, i);
+        pthread_rwlock_wrlock(&Ip2Macs[deviceNo].lock);
+        while (Ip2Macs[deviceNo].tick < now)
+        {
+            Ip2Macs[deviceNo].tick++;
+            slot = Ip2Macs[deviceNo].tick & (TIMER_WHEEL0_SIZE - 1);
+            if (slot == 0)
+            { // 1段目が一周したら, 2段目の次のスロットを1段目に入れ直す
+                next = TimerTakeSlot(deviceNo, TIMER_WHEEL0_SIZE + ((Ip2Macs[deviceNo].tick / TIMER_WHEEL0_SIZE) & (TIMER_WHEEL1_SIZE - 1)));
+                while ((no = next) != -1)
+                {
+                    next = Ip2MacCold(deviceNo, no)->timerNext;
+                    TimerAdd(deviceNo, no, Ip2MacCold(deviceNo, no)->expire);
                 }
-                DebugPrintf("Ip2Mac EXIST [%d] %s = %d\n", deviceNo, in_addr_t2str(addr, buf, sizeof(buf)), i);
-                return ip2mac;
             }
-            else
-            { // MACアドレスの取得
-                if (((ip2mac->flag == FLAG_OK) && (now - ip2mac->lastTime) > IP2MAC_TIMEOUT_SEC) || ((ip2mac->flag == FLAG_NG) && (now - ip2mac->lastTime) > IP2MAC_NG_TIMEOUT_SEC))
-                { // タイムアウトした場合, エントリを解放
-                    FreeSendData(ip2mac);
-                    ip2mac->flag = FLAG_FREE;
-                    DebugPrintf("Ip2Mac FREE [%d] %s = %d\n", deviceNo, in_addr_t2str(ip2mac->addr, buf, sizeof(buf)), i);
-                    if (freeNo == -1)
-                    {
-                        freeNo = i;
-                    }
+            next = TimerTakeSlot(deviceNo, slot);
+            while ((no = next) != -1)
+            {
+                next = Ip2MacCold(deviceNo, no)->timerNext;
+                if (Ip2MacCold(deviceNo, no)->expire <= Ip2Macs[deviceNo].tick)
+                {
+                    Ip2MacExpire(deviceNo, no);
                 }
                 else
-                { // タイムアウトしていない場合
-                    DebugPrintf("Ip2Mac EXIST [%d] %s = %d\n", deviceNo, in_addr_t2str(addr, buf, sizeof(buf)), i);
-                    return ip2mac;
-                }
-            }
-        }
-        else
-        { // 既存エントリにマッチしなかった場合
-            if (((ip2mac->flag == FLAG_OK) && (now - ip2mac->lastTime) > IP2MAC_TIMEOUT_SEC) || ((ip2mac->flag == FLAG_NG) && (now - ip2mac->lastTime) > IP2MAC_NG_TIMEOUT_SEC))
-            { // タイムアウトした場合, エントリを解放
-                FreeSendData(ip2mac);
-                ip2mac->flag = FLAG_FREE;
-                DebugPrintf("Ip2Mac FREE [%d] %s = %d\n", deviceNo, in_addr_t2str(ip2mac->addr, buf, sizeof(buf)), i);
-                if (freeNo == -1)
-                {
-                    freeNo = i;
+                { // 同じスロットの次の周回分
+                    TimerAdd(deviceNo, no, Ip2MacCold(deviceNo, no)->expire);
                 }
             }
         }
+        pthread_rwlock_unlock(&Ip2Macs[deviceNo].lock);
     }
-    if (freeNo == -1)
-    { // 空きエントリがない場合, エントリを追加
-        no = Ip2Macs[deviceNo].no;
-        if (no >= Ip2Macs[deviceNo].size)
-        {
-            if (Ip2Macs[deviceNo].size == 0)
-            {
-                Ip2Macs[deviceNo].size = 1024;
-                Ip2Macs[deviceNo].data = (IP2MAC *)malloc(Ip2Macs[deviceNo].size * sizeof(IP2MAC));
+    return 0;
+}
+
+/**
+ * @brief エントリの書き換え用Ethernetヘッダを作る
+ *
+ * @param[out] ip2mac : IP2MAC構造体
+ * @param[in] hwaddr : 宛先MACアドレス(NULLなら未解決として0)
+ */
+static void Ip2MacSetRewrite(IP2MAC *ip2mac, u_char *hwaddr)
+{
+    struct ether_header *eh = (struct ether_header *)ip2mac->rewrite;
+
+    if (hwaddr == NULL)
+    {
+        memset(eh->ether_dhost, 0, 6);
+    }
+    else
+    {
+        memcpy(eh->ether_dhost, hwaddr, 6);
+    }
+    memcpy(eh->ether_shost, Device[ip2mac->deviceNo].hwaddr, 6);
+    eh->ether_type = htons(ETHERTYPE_IP);
+    ip2mac->rewrite[14] = ip2mac->rewrite[15] = 0;
+}
+
+/**
+ * @brief 解決済みのエントリのEthernetヘッダをフレームの先頭に書き込む
+ * @details 宛先MAC, 送信元MAC, タイプを16バイトの1回のストアで書き込む. @n
+ * 後ろ2バイトはIPヘッダの先頭なので, フレームの元の値を残す. フレームは16バイト以上あること
+ *
+ * @param[in] ip2mac : IP2MAC構造体
+ * @param[in,out] frame : 送信するフレーム
+ */
+void Ip2MacRewrite(IP2MAC *ip2mac, u_char *frame)
+{
+#ifdef __SSE2__
+    __m128i keep = _mm_set_epi16((short)0xFFFF, 0, 0, 0, 0, 0, 0, 0);
+    __m128i v = _mm_loadu_si128((const __m128i *)frame);
+
+    v = _mm_or_si128(_mm_and_si128(v, keep), _mm_load_si128((const __m128i *)ip2mac->rewrite));
+    _mm_storeu_si128((__m128i *)frame, v);
+#else
+    memcpy(frame, ip2mac->rewrite, sizeof(struct ether_header));
+#endif
+}
+
+/**
+ * @brief ARPテーブルの検索(書き込みロックは呼び出し側で取得する)
+ * @details 返したエントリは参照中になるので, 使い終わったら Ip2MacRelease() を呼ぶ
+ *
+ * @param deviceNo
+ * @param addr
+ * @param hwaddr
+ * @return IP2MAC*
+ */
+static IP2MAC *Ip2MacSearchNoLock(int deviceNo, in_addr_t addr, u_char *hwaddr)
+{
+    int h, no;
+    char buf[80];
+    IP2MAC *ip2mac;
+    IP2MAC_COLD *cold;
+
+    if (Ip2Macs[deviceNo].hash == NULL)
+    {
+        TimerInit(deviceNo);
+    }
+
+    if ((h = Ip2MacHashFind(deviceNo, addr)) != -1)
+    { // 既存エントリにマッチした場合
+        no = Ip2Macs[deviceNo].hash[h].no;
+        ip2mac = Ip2MacEntry(deviceNo, no);
+        if (hwaddr != NULL)
+        { // MACアドレスの更新
+            Ip2MacSetRewrite(ip2mac, hwaddr);
+            if (ip2mac->flag != FLAG_OK)
+            { // 解決できたのでタイムアウトを設定し直す
+                Ip2MacCold(deviceNo, no)->retry = 0;
+                TimerAdd(deviceNo, no, Ip2Macs[deviceNo].tick + IP2MAC_TIMEOUT_SEC * (1000 / TIMER_TICK_MS));
             }
-            else
-            {
-                Ip2Macs[deviceNo].size += 1024;
-                Ip2Macs[deviceNo].data = (IP2MAC *)realloc(Ip2Macs[deviceNo].data, Ip2Macs[deviceNo].size * sizeof(IP2MAC));
+            ip2mac->flag = FLAG_OK;
+            ip2mac->used = 1;
+            if (ip2mac->pending)
+            { // 送信待ちデータがある場合
+                AppendSendReqData(deviceNo, no);
             }
         }
-        Ip2Macs[deviceNo].no++;
+        DebugPkt("Ip2Mac EXIST [%d] %s = %d\n", deviceNo, in_addr_t2str(addr, buf, sizeof(buf)), no);
+        return Ip2MacHold(deviceNo, no);
     }
-    else
-    { // 空きエントリがある場合, そのエントリを使用
-        no = freeNo;
+
+    if ((no = Ip2MacAlloc(deviceNo)) == -1)
+    {
+        return NULL;
     }
-    ip2mac = &Ip2Macs[deviceNo].data[no];
+    ip2mac = Ip2MacEntry(deviceNo, no);
+    cold = Ip2MacCold(deviceNo, no);
 
     // エントリの登録
     ip2mac->deviceNo = deviceNo;
+    ip2mac->no = no;
     ip2mac->addr = addr;
-    if (hwaddr == NULL)
+    ip2mac->flag = hwaddr == NULL ? FLAG_NG : FLAG_OK;
+    Ip2MacSetRewrite(ip2mac, hwaddr);
+    ip2mac->used = 0;
+    ip2mac->pending = 0;
+    InitSendData(&cold->sd);
+    cold->retry = 0;
+    cold->timerSlot = cold->timerNext = cold->timerPrev = -1;
+    TimerAdd(deviceNo, no, Ip2Macs[deviceNo].tick + (ip2mac->flag == FLAG_OK ? IP2MAC_TIMEOUT_SEC : IP2MAC_NG_TIMEOUT_SEC) * (1000 / TIMER_TICK_MS));
+    if (Ip2MacHashInsert(deviceNo, no) == -1)
     {
-        ip2mac->flag = FLAG_NG;
-        memset(ip2mac->hwaddr, 0, 6);
+        Ip2MacFree(deviceNo, no);
+        return NULL;
     }
-    else
+
+    DebugInfo("Ip2Mac ADD [%d] %s = %d\n", deviceNo, in_addr_t2str(ip2mac->addr, buf, sizeof(buf)), no);
+
+    return Ip2MacHold(deviceNo, no);
+}
+
+/**
+ * @brief ARPテーブルの検索
+ * @details 既存エントリの参照は読み込みロックだけで行い, エントリには参照済みの印を付けるだけで書き込まない. @n
+ * タイムアウトの判定は Ip2MacTimer() に任せる. @n
+ * エントリの追加やMACアドレスの更新が必要な場合のみ書き込みロックを取得する. @n
+ * 返したエントリは参照中になり, 解放や再利用はされない. 使い終わったら Ip2MacRelease() を呼ぶ
+ *
+ * @param deviceNo
+ * @param addr
+ * @param hwaddr
+ * @return IP2MAC*
+ */
+IP2MAC *Ip2MacSearch(int deviceNo, in_addr_t addr, u_char *hwaddr)
+{
+    IP2MAC *ip2mac = NULL;
+    int h;
+
+    if (hwaddr == NULL)
     {
-        ip2mac->flag = FLAG_OK;
-        memcpy(ip2mac->hwaddr, hwaddr, 6);
+        pthread_rwlock_rdlock(&Ip2Macs[deviceNo].lock);
+        if ((h = Ip2MacHashFind(deviceNo, addr)) != -1)
+        {
+            ip2mac = Ip2MacHold(deviceNo, Ip2Macs[deviceNo].hash[h].no);
+            if (ip2mac->used == 0)
+            {
+                ip2mac->used = 1;
+            }
+        }
+        pthread_rwlock_unlock(&Ip2Macs[deviceNo].lock);
+        if (ip2mac != NULL)
+        {
+            return ip2mac;
+        }
     }
-    ip2mac->lastTime = now;
-    memset(&ip2mac->sd, 0, sizeof(SEND_DATA));
-    pthread_mutex_init(&ip2mac->sd.mutex, NULL);
 
-    DebugPrintf("Ip2Mac ADD [%d] %s = %d\n", deviceNo, in_addr_t2str(ip2mac->addr, buf, sizeof(buf)), no);
+    pthread_rwlock_wrlock(&Ip2Macs[deviceNo].lock);
+    ip2mac = Ip2MacSearchNoLock(deviceNo, addr, hwaddr);
+    pthread_rwlock_unlock(&Ip2Macs[deviceNo].lock);
 
     return ip2mac;
 }
 
 /**
  * @brief ARPテーブルのエントリを検索し, エントリがない場合はARPリクエストを送信する
+ * @details 返したエントリは使い終わったら Ip2MacRelease() を呼ぶ
  *
  * @param deviceNo
  * @param addr
@@ -183,22 +837,82 @@ IP2MAC *Ip2Mac(int deviceNo, in_addr_t addr, u_char *hwaddr)
     char buf[80];
 
     ip2mac = Ip2MacSearch(deviceNo, addr, hwaddr);
+    if (ip2mac == NULL)
+    { // ARPテーブルに空きがない場合
+        DebugPkt("Ip2Mac(%s): table full\n", in_addr_t2str(addr, buf, sizeof(buf)));
+        return NULL;
+    }
     if (ip2mac->flag == FLAG_OK)
     { // ARPテーブルにエントリがある場合, エントリを返す
-        DebugPrintf("Ip2Mac(%s): OK\n", in_addr_t2str(addr, buf, sizeof(buf)));
+        DebugPkt("Ip2Mac(%s): OK\n", in_addr_t2str(addr, buf, sizeof(buf)));
         return ip2mac;
     }
     else
     { // ARPテーブルにエントリがない場合, ARPリクエストを送信
-        DebugPrintf("Ip2Mac(%s): NG\n", in_addr_t2str(addr, buf, sizeof(buf)));
-        DebugPrintf("Ip2Mac(%s): Send Arp Request\n", in_addr_t2str(addr, buf, sizeof(buf)));
-        SendArpRequestB(Device[deviceNo].soc, addr, bcast, Device[deviceNo].addr.s_addr, Device[deviceNo].hwaddr);
+        DebugPkt("Ip2Mac(%s): NG\n", in_addr_t2str(addr, buf, sizeof(buf)));
+        DebugPkt("Ip2Mac(%s): Send Arp Request\n", in_addr_t2str(addr, buf, sizeof(buf)));
+        SendArpRequestB(deviceNo, addr, bcast, Device[deviceNo].addr.s_addr, Device[deviceNo].hwaddr);
         return ip2mac;
     }
 }
 
+/**
+ * @brief 既存エントリのMACアドレスを更新する
+ * @details エントリがなければ追加しない. 自分宛てでないブロードキャストのARPから学習するときに使う. @n
+ * 解決済みでMACアドレスも変わらない場合は, 書き込みロックを取得しない
+ *
+ * @param deviceNo : デバイス番号
+ * @param addr : IPアドレス
+ * @param hwaddr : MACアドレス
+ * @return 0 : 正常終了, -1 : エントリがない
+ */
+int Ip2MacUpdate(int deviceNo, in_addr_t addr, u_char *hwaddr)
+{
+    IP2MAC *ip2mac;
+    int h, changed = 0, ret = -1;
+
+    pthread_rwlock_rdlock(&Ip2Macs[deviceNo].lock);
+    if ((h = Ip2MacHashFind(deviceNo, addr)) != -1)
+    {
+        ip2mac = Ip2MacEntry(deviceNo, Ip2Macs[deviceNo].hash[h].no);
+        changed = ip2mac->flag != FLAG_OK || memcmp(ip2mac->hwaddr, hwaddr, 6) != 0;
+        ret = 0;
+    }
+    pthread_rwlock_unlock(&Ip2Macs[deviceNo].lock);
+    if (changed)
+    {
+        pthread_rwlock_wrlock(&Ip2Macs[deviceNo].lock);
+        if (Ip2MacHashFind(deviceNo, addr) != -1)
+        {
+            Ip2MacRelease(Ip2MacSearchNoLock(deviceNo, addr, hwaddr));
+        }
+        else
+        { // 読み込みロックを外している間に解放された
+            ret = -1;
+        }
+        pthread_rwlock_unlock(&Ip2Macs[deviceNo].lock);
+    }
+    return ret;
+}
+
+/**
+ * @brief Ip2Mac() で得たエントリの参照を返す
+ * @details 参照がなくなるまで, エントリは Ip2MacTimer() で解放されず, 別のアドレスに再利用されない
+ *
+ * @param ip2mac : IP2MAC構造体(NULLなら何もしない)
+ */
+void Ip2MacRelease(IP2MAC *ip2mac)
+{
+    if (ip2mac != NULL)
+    {
+        __atomic_sub_fetch(&Ip2MacCold(ip2mac->deviceNo, ip2mac->no)->ref, 1, __ATOMIC_RELEASE);
+    }
+}
+
 /**
  * @brief 送信待ちデータを送信する
+ * @details ヘッダはパケットバッファ上でそのまま書き換える. @n
+ * 受信時にチェックサムを検証済みなので, TTLの減算はチェックサムの差分更新で行う
  *
  * @param[in] deviceNo : デバイス番号
  * @param[in] ip2mac : IP2MAC構造体
@@ -206,88 +920,35 @@ IP2MAC *Ip2Mac(int deviceNo, in_addr_t addr, u_char *hwaddr)
  */
 int BufferSendOne(int deviceNo, IP2MAC *ip2mac)
 {
-    struct ether_header eh;
-    struct iphdr iphdr;
-    u_char option[1500];
-    int optionLen;
-    int size;
-    u_char *data;
-    u_char *ptr;
+    struct iphdr *iphdr;
+    DATA_BUF *d;
 
     while (1)
     {
-        if (GetSendData(ip2mac, &size, &data) == -1)
+        if ((d = GetSendData(ip2mac)) == NULL)
         {
             break;
         }
 
-        ptr = data;
+        iphdr = (struct iphdr *)(d->data + sizeof(struct ether_header));
 
-        memcpy(&eh, ptr, sizeof(struct ether_header));
-        ptr += sizeof(struct ether_header);
+        Ip2MacRewrite(ip2mac, d->data);
 
-        memcpy(&iphdr, ptr, sizeof(struct iphdr));
+        DebugPkt("iphdr.ttl %d->%d\n", iphdr->ttl, iphdr->ttl - 1);
+        ipDecrementTtl(iphdr);
 
-        ptr += sizeof(struct iphdr);
-
-        optionLen = iphdr.ihl * 4 - sizeof(struct iphdr);
-        if (optionLen > 0)
-        {
-            memcpy(option, ptr, optionLen);
-            ptr += optionLen;
-        }
-
-        memcpy(eh.ether_dhost, ip2mac->hwaddr, 6);
-        memcpy(eh.ether_shost, Device[deviceNo].hwaddr, 6);
-        memcpy(data, &eh, sizeof(struct ether_header));
-
-        DebugPrintf("iphdr.ttl %d->%d\n", iphdr.ttl, iphdr.ttl - 1);
-        iphdr.ttl--;
-
-        iphdr.check = 0;
-        iphdr.check = checksum2((u_char *)&iphdr, sizeof(struct iphdr), option, optionLen);
-        memcpy(data + sizeof(struct ether_header), &iphdr, sizeof(struct iphdr));
-
-        DebugPrintf("write:BufferSendOne:[%d] %dbytes\n", deviceNo, size);
-        write(Device[deviceNo].soc, data, size);
-
-        /*
-           DebugPrintf("*************[%d]\n", deviceNo);
-           print_ether_header(&eh);
-           print_ip(&ip);
-           DebugPrintf("*************[%d]\n", deviceNo);
-       */
+        DebugPkt("write:BufferSendOne:[%d] %dbytes\n", deviceNo, d->size);
+        Trace(TRACE_EV_BUF_SEND, deviceNo, 0, iphdr->saddr, iphdr->daddr, d->size);
+        DeviceWrite(deviceNo, d->data, d->size);
+        PktBufFree(d);
     }
+    DeviceFlush(deviceNo);
     return 0;
 }
 
 /**
- * @brief 送信待ちデータの情報を保持するための構造体
- *
- */
-typedef struct _send_req_data_
-{
-    struct _send_req_data_ *next;
-    struct _send_req_data_ *before;
-    int deviceNo;
-    int ip2macNo;
-} SEND_REQ_DATA;
-
-/**
- * @brief
- *
- */
-struct
-{
-    SEND_REQ_DATA *top;
-    SEND_REQ_DATA *bottom;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-} SendReq = {NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
-
-/**
- * @brief SendReqにデータを追加し, pthread_cond_signal()で別スレッドのBufferSend()に通知
- * @details ip2MacSeach()でARPテーブルにエントリがない場合に呼び出される
+ * @brief 処理待ちリストにエントリを追加し, BufferSend()を起こす
+ * @details ARPの解決時や, 解決済みのエントリに送信待ちデータが追加されたときに呼び出される
  *
  * @param[in] deviceNo : デバイス番号
  * @param[in] ip2macNo : ARPテーブルのエントリ番号
@@ -295,56 +956,35 @@ struct
  */
 int AppendSendReqData(int deviceNo, int ip2macNo)
 {
-    SEND_REQ_DATA *d;
-    int status;
+    IP2MAC_COLD *cold = Ip2MacCold(deviceNo, ip2macNo);
+    u_int64_t one = 1;
+    int head;
 
-    if ((status = pthread_mutex_lock(&SendReq.mutex)) != 0)
-    {
-        DebugPrintf("AppendSendReqData:pthread_mutex_lock:%s\n", strerror(status));
-        return -1;
+    if (__atomic_exchange_n(&cold->scheduled, 1, __ATOMIC_ACQ_REL) != 0)
+    { // 既に処理待ち
+        return 1;
     }
-
-    for (d = SendReq.top; d != NULL; d = d->next)
+    head = __atomic_load_n(&SendReq.head, __ATOMIC_RELAXED);
+    do
     {
-        if (d->deviceNo == deviceNo && d->ip2macNo == ip2macNo)
-        {
-            pthread_mutex_unlock(&SendReq.mutex);
-            return 1;
-        }
-    }
+        cold->readyNext = head;
+    } while (!__atomic_compare_exchange_n(&SendReq.head, &head, ip2macNo * DEVICE_MAX + deviceNo, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 
-    d = (SEND_REQ_DATA *)malloc(sizeof(SEND_REQ_DATA));
-    if (d == NULL)
+    if (head == -1 && SendReq.efd != -1 && write(SendReq.efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
     {
-        DebugPrintf("AppendSendReqData:malloc:%s\n", strerror(errno));
-        pthread_mutex_unlock(&SendReq.mutex);
+        DebugPerror("write(eventfd)");
         return -1;
     }
 
-    d->next = d->before = NULL;
-    d->deviceNo = deviceNo;
-    d->ip2macNo = ip2macNo;
-
-    if (SendReq.bottom == NULL)
-    {
-        SendReq.top = SendReq.bottom = d;
-    }
-    else
-    {
-        SendReq.bottom->next = d;
-        d->before = SendReq.bottom;
-        SendReq.bottom = d;
-    }
-    pthread_cond_signal(&SendReq.cond);
-    pthread_mutex_unlock(&SendReq.mutex);
-
-    DebugPrintf("AppendSendReqData:[%d]:%d\n", deviceNo, ip2macNo);
+    DebugPkt("AppendSendReqData:[%d]:%d\n", deviceNo, ip2macNo);
 
     return 0;
 }
 
 /**
  * @brief BufferSend()で先頭の1データを得る
+ * @details 手元のリストが空なら処理待ちリストを丸ごと取り出し, 追加された順に並べ直す. @n
+ * 返す前に IP2MAC_COLD.scheduled を下ろすので, この後に追加されたデータは改めて処理待ちになる
  *
  * @param[out] deviceNo : デバイス番号
  * @param[out] ip2macNo : ARPテーブルのエントリ番号
@@ -352,77 +992,107 @@ int AppendSendReqData(int deviceNo, int ip2macNo)
  */
 int GetSendReqData(int *deviceNo, int *ip2macNo)
 {
-    SEND_REQ_DATA *d;
-    int status;
+    IP2MAC_COLD *cold;
+    int key, next;
 
-    if (SendReq.top == NULL)
+    if (SendReq.local == -1)
     {
-        return -1;
-    }
-
-    if ((status = pthread_mutex_lock(&SendReq.mutex)) != 0)
-    {
-        DebugPrintf("GetSendReqData:pthread_mutex_lock:%s\n", strerror(status));
-        return -1;
-    }
-    d = SendReq.top;
-    SendReq.top = d->next;
-    if (SendReq.top == NULL)
-    {
-        SendReq.bottom = NULL;
-    }
-    else
-    {
-        SendReq.top->before = NULL;
+        key = __atomic_exchange_n(&SendReq.head, -1, __ATOMIC_ACQUIRE);
+        while (key != -1)
+        { // 逆順に並べ直す
+            cold = Ip2MacCold(key % DEVICE_MAX, key / DEVICE_MAX);
+            next = cold->readyNext;
+            cold->readyNext = SendReq.local;
+            SendReq.local = key;
+            key = next;
+        }
+        if (SendReq.local == -1)
+        {
+            return -1;
+        }
     }
-    pthread_mutex_unlock(&SendReq.mutex);
+    key = SendReq.local;
+    cold = Ip2MacCold(key % DEVICE_MAX, key / DEVICE_MAX);
+    SendReq.local = cold->readyNext;
+    __atomic_store_n(&cold->scheduled, 0, __ATOMIC_SEQ_CST);
 
-    *deviceNo = d->deviceNo;
-    *ip2macNo = d->ip2macNo;
+    *deviceNo = key % DEVICE_MAX;
+    *ip2macNo = key / DEVICE_MAX;
 
-    DebugPrintf("GetSendReqData:[%d]:%d\n", *deviceNo, *ip2macNo);
+    DebugPkt("GetSendReqData:[%d]:%d\n", *deviceNo, *ip2macNo);
 
     return 0;
 }
 
+/**
+ * @brief 処理待ちリストのエントリの送信待ちデータを全て送信する
+ * @details 処理待ちの間に解放されたエントリは飛ばす. 送信中は参照を持ち, 解放や再利用を防ぐ
+ *
+ * @return 送信したエントリ数
+ */
+int BufferSendPending()
+{
+    int deviceNo, ip2macNo, n = 0;
+    IP2MAC *ip2mac;
+
+    while (GetSendReqData(&deviceNo, &ip2macNo) != -1)
+    {
+        pthread_rwlock_rdlock(&Ip2Macs[deviceNo].lock);
+        ip2mac = Ip2MacEntry(deviceNo, ip2macNo);
+        ip2mac = (ip2mac->flag == FLAG_FREE) ? NULL : Ip2MacHold(deviceNo, ip2macNo);
+        pthread_rwlock_unlock(&Ip2Macs[deviceNo].lock);
+        if (ip2mac == NULL)
+        {
+            continue;
+        }
+        BufferSendOne(deviceNo, ip2mac);
+        Ip2MacRelease(ip2mac);
+        n++;
+    }
+    return n;
+}
+
+/**
+ * @brief 処理待ちリストへの追加を通知するeventfd
+ * @details BufferSend()のスレッドを使わない場合は, これを読み込めたら BufferSendPending() を呼ぶ
+ *
+ * @return eventfd
+ */
+int BufferSendEventFd()
+{
+    return SendReq.efd;
+}
+
 /**
  * @brief メインの送受信処理とは別スレッドで動き続ける関数
+ * @details 処理待ちリストへの追加をeventfdで待つ. 終了フラグを確認するため1秒でタイムアウトする
  *
  * @return 0 : 正常終了
  */
 int BufferSend()
 {
-    struct timeval now;
-    struct timespec timeout;
-    int deviceNo, ip2macNo;
-    int status;
+    struct pollfd target;
+    u_int64_t val;
 
+    target.fd = SendReq.efd;
+    target.events = POLLIN;
     while (EndFlag == 0)
     {
-        gettimeofday(&now, NULL);
-        timeout.tv_sec = now.tv_sec + 1;
-        timeout.tv_nsec = now.tv_usec * 1000;
-
-        pthread_mutex_lock(&SendReq.mutex);
-        if ((status = pthread_cond_timedwait(&SendReq.cond, &SendReq.mutex, &timeout)) != 0)
+        if (poll(&target, 1, 1000) == -1)
         {
-            if (status != ETIMEDOUT)
+            if (errno != EINTR)
             {
-                DebugPrintf("BufferSend:pthread_cond_timedwait:%s\n", strerror(status));
+                DebugPerror("poll");
             }
+            continue;
         }
-        pthread_mutex_unlock(&SendReq.mutex);
-
-        while (1)
+        if ((target.revents & POLLIN) && read(SendReq.efd, &val, sizeof(val)) == -1 && errno != EAGAIN)
         {
-            if (GetSendReqData(&deviceNo, &ip2macNo) == -1)
-            {
-                break;
-            }
-            BufferSendOne(deviceNo, &Ip2Macs[deviceNo].data[ip2macNo]);
+            DebugPerror("read(eventfd)");
         }
+        BufferSendPending();
     }
     DebugPrintf("BufferSend:End\n");
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,14 @@
 IP2MAC *Ip2MacSearch(int deviceNo, in_addr_t addr, u_char *hwaddr);
 IP2MAC *Ip2Mac(int deviceNo, in_addr_t addr, u_char *hwaddr);
+void Ip2MacRelease(IP2MAC *ip2mac);
+int Ip2MacUpdate(int deviceNo, in_addr_t addr, u_char *hwaddr);
+void Ip2MacRewrite(IP2MAC *ip2mac, u_char *frame);
+int Ip2MacInit(int deviceNo, int prealloc);
+int Ip2MacTimer();
+SEND_DATA *Ip2MacSendData(IP2MAC *ip2mac);
 int BufferSendOne(int deviceNo, IP2MAC *ip2mac);
 int AppendSendReqData(int deviceNo, int ip2macNo);
 int GetSendReqData(int *deviceNo, int *ip2macNo);
+int BufferSendPending();
+int BufferSendEventFd();
 int BufferSend();
\ No newline at end of file
@@ -0,0 +1,135 @@
+/**
+ * @file ip2macBench.c
+ * @brief ARPテーブル検索のマイクロベンチマーク
+ * @details 近隣ノード数を 1k, 10k, 100k と増やしながら, 登録済みアドレスをランダムな順で
+ * Ip2MacSearch() したときの1回あたりの時間を測る. 転送処理の通常経路(読み込みロックでの検索)と同じ処理である. @n
+ * make bench で実行する
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <pthread.h>
+#include "netutil.h"
+#include "base.h"
+#include "ip2mac.h"
+
+#define BENCH_LOOKUPS (1 << 22) // 1回の計測での検索回数
+
+DEVICE Device[DEVICE_MAX];
+int DeviceNum = 1;
+int EndFlag = 0;
+int DebugLevel = 0;
+
+/**
+ * @brief ルーター本体のデバッグ出力の代わり. 何も出力しない
+ *
+ */
+int DebugPrintf(char *fmt, ...)
+{
+    return 0;
+}
+
+/**
+ * @brief ルーター本体のperror()の代わり
+ *
+ */
+int DebugPerror(char *msg)
+{
+    perror(msg);
+    return 0;
+}
+
+/**
+ * @brief ルーター本体のデバイス送信の代わり. 何も送信しない
+ *
+ */
+int DeviceWrite(int deviceNo, u_char *data, int size)
+{
+    return size;
+}
+
+/**
+ * @brief ルーター本体の送信フラッシュの代わり
+ *
+ */
+int DeviceFlush(int deviceNo)
+{
+    return 0;
+}
+
+/**
+ * @brief 経過時間(ns)
+ *
+ * @param start : 開始時刻
+ * @param end : 終了時刻
+ * @return 経過時間(ns)
+ */
+static double Elapsed(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char *argv[])
+{
+    static int sizes[] = {1000, 10000, 100000};
+    static u_char hwaddr[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x00};
+    in_addr_t *addrs;
+    int *order;
+    struct timespec start, end;
+    unsigned long sum = 0;
+    IP2MAC *ip2mac;
+    int i, n, no = 0;
+
+    addrs = (in_addr_t *)malloc(sizes[2] * sizeof(in_addr_t));
+    order = (int *)malloc(BENCH_LOOKUPS * sizeof(int));
+    if (addrs == NULL || order == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    srand(1);
+
+    printf("sizeof(IP2MAC)=%zu sizeof(IP2MAC_COLD)=%zu\n", sizeof(IP2MAC), sizeof(IP2MAC_COLD));
+    printf("%10s %12s\n", "neighbors", "ns/lookup");
+    for (n = 0; n < 3; n++)
+    {
+        // 近隣ノードを sizes[n] 個まで登録(10.0.0.0/8から順に割り当てる)
+        for (; no < sizes[n]; no++)
+        {
+            addrs[no] = htonl(0x0A000001 + no);
+            hwaddr[2] = no >> 16;
+            hwaddr[3] = no >> 8;
+            hwaddr[4] = no;
+            Ip2MacRelease(Ip2MacSearch(0, addrs[no], hwaddr));
+        }
+        for (i = 0; i < BENCH_LOOKUPS; i++)
+        {
+            order[i] = rand() % sizes[n];
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < BENCH_LOOKUPS; i++)
+        {
+            ip2mac = Ip2MacSearch(0, addrs[order[i]], NULL);
+            sum += ip2mac->hwaddr[4];
+            Ip2MacRelease(ip2mac);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        printf("%10d %12.1f\n", sizes[n], Elapsed(&start, &end) / BENCH_LOOKUPS);
+    }
+    // 検索結果を使い, 最適化で検索ループが消えないようにする
+    fprintf(stderr, "checksum=%lu\n", sum);
+
+    free(order);
+    free(addrs);
+
+    return 0;
+}
@@ -0,0 +1,156 @@
+/**
+ * @file latency.c
+ * @brief 転送遅延のヒストグラム
+ * @details 遅延はフレームの受信時刻(できるだけカーネルが受信した時刻)から, 転送先に送出するまでの時間とする. @n
+ * 2のべき乗の区間を 2^LAT_SUB_BITS 等分した対数ヒストグラムに数えるので, 記録は加算1回で済み, @n
+ * ns から秒までの範囲を一定の相対誤差で扱える. パーセンタイルは区間の上限で答える
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <pthread.h>
+#include "netutil.h"
+#include "base.h"
+#include "latency.h"
+
+extern int DebugPrintf(char *fmt, ...);
+
+/**
+ * @brief 現在時刻
+ * @details カーネルの受信タイムスタンプと比べるので CLOCK_REALTIME を使う
+ *
+ * @return 現在時刻(ns)
+ */
+u_int64_t LatencyNow()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief 値を数える区間の番号
+ *
+ * @param [in] ns : 値
+ * @return 区間の番号
+ */
+static int LatencyBucket(u_int64_t ns)
+{
+    int msb;
+
+    if (ns < (1 << LAT_SUB_BITS))
+    {
+        return (int)ns;
+    }
+    msb = 63 - __builtin_clzll(ns);
+    return ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) + (int)((ns >> (msb - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+/**
+ * @brief 区間に入る値の上限
+ *
+ * @param [in] bucket : 区間の番号
+ * @return 上限の値
+ */
+static u_int64_t LatencyBucketMax(int bucket)
+{
+    int shift;
+
+    if (bucket < (1 << LAT_SUB_BITS))
+    {
+        return bucket;
+    }
+    shift = (bucket >> LAT_SUB_BITS) - 1;
+    return ((u_int64_t)((1 << LAT_SUB_BITS) + (bucket & ((1 << LAT_SUB_BITS) - 1)) + 1) << shift) - 1;
+}
+
+/**
+ * @brief 遅延を1つ記録する
+ *
+ * @param [in] hist : 自スレッドのヒストグラム
+ * @param [in] ns : 遅延(ns)
+ */
+void LatencyRecord(LAT_HIST *hist, u_int64_t ns)
+{
+    hist->count[LatencyBucket(ns)]++;
+}
+
+/**
+ * @brief ヒストグラムを足し合わせる
+ * @details 他のスレッドが記録中のヒストグラムも読めるが, その場合は数え途中の値になる
+ *
+ * @param [out] dst : 足し込む先
+ * @param [in] src : 足すヒストグラム
+ */
+void LatencyMerge(LAT_HIST *dst, LAT_HIST *src)
+{
+    int i;
+
+    for (i = 0; i < LAT_BUCKETS; i++)
+    {
+        dst->count[i] += __atomic_load_n(&src->count[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief パーセンタイルを求める
+ *
+ * @param [in] hist : ヒストグラム
+ * @param [in] p : 割合(0.5, 0.99など)
+ * @return 全体のpが収まる値(ns, 区間の上限), 0 : 記録なし
+ */
+u_int64_t LatencyPercentile(LAT_HIST *hist, double p)
+{
+    unsigned long total = 0, sum = 0, target;
+    int i;
+
+    for (i = 0; i < LAT_BUCKETS; i++)
+    {
+        total += hist->count[i];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+    target = (unsigned long)(total * p);
+    if (target >= total)
+    {
+        target = total - 1;
+    }
+    for (i = 0; i < LAT_BUCKETS; i++)
+    {
+        sum += hist->count[i];
+        if (sum > target)
+        {
+            break;
+        }
+    }
+    return LatencyBucketMax(i);
+}
+
+/**
+ * @brief 記録数とp50/p99/p999をデバッグ出力する
+ *
+ * @param [in] name : 表示名
+ * @param [in] hist : ヒストグラム
+ * @return 0 : 正常終了
+ */
+int LatencyReport(char *name, LAT_HIST *hist)
+{
+    unsigned long total = 0;
+    int i;
+
+    for (i = 0; i < LAT_BUCKETS; i++)
+    {
+        total += hist->count[i];
+    }
+    DebugPrintf("latency[%s]:n=%lu p50=%.1fus p99=%.1fus p999=%.1fus\n", name, total,
+                LatencyPercentile(hist, 0.5) / 1000.0, LatencyPercentile(hist, 0.99) / 1000.0, LatencyPercentile(hist, 0.999) / 1000.0);
+    return 0;
+}
@@ -0,0 +1,12 @@
+/**
+ * @file latency.h
+ * @brief 転送遅延のヒストグラム
+ * @details base.h の後にインクルードする
+ *
+ */
+
+u_int64_t LatencyNow();
+void LatencyRecord(LAT_HIST *hist, u_int64_t ns);
+void LatencyMerge(LAT_HIST *dst, LAT_HIST *src);
+u_int64_t LatencyPercentile(LAT_HIST *hist, double p);
+int LatencyReport(char *name, LAT_HIST *hist);
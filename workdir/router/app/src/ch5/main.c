@@ -5,6 +5,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <poll.h>
@@ -12,6 +13,8 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <netinet/if_ether.h>
 #include <netinet/ip.h>
@@ -21,6 +24,11 @@
 #include "base.h"
 #include "ip2mac.h"
 #include "sendBuf.h"
+#include "fib.h"
+#include "rcu.h"
+#include "debug.h"
+#include "trace.h"
+#include "latency.h"
 
 /**
  * @brief 動作パラメータの管理用構造体
@@ -28,18 +36,58 @@
  */
 typedef struct
 {
-    char *Device1;
-    char *Device2;
-    int DebugOut;
+    char *Devices;   // 使用するネットワークインターフェース(カンマ区切り)
+    int DebugOut;    // デバッグ出力のレベル(DEBUG_LEVEL_*)
     char *NextRouter;
+    int RxMode;      // 受信方式
+    int TxMode;      // 送信方式
+    int QdiscBypass; // PACKET_QDISC_BYPASSを使うかどうか
+    int BatchSize;   // recvmmsg()/sendmmsg()で1回に扱う最大フレーム数
+    int Workers;     // 受信処理を行うワーカースレッド数
+    int FanoutMode;  // ワーカーへの分配方式
+    int ArpPrealloc; // デバイスごとに事前確保するARPテーブルのエントリ数
+    int PktPool;     // 事前確保するパケットバッファ数
+    int HugePage;    // パケットバッファをhugepageで確保するかどうか
+    int SendDepth;   // 近隣ノードごとの送信待ちキューの長さ
+    int SendDrop;    // 送信待ちキューが一杯のときの破棄方式
+    int CsumMode;    // 転送時のIPヘッダチェックサムの更新方式
+    int TrustRxCsum; // 受信したIPヘッダのチェックサムを検証しないかどうか
+    char *TraceFile; // トレースの書き出し先(NULLならトレースしない)
+    char *RouteFile; // 経路ファイル(NULLなら直接接続の経路とNextRouterへのデフォルト経路)
+    int SpinUsec;    // 受信がなくなってからスピンを続ける時間(us, 0ならスピンしない)
+    int Latency;     // 転送遅延を記録するかどうか
+    int Vnet;        // PACKET_VNET_HDRでGRO/GSOのフレームをまとめたまま転送するかどうか
 } PARAM;
 
+#define RX_MODE_READ 0 // read()で1フレームずつ受信
+#define RX_MODE_RING 1 // PACKET_MMAP(TPACKET_V3)の受信リングをブロック単位で処理
+#define RX_MODE_MMSG 2 // recvmmsg()で複数フレームをまとめて受信
+#define RX_MODE_XDP 3  // AF_XDPで受信し, 転送するフレームはUMEM上のまま送信(ARPなどはread())
+#define RX_MODE_URING 4 // io_uringのマルチショット受信で受け, 転送するフレームは受信バッファのまま送信
+
+#define TX_MODE_WRITE 0 // write()で1フレームずつ送信
+#define TX_MODE_RING 1  // PACKET_MMAP(TPACKET_V2)の送信リングに書き込み, まとめて送信
+#define TX_MODE_MMSG 2  // 送信先デバイスごとのバッチに積み, sendmmsg()でまとめて送信
+
+#define CSUM_MODE_FULL 0 // TTLを減らした後, ヘッダ全体からチェックサムを計算し直す
+#define CSUM_MODE_INCR 1 // TTLを減らした分だけチェックサムを差分更新する(RFC 1624)
+
 // 簡単のためデバイスはハードコード
-PARAM Param = {"eth0", "eth1", 1, "10.0.1.250"};
+PARAM Param = {"eth0,eth1", DEBUG_LEVEL_PKT, "10.0.1.250", RX_MODE_READ, TX_MODE_WRITE, 0, 64, 1, FANOUT_MODE_HASH, 0, 1024, 0, 64, SEND_DROP_TAIL, CSUM_MODE_FULL, 0, NULL, NULL, 0, 0, 0};
 
 struct in_addr NextRouter; // 上位ルータのIPアドレス
-DEVICE Device[2];          // ネットワークインターフェースのソケットディスクリプタを保持する構造体
+DEVICE Device[DEVICE_MAX]; // ネットワークインターフェースのソケットディスクリプタを保持する構造体
+int DeviceNum;             // 使用するネットワークインターフェースの数
 int EndFlag = 0;           // 終了フラグ
+int ReloadFlag = 0;        // 経路表の再読み込み要求
+int LatencyFlag = 0;       // 転送遅延の出力要求
+int DebugLevel;            // 実行時のデバッグ出力レベル(Param.DebugOut)
+
+WORKER *Worker;                 // ワーカーの配列(Param.Workers個)
+__thread WORKER *CurWorker;     // 自スレッドのワーカー(BufThreadではNULL)
+__thread u_char *VnetFrame;     // 処理中の受信フレーム(-G). 直前に受信時のvirtio_net_hdrがある
+STATS BufStats;                 // BufThreadのカウンタ
+XSK_UMEM XskUmem;               // AF_XDPで全デバイスが共有するUMEM(RX_MODE_XDPの場合のみ使用)
 
 /**
  * @brief fprintfのラッパー関数
@@ -75,6 +123,74 @@ int DebugPerror(char *msg)
     return 0;
 }
 
+/**
+ * @brief デバイスへのフレーム送信
+ * @details 自スレッドのワーカーのポートから送信する. ワーカーを持たないBufThreadはワーカー0のポートを共有する. @n
+ * AF_XDPソケット, 送信リング, 送信バッチが設定されている場合はそこに書き込むだけで, 実際の送信は DeviceFlush() で行う. @n
+ * AF_XDPソケットはワーカー0だけが使い, BufThreadからの送信はwrite()で行う. @n
+ * io_uringのワーカーが受信バッファのフレームを送る場合は, 送信要求を積むだけで次の io_uring_enter() で投入される. @n
+ * PACKET_VNET_HDRの場合は, 処理中の受信フレームなら受信時のvirtio_net_hdrを付けて(GSOのまま)送る. @n
+ * どれもない場合や書き込めなかった場合はwrite()で送信する
+ *
+ * @param[in] deviceNo : デバイス番号
+ * @param[in] data : フレーム
+ * @param[in] size : フレーム長
+ * @return 送信したバイト数, -1 : 異常終了
+ */
+int DeviceWrite(int deviceNo, u_char *data, int size)
+{
+    IO_PORT *port = &(CurWorker != NULL ? CurWorker : &Worker[0])->port[deviceNo];
+    STATS *stats = (CurWorker != NULL) ? &CurWorker->stats : &BufStats;
+
+    stats->txPackets++;
+    if (Param.Vnet)
+    {
+        return VnetWrite(port->soc, data, size, data == VnetFrame);
+    }
+    if (CurWorker != NULL && CurWorker->uring.fd > 0 && URingSend(&CurWorker->uring, port->soc, data, size) == 0)
+    {
+        return size;
+    }
+    if (port->xsk.fd > 0 && CurWorker != NULL && XskSend(&port->xsk, data, size) == 0)
+    {
+        return size;
+    }
+    if (port->tx.map != NULL && TxRingSend(&port->tx, data, size) == 0)
+    {
+        return size;
+    }
+    if (port->txm.msgs != NULL && TxMmsgSend(port->soc, &port->txm, data, size) == 0)
+    {
+        return size;
+    }
+    return write(port->soc, data, size);
+}
+
+/**
+ * @brief DeviceWrite()で送信リングや送信バッチに書き込んだフレームをまとめて送信
+ *
+ * @param[in] deviceNo : デバイス番号
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int DeviceFlush(int deviceNo)
+{
+    IO_PORT *port = &(CurWorker != NULL ? CurWorker : &Worker[0])->port[deviceNo];
+
+    if (port->xsk.fd > 0 && CurWorker != NULL && XskFlush(&port->xsk) == -1)
+    {
+        return -1;
+    }
+    if (port->tx.map != NULL && TxRingFlush(&port->tx) == -1)
+    {
+        return -1;
+    }
+    if (port->txm.msgs != NULL && TxMmsgFlush(port->soc, &port->txm) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * @brief ICMP Time Exceededメッセージの送信
  *
@@ -91,7 +207,7 @@ int SendIcmpTimeExceeded(int deviceNo, struct ether_header *eh, struct iphdr *ip
     struct iphdr rih;
     struct icmp icmp;
     u_char *ipptr;
-    u_char *ptr, buf[1500];
+    u_char *ptr, buf[sizeof(struct ether_header) + sizeof(struct iphdr) + 8 + 64];
     int len;
 
     // Ethernetヘッダの設定
@@ -138,9 +254,30 @@ int SendIcmpTimeExceeded(int deviceNo, struct ether_header *eh, struct iphdr *ip
     ptr += 64;
     len = ptr - buf;
 
-    DebugPrintf("write:SendIcmpTimeExceeded:[%d] %dbytes\n", deviceNo, len);
-    write(Device[deviceNo].soc, buf, len);
+    DebugPkt("write:SendIcmpTimeExceeded:[%d] %dbytes\n", deviceNo, len);
+    Trace(TRACE_EV_TIME_EXCEEDED, deviceNo, 0, rih.saddr, rih.daddr, len);
+    DeviceWrite(deviceNo, buf, len);
+
+    return 0;
+}
+
+/**
+ * @brief 自分のインターフェースのIPアドレスかどうか
+ *
+ * @param[in] addr : IPアドレス
+ * @return 1 : 自分のアドレス, 0 : それ以外
+ */
+static int IsMyAddr(in_addr_t addr)
+{
+    int i;
 
+    for (i = 0; i < DeviceNum; i++)
+    {
+        if (Device[i].addr.s_addr == addr)
+        {
+            return 1;
+        }
+    }
     return 0;
 }
 
@@ -160,198 +297,466 @@ int AnalyzePacket(int deviceNo, u_char *data, int size)
     struct ether_header *eh;
     char buf[80];
     int tno;
-    u_char hwaddr[6];
+    static u_char bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
     ptr = data;
     lest = size;
 
     if (lest < sizeof(struct ether_header))
     { // パケットサイズがEthernetヘッダより小さい場合
-        DebugPrintf("[%d]:lest(%d) < sizeof(struct ether_header)\n", deviceNo, lest);
+        DebugPkt("[%d]:lest(%d) < sizeof(struct ether_header)\n", deviceNo, lest);
+        Trace(TRACE_EV_DROP, deviceNo, TRACE_DROP_SHORT, 0, 0, size);
         return -1;
     }
     eh = (struct ether_header *)ptr;
     ptr += sizeof(struct ether_header);
     lest -= sizeof(struct ether_header);
-    if (memcmp(&eh->ether_dhost, Device[deviceNo].hwaddr, 6) != 0)
-    { // 送信先MACアドレスが自分宛てでない場合
-        DebugPrintf("[%d]:dhost not match %s\n", deviceNo, my_ether_ntoa_r((u_char *)&eh->ether_dhost, buf, sizeof(buf)));
+    if (memcmp(&eh->ether_dhost, Device[deviceNo].hwaddr, 6) != 0 &&
+        !(eh->ether_type == htons(ETHERTYPE_ARP) && memcmp(&eh->ether_dhost, bcast, 6) == 0))
+    { // 送信先MACアドレスが自分宛てでも, ブロードキャストのARPでもない場合
+        DebugPkt("[%d]:dhost not match %s\n", deviceNo, my_ether_ntoa_r((u_char *)&eh->ether_dhost, buf, sizeof(buf)));
         return -1;
     }
 
     if (ntohs(eh->ether_type) == ETHERTYPE_ARP)
     { // ARPパケットの場合
         struct ether_arp *arp;
-        DebugPrintf("[%d]:ARP packet\n", deviceNo);
+        int learn;
+        DebugPkt("[%d]:ARP packet\n", deviceNo);
         if (lest < sizeof(struct ether_arp))
         { // パケットサイズがARPヘッダより小さい場合
-            DebugPrintf("[%d]:lest(%d) < sizeof(struct ether_arp)\n", deviceNo, lest);
+            DebugPkt("[%d]:lest(%d) < sizeof(struct ether_arp)\n", deviceNo, lest);
+            Trace(TRACE_EV_DROP, deviceNo, TRACE_DROP_SHORT, 0, 0, size);
             return -1;
         }
 
         arp = (struct ether_arp *)ptr;
         ptr += sizeof(struct ether_arp);
         lest -= sizeof(struct ether_arp);
+        Trace(TRACE_EV_ARP, deviceNo, ntohs(arp->arp_op), *(in_addr_t *)arp->arp_spa, *(in_addr_t *)arp->arp_tpa, size);
+        // ブロードキャストのARPは自分のアドレス宛てのときだけ送信元を登録し, それ以外は既存エントリの更新だけ行う(RFC 826)
+        learn = memcmp(&eh->ether_dhost, bcast, 6) != 0 || IsMyAddr(*(in_addr_t *)arp->arp_tpa);
 
-        if (arp->arp_op == htons(ARPOP_REQUEST))
-        { // ARPリクエストの場合
-            DebugPrintf("[%d]recv:ARP REQUEST:%dbytes\n", deviceNo, size);
-            Ip2Mac(deviceNo, *(in_addr_t *)arp->arp_spa, arp->arp_sha);
-        }
-        if (arp->arp_op == htons(ARPOP_REPLY))
-        { // ARPリプライの場合
-            DebugPrintf("[%d]recv:ARP REPLY:%dbytes\n", deviceNo, size);
-            Ip2Mac(deviceNo, *(in_addr_t *)arp->arp_spa, arp->arp_sha);
+        if (arp->arp_op == htons(ARPOP_REQUEST) || arp->arp_op == htons(ARPOP_REPLY))
+        { // ARPリクエスト, ARPリプライの場合
+            DebugPkt("[%d]recv:ARP %s:%dbytes\n", deviceNo, arp->arp_op == htons(ARPOP_REQUEST) ? "REQUEST" : "REPLY", size);
+            if (learn)
+            {
+                Ip2MacRelease(Ip2Mac(deviceNo, *(in_addr_t *)arp->arp_spa, arp->arp_sha));
+            }
+            else
+            {
+                Ip2MacUpdate(deviceNo, *(in_addr_t *)arp->arp_spa, arp->arp_sha);
+            }
         }
     }
     else if (ntohs(eh->ether_type) == ETHERTYPE_IP)
     { // IPパケットの場合
-        DebugPrintf("[%d]:IP packet\n", deviceNo);
+        DebugPkt("[%d]:IP packet\n", deviceNo);
         struct iphdr *iphdr;
-        u_char option[1500];
+        u_char *option;
         int optionLen;
+        FIB_NEXTHOP *nh;
+        IP2MAC *ip2mac;
+        in_addr_t gw;
+        char buf2[80];
 
         if (lest < sizeof(struct iphdr))
         { // パケットサイズがIPヘッダより小さい場合
-            DebugPrintf("[%d]:lest(%d) < sizeof(struct iphdr)\n", deviceNo, lest);
+            DebugPkt("[%d]:lest(%d) < sizeof(struct iphdr)\n", deviceNo, lest);
+            Trace(TRACE_EV_DROP, deviceNo, TRACE_DROP_SHORT, 0, 0, size);
             return -1;
         }
         iphdr = (struct iphdr *)ptr;
         ptr += sizeof(struct iphdr);
         lest -= sizeof(struct iphdr);
 
+        // IPオプションはコピーせず, 受信バッファ上の位置と長さで扱う
         optionLen = iphdr->ihl * 4 - sizeof(struct iphdr);
-        if (0 < optionLen)
-        { // IPオプションがある場合
-            if (1500 <= optionLen)
-            { // IPオプションの長さが1500バイト以上の場合
-                DebugPrintf("[%d]:IP option length(%d) is too big\n", deviceNo, optionLen);
-                return -1;
-            }
-            memcpy(option, ptr, optionLen);
-            ptr += optionLen;
-            lest -= optionLen;
+        if (optionLen < 0 || lest < optionLen)
+        { // IPヘッダ長が不正, またはパケットに収まっていない場合
+            DebugPkt("[%d]:IP option length(%d) is invalid\n", deviceNo, optionLen);
+            Trace(TRACE_EV_DROP, deviceNo, TRACE_DROP_IHL, iphdr->saddr, iphdr->daddr, size);
+            return -1;
         }
+        option = ptr;
+        ptr += optionLen;
+        lest -= optionLen;
 
-        if (checkIPchecksum(iphdr, option, optionLen) == 0)
+        if (!Param.TrustRxCsum && checkIPchecksum(iphdr, option, optionLen) == 0)
         { // IPヘッダのチェックサムが正しくない場合
-            DebugPrintf("[%d]:bad ip checksum\n", deviceNo);
+            DebugPkt("[%d]:bad ip checksum\n", deviceNo);
+            Trace(TRACE_EV_DROP, deviceNo, TRACE_DROP_CSUM, iphdr->saddr, iphdr->daddr, size);
             fprintf(stderr, "IP checksum error\n");
             return -1;
         }
 
         if (iphdr->ttl - 1 == 0)
         { // TTLが0の場合
-            DebugPrintf("[%d]:iphdr->ttl==0 error\n", deviceNo);
+            DebugPkt("[%d]:iphdr->ttl==0 error\n", deviceNo);
+            Trace(TRACE_EV_DROP, deviceNo, TRACE_DROP_TTL, iphdr->saddr, iphdr->daddr, size);
             SendIcmpTimeExceeded(deviceNo, eh, iphdr, data, size);
             return -1;
         }
-        // 送信先デバイス番号の設定(0->1, 1->0)
-        tno = (!deviceNo);
-        if ((iphdr->daddr & Device[tno].netmask.s_addr) == Device[tno].subnet.s_addr)
-        { // 宛先IPアドレスが自ネットワーク内の場合
-            IP2MAC *ip2mac;
-
-            DebugPrintf("[%d]:%s to TargetSegment\n", deviceNo, in_addr_t2str(iphdr->daddr, buf, sizeof(buf)));
-
-            if (iphdr->daddr == Device[tno].addr.s_addr)
-            {
-                DebugPrintf("[%d]:recv:myaddr\n", deviceNo);
-                return 1;
-            }
-
-            ip2mac = Ip2Mac(tno, iphdr->daddr, NULL);
-            if (ip2mac->flag == FLAG_NG || ip2mac->sd.dno != 0)
-            { // ARPテーブルにエントリがない場合, AppendSendData() で送信待ちバッファに格納
-                DebugPrintf("[%d]:Ip2Mac error or sending\n", deviceNo);
-                AppendSendData(ip2mac, 1, iphdr->daddr, data, size);
-                return -1;
-            }
-            else
-            { // ARPテーブルにエントリがある場合, 後でEthernetヘッダの宛先を書き換えるために, hwaddr変数に格納
-                memcpy(hwaddr, ip2mac->hwaddr, 6);
-            }
+        // 経路表から送信先デバイスと次ホップを決める
+        nh = FibLookup(iphdr->daddr);
+        if (nh == NULL)
+        { // 経路がない場合
+            DebugPkt("[%d]:%s no route\n", deviceNo, in_addr_t2str(iphdr->daddr, buf, sizeof(buf)));
+            Trace(TRACE_EV_DROP, deviceNo, TRACE_DROP_NO_ROUTE, iphdr->saddr, iphdr->daddr, size);
+            return -1;
         }
-        else
-        { // 宛先IPアドレスが自ネットワーク外の場合
-            IP2MAC *ip2mac;
-
-            DebugPrintf("[%d]:%s to NextRouter\n", deviceNo, in_addr_t2str(iphdr->daddr, buf, sizeof(buf)));
+        tno = nh->deviceNo;
+        if (iphdr->daddr == Device[tno].addr.s_addr)
+        {
+            DebugPkt("[%d]:recv:myaddr\n", deviceNo);
+            return 1;
+        }
+        // 直接接続の経路なら宛先に, それ以外は次ホップに送る
+        gw = nh->gw ? nh->gw : iphdr->daddr;
+        DebugPkt("[%d]:%s to [%d] via %s\n", deviceNo, in_addr_t2str(iphdr->daddr, buf, sizeof(buf)), tno, in_addr_t2str(gw, buf2, sizeof(buf2)));
 
-            // 上位ルータのIPアドレスを設定
-            ip2mac = Ip2Mac(tno, NextRouter.s_addr, NULL);
-            if (ip2mac->flag == FLAG_NG || ip2mac->sd.dno != 0)
-            { // ARPテーブルにエントリがない場合, AppendSendData() で送信待ちバッファに格納
-                DebugPrintf("[%d]:Ip2Mac error or sending\n", deviceNo);
-                AppendSendData(ip2mac, 1, NextRouter.s_addr, data, size);
+        ip2mac = Ip2Mac(tno, gw, NULL);
+        if (ip2mac == NULL)
+        { // ARPテーブルに空きがない場合
+            Trace(TRACE_EV_DROP, deviceNo, TRACE_DROP_NO_ARP, iphdr->saddr, iphdr->daddr, size);
+            return -1;
+        }
+        if (ip2mac->flag == FLAG_NG || ip2mac->pending)
+        { // ARPテーブルにエントリがない場合, AppendSendData() で送信待ちバッファに格納
+            DebugPkt("[%d]:Ip2Mac error or sending\n", deviceNo);
+            Trace(TRACE_EV_ARP_WAIT, deviceNo, tno, iphdr->saddr, iphdr->daddr, size);
+            if (data == VnetFrame && VnetFinishCsum(data - VNET_HDR_SIZE, data, size) == -1)
+            { // 送信待ちキューにはvirtio_net_hdrを保存しないので, GROのフレームは待たせられない
+                DebugPkt("[%d]:GSO frame cannot wait for ARP\n", deviceNo);
+                Trace(TRACE_EV_DROP, deviceNo, TRACE_DROP_NO_ARP, iphdr->saddr, iphdr->daddr, size);
+                Ip2MacRelease(ip2mac);
                 return -1;
             }
-            else
-            { // ARPテーブルにエントリがある場合, 後でEthernetヘッダの宛先を書き換えるために, hwaddr変数に格納
-                memcpy(hwaddr, ip2mac->hwaddr, 6);
-            }
+            AppendSendData(ip2mac, tno, gw, data, size);
+            Ip2MacRelease(ip2mac);
+            return -1;
         }
-        // パケットの送出
-        memcpy(eh->ether_dhost, hwaddr, 6);
-        memcpy(eh->ether_shost, Device[tno].hwaddr, 6);
+        // パケットの送出. ARPテーブルのエントリが持つEthernetヘッダで書き換える
+        Ip2MacRewrite(ip2mac, data);
+        Ip2MacRelease(ip2mac);
 
-        iphdr->ttl--;
-        iphdr->check = 0;
-        iphdr->check = checksum2((u_char *)iphdr, sizeof(struct iphdr), option, optionLen);
+        if (Param.CsumMode == CSUM_MODE_INCR)
+        {
+            ipDecrementTtl(iphdr);
+        }
+        else
+        {
+            iphdr->ttl--;
+            iphdr->check = 0;
+            iphdr->check = checksum2((u_char *)iphdr, sizeof(struct iphdr), option, optionLen);
+        }
 
-        write(Device[tno].soc, data, size);
+        Trace(TRACE_EV_FWD, deviceNo, tno, iphdr->saddr, iphdr->daddr, size);
+        DeviceWrite(tno, data, size);
+        if (Param.Latency && RxStamp != 0 && CurWorker != NULL)
+        {
+            LatencyRecord(&CurWorker->lat, LatencyNow() - RxStamp);
+        }
     }
     else
     { // その他のパケットの場合
-        DebugPrintf("[%d]:unknown ether_type: %04X\n", deviceNo, ntohs(eh->ether_type));
+        DebugPkt("[%d]:unknown ether_type: %04X\n", deviceNo, ntohs(eh->ether_type));
     }
     return 0;
 }
 
+/**
+ * @brief スピンの経過時間を測る時刻
+ *
+ * @return CLOCK_MONOTONICの時刻(us)
+ */
+static u_int64_t SpinNow()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief ポートの受信済みフレームを処理する
+ * @details 受信リングはブロック単位で, 受信バッチはrecvmmsg()でまとめて処理し, @n
+ * それ以外はrecv()で1フレーム受信する. AF_XDPソケット(デバイス番号+DEVICE_MAX)は受信リングのフレームを処理する. @n
+ * どれも受信を待たないので, epollで受信可能になったポートにも, スピン中の全ポートにも使える
+ *
+ * @param w : ワーカー
+ * @param i : デバイス番号(AF_XDPソケットはデバイス番号+DEVICE_MAX)
+ * @return 処理したフレーム数
+ */
+static int RouterRecv(WORKER *w, int i)
+{
+    int size;
+    u_char *buf;
+
+    if (i >= DEVICE_MAX)
+    { // AF_XDPソケットの場合, 受信リングのフレームをまとめて処理(カーネルの受信時刻はないので処理開始時刻とする)
+        i -= DEVICE_MAX;
+        RxStamp = Param.Latency ? LatencyNow() : 0;
+        size = XskRxWalk(&w->port[i].xsk, i, AnalyzePacket);
+    }
+    else if (w->port[i].rx.map != NULL)
+    { // 受信リングの場合, ユーザ側に渡されたブロックをまとめて処理
+        size = RxRingWalk(&w->port[i].rx, i, AnalyzePacket);
+    }
+    else if (w->port[i].rxm.msgs != NULL)
+    { // 受信バッチの場合, 受信済みのフレームをまとめて処理
+        if ((size = RxMmsgRead(w->port[i].soc, &w->port[i].rxm, i, AnalyzePacket)) < 0)
+        {
+            size = 0;
+        }
+    }
+    else if (Param.Vnet)
+    { // virtio_net_hdr付きで受信し, GROのフレームはまとめたまま処理
+        buf = w->vnetBuf;
+        size = Param.Latency ? RecvStamp(w->port[i].soc, buf, VNET_HDR_SIZE + VNET_FRAME_MAX) : recv(w->port[i].soc, buf, VNET_HDR_SIZE + VNET_FRAME_MAX, MSG_DONTWAIT | MSG_TRUNC);
+        if (size == -1 && errno != EAGAIN)
+        {
+            DebugPerror("recv");
+        }
+        if (size <= VNET_HDR_SIZE || size > VNET_HDR_SIZE + VNET_FRAME_MAX)
+        { // 受信なし, またはバッファに収まらない
+            size = 0;
+        }
+        else
+        {
+            if (VnetIsGso(buf))
+            {
+                w->stats.gsoPackets++;
+            }
+            VnetFrame = buf + VNET_HDR_SIZE;
+            AnalyzePacket(i, VnetFrame, size - VNET_HDR_SIZE);
+            VnetFrame = NULL;
+            size = 1;
+        }
+    }
+    else if ((buf = PktBufRx()) == NULL)
+    { // 受信バッファがない場合は読み捨てる
+        recv(w->port[i].soc, NULL, 0, MSG_TRUNC | MSG_DONTWAIT);
+        size = 0;
+    }
+    else if ((size = Param.Latency ? RecvStamp(w->port[i].soc, buf, PKT_BUF_SIZE) : recv(w->port[i].soc, buf, PKT_BUF_SIZE, MSG_DONTWAIT)) <= 0)
+    {
+        if (size == -1 && errno != EAGAIN)
+        {
+            DebugPerror("recv");
+        }
+        size = 0;
+    }
+    else
+    {
+        AnalyzePacket(i, buf, size);
+        size = 1;
+    }
+    w->stats.rxPackets += size;
+    return size;
+}
+
 /**
  * @brief ルーター関数
- * @details
+ * @details ワーカーごとに1つ動き, 自分のポートに分配されたフレームを送信まで処理する. @n
+ * 受信を待つデバイスの数によらないよう, ポートのソケットはepollで待つ(AF_XDPソケットはデバイス番号+DEVICE_MAXで登録). @n
+ * スピンが有効(-s)なら, 受信があった後は Param.SpinUsec の間受信がなくなるまで, epollで眠らずに @n
+ * 全ポートを RouterRecv() で見て回る. 受信リングとAF_XDPはリングの状態を読むだけなので, システムコールを使わない. @n
+ * 送信リングに書き込まれたフレームはループの1周ごとにまとめて送信する. @n
+ * ワーカー0はepoll_wait()のタイムアウトを利用して, ARPテーブルのタイマ処理も行う. @n
+ * epoll_wait()で待つ間は経路表の静止状態とし, 経路表の入れ替えを待たせない. スピン中は1周ごとに静止状態を通る
+ *
+ * @param w : ワーカー
+ * @return 0 : 正常終了
  */
-int Router()
+int Router(WORKER *w)
 {
-    struct pollfd targets[2];
-    int nready, i, size;
-    u_char buf[2048];
-
-    targets[0].fd = Device[0].soc;
-    targets[0].events = POLLIN | POLLERR;
-    targets[1].fd = Device[1].soc;
-    targets[1].events = POLLIN | POLLERR;
+    struct epoll_event events[DEVICE_MAX];
+    int nready, n, i, spin = 0;
+    u_int64_t lastRecv = 0, now;
+
     while (EndFlag == 0)
     {
-        switch (nready = poll(targets, 2, 100))
+        if (spin)
+        {
+            // 経路表の静止状態を通過する
+            RcuOffline();
+            RcuOnline();
+            n = 0;
+            for (i = 0; i < DeviceNum; i++)
+            {
+                n += RouterRecv(w, i);
+                if (w->port[i].xsk.fd > 0)
+                {
+                    n += RouterRecv(w, DEVICE_MAX + i);
+                }
+            }
+            now = SpinNow();
+            if (n > 0)
+            {
+                lastRecv = now;
+            }
+            else if (now - lastRecv >= Param.SpinUsec)
+            { // 受信のない時間が予算を超えたらepollで眠る
+                spin = 0;
+            }
+        }
+        else
         {
-        case -1:
-            if (errno != EINTR)
+            // 受信を待つ間は経路表を参照しない(静止状態)
+            RcuOffline();
+            if ((nready = epoll_wait(w->efd, events, DEVICE_MAX, 100)) == -1)
             {
-                DebugPerror("poll");
+                if (errno != EINTR)
+                {
+                    DebugPerror("epoll_wait");
+                }
+                nready = 0;
             }
-            break;
-        case 0:
-            break;
-        default:
-            for (i = 0; i < 2; i++)
+            RcuOnline();
+            for (n = 0; n < nready; n++)
+            {
+                RouterRecv(w, events[n].data.u32);
+            }
+            if (nready > 0 && Param.SpinUsec > 0)
+            {
+                spin = 1;
+                lastRecv = SpinNow();
+            }
+        }
+        if (w->no == 0)
+        { // ARPテーブルのタイマ処理はワーカー0が行う
+            Ip2MacTimer();
+        }
+        for (i = 0; i < DeviceNum; i++)
+        {
+            DeviceFlush(i);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief io_uringによるルーター関数
+ * @details Router()のepoll_wait()とBufThreadの代わりに, 1つのio_uringの完了キューで全ての事象を待つ. @n
+ * デバイスごとにマルチショット受信を1つ投入しておき, 受信したフレームは提供バッファ上でそのまま処理する. @n
+ * 転送するフレームは DeviceWrite() から受信バッファのまま送信要求を積み, 送信の完了でバッファを返す. @n
+ * ワーカー0はタイマの完了でARPテーブルのタイマ処理を, eventfdの読み込みの完了で送信待ちデータの送信を行う. @n
+ * 他のワーカーも終了フラグを確認するためタイマを投入する. @n
+ * 積んだ要求は完了待ちの io_uring_enter() でまとめて投入し, その間は経路表の静止状態とする. @n
+ * スピンが有効(-s)なら, 完了があった後は Param.SpinUsec の間完了がなくなるまで, 待たない io_uring_enter() を繰り返す
+ *
+ * @param w : ワーカー
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int RouterUring(WORKER *w)
+{
+    URING *u = &w->uring;
+    u_int64_t userData, lastRecv = 0, now;
+    u_int32_t flags;
+    int i, res, bid, n, spin = 0;
+
+    // SINGLE_ISSUERのio_uringは作ったスレッドからしか投入できないので, ワーカースレッドで作る
+    if (URingInit(u) == -1)
+    {
+        return -1;
+    }
+    for (i = 0; i < DeviceNum; i++)
+    {
+        if (URingInitBufs(u, &w->port[i].rxb, i) == -1 || URingRecv(u, w->port[i].soc, &w->port[i].rxb, i) == -1)
+        {
+            URingFree(u);
+            return -1;
+        }
+    }
+    URingTimeout(u, 100);
+    if (w->no == 0)
+    {
+        URingReadEvent(u, BufferSendEventFd());
+    }
+
+    while (EndFlag == 0)
+    {
+        // 完了を待つ間は経路表を参照しない(静止状態)
+        RcuOffline();
+        URingEnter(u, !spin);
+        RcuOnline();
+        n = 0;
+        while (URingPeek(u, &userData, &res, &flags))
+        {
+            n++;
+            i = URING_UD_DEVICE(userData);
+            switch (URING_UD_OP(userData))
             {
-                if (targets[i].revents & (POLLIN | POLLERR))
+            case URING_OP_RECV:
+                if ((bid = URingBufId(flags)) != -1)
                 {
-                    if ((size = read(Device[i].soc, buf, sizeof(buf))) <= 0)
-                    {
-                        DebugPerror("read");
+                    u->rxData = w->port[i].rxb.bufs + (size_t)bid * URING_BUF_SIZE;
+                    u->rxDevice = i;
+                    u->rxBid = bid;
+                    u->rxTaken = 0;
+                    if (res > 0)
+                    { // カーネルの受信時刻はないので完了を取り出した時刻とする
+                        RxStamp = Param.Latency ? LatencyNow() : 0;
+                        w->stats.rxPackets++;
+                        AnalyzePacket(i, u->rxData, res);
                     }
-                    else
-                    {
-                        AnalyzePacket(i, buf, size);
+                    u->rxData = NULL;
+                    if (!u->rxTaken)
+                    { // 送信に使わなかったバッファはすぐに返す
+                        URingReturnBuf(&w->port[i].rxb, bid);
                     }
                 }
+                else if (res < 0 && res != -ENOBUFS)
+                {
+                    DebugPrintf("[%d]:io_uring recv:%s\n", i, strerror(-res));
+                }
+                if (!URingMore(flags))
+                { // バッファ切れなどでマルチショット受信が終わったら投入し直す
+                    URingRecv(u, w->port[i].soc, &w->port[i].rxb, i);
+                }
+                break;
+            case URING_OP_SEND:
+                if (res < 0)
+                {
+                    DebugPrintf("[%d]:io_uring send:%s\n", i, strerror(-res));
+                }
+                URingReturnBuf(&w->port[i].rxb, URING_UD_BID(userData));
+                break;
+            case URING_OP_TIMEOUT:
+                if (w->no == 0)
+                { // ARPテーブルのタイマ処理はワーカー0が行う
+                    Ip2MacTimer();
+                }
+                URingTimeout(u, 100);
+                break;
+            case URING_OP_EVENT:
+                BufferSendPending();
+                URingReadEvent(u, BufferSendEventFd());
+                break;
+            }
+        }
+        for (i = 0; i < DeviceNum; i++)
+        {
+            URingPublishBufs(&w->port[i].rxb);
+            DeviceFlush(i);
+        }
+        if (Param.SpinUsec > 0)
+        {
+            now = SpinNow();
+            if (n > 0)
+            {
+                spin = 1;
+                lastRecv = now;
+            }
+            else if (spin && now - lastRecv >= Param.SpinUsec)
+            { // 完了のない時間が予算を超えたら完了を待って眠る
+                spin = 0;
             }
-            break;
         }
     }
+    URingFree(u);
     return 0;
 }
 
@@ -365,6 +770,49 @@ void *BufThread(void *arg)
     return NULL;
 }
 
+/**
+ * @brief ワーカースレッド
+ * @details 割り当てられたCPUに自分を固定し, Router()を実行する
+ *
+ */
+void *WorkerThread(void *arg)
+{
+    WORKER *w = (WORKER *)arg;
+    cpu_set_t cpus;
+    int status;
+
+    CurWorker = w;
+    if (w->cpu >= 0)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(w->cpu, &cpus);
+        if ((status = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) != 0)
+        {
+            DebugPrintf("pthread_setaffinity_np:%s\n", strerror(status));
+        }
+    }
+    if (RcuRegister() == -1)
+    { // 登録せずに経路表を参照すると, 入れ替え時に解放された表を参照してしまう
+        DebugPrintf("RcuRegister:error\n");
+        EndFlag = 1;
+        return NULL;
+    }
+    if (Param.RxMode == RX_MODE_URING)
+    {
+        if (RouterUring(w) == -1)
+        {
+            DebugPrintf("RouterUring:error\n");
+            EndFlag = 1;
+        }
+    }
+    else
+    {
+        Router(w);
+    }
+    RcuUnregister();
+    return NULL;
+}
+
 /**
  * @brief カーネルのIPフォワーディングを無効にする
  *
@@ -393,84 +841,735 @@ void EndSignal(int sig)
     EndFlag = 1;
 }
 
-pthread_t BufTid;
-
 /**
- * @brief メイン処理
+ * @brief 経路表の再読み込みを要求するシグナルハンドラ(SIGHUP)
  *
- * @param argv
- * @param envp
- * @return int
+ * @param sig : シグナル番号
  */
-int main(int argc, char *argv[], char *envp[])
+void ReloadSignal(int sig)
 {
-    char buf[80];
-    pthread_attr_t attr;
-    int status;
+    ReloadFlag = 1;
+}
 
-    inet_aton(Param.NextRouter, &NextRouter);
-    DebugPrintf("NextRouter=%s\n", my_inet_ntoa_r(&NextRouter, buf, sizeof(buf)));
-    // デバイス1の情報取得とディスクリプタの初期化
-    if (GetDeviceInfo(Param.Device1, Device[0].hwaddr, &Device[0].addr, &Device[0].subnet, &Device[0].netmask) == -1)
-    {
-        DebugPrintf("GetDeviceInfo:error:%s\n", Param.Device1);
-        return -1;
-    }
-    if ((Device[0].soc = InitRawSocket(Param.Device1, 0, 0)) == -1)
-    {
-        DebugPrintf("InitRawSocket:error:%s\n", Param.Device1);
-        return -1;
-    }
-    DebugPrintf("%s OK\n", Param.Device1);
-    DebugPrintf("hwaddr=%s\n", my_ether_ntoa_r(&Device[0].hwaddr, buf, sizeof(buf)));
-    DebugPrintf("addr=%s\n", my_inet_ntoa_r(&Device[0].addr, buf, sizeof(buf)));
-    DebugPrintf("subnet=%s\n", my_inet_ntoa_r(&Device[0].subnet, buf, sizeof(buf)));
-    DebugPrintf("netmask=%s\n", my_inet_ntoa_r(&Device[0].netmask, buf, sizeof(buf)));
+/**
+ * @brief 転送遅延の出力を要求するシグナルハンドラ(SIGUSR1)
+ *
+ * @param sig : シグナル番号
+ */
+void LatencySignal(int sig)
+{
+    LatencyFlag = 1;
+}
 
-    // デバイス2の情報取得とディスクリプタの初期化
-    if (GetDeviceInfo(Param.Device2, Device[1].hwaddr, &Device[1].addr, &Device[1].subnet, &Device[1].netmask) == -1)
-    {
-        DebugPrintf("GetDeviceInfo:error:%s\n", Param.Device2);
-        return -1;
-    }
-    if ((Device[1].soc = InitRawSocket(Param.Device2, 0, 0)) == -1)
-    {
-        DebugPrintf("InitRawSocket:error:%s\n", Param.Device2);
-        return -1;
-    }
-    DebugPrintf("%s OK\n", Param.Device2);
-    DebugPrintf("hwaddr=%s\n", my_ether_ntoa_r(&Device[1].hwaddr, buf, sizeof(buf)));
-    DebugPrintf("addr=%s\n", my_inet_ntoa_r(&Device[1].addr, buf, sizeof(buf)));
-    DebugPrintf("subnet=%s\n", my_inet_ntoa_r(&Device[1].subnet, buf, sizeof(buf)));
-    DebugPrintf("netmask=%s\n", my_inet_ntoa_r(&Device[1].netmask, buf, sizeof(buf)));
+pthread_t BufTid;
+pthread_t ControlTid;
 
-    // IPフォワーディングの無効化
-    DisableIpForward();
+/**
+ * @brief コマンドライン引数から動作パラメータを設定
+ * @details -r read : read()で受信(デフォルト) @n
+ * -r ring : PACKET_MMAP(TPACKET_V3)の受信リングで受信 @n
+ * -r mmsg : recvmmsg()でまとめて受信 @n
+ * -r xdp : AF_XDP(XDP汎用モード)で受信し, 転送するフレームはコピーせずに送信する. ワーカーは1つだけ @n
+ * -r uring : io_uringのマルチショット受信で受信し, 転送するフレームは受信バッファのまま送信する. BufThreadは使わない @n
+ * -t write : write()で送信(デフォルト) @n
+ * -t ring : PACKET_MMAP(TPACKET_V2)の送信リングで送信 @n
+ * -t mmsg : sendmmsg()でまとめて送信 @n
+ * -n N : recvmmsg()/sendmmsg()で1回に扱う最大フレーム数 @n
+ * -w N : ワーカースレッド数(最大 RCU_READER_MAX. 2以上でPACKET_FANOUTを使用) @n
+ * -f hash|cpu : ワーカーへの分配方式(フローのハッシュ, または受信CPU) @n
+ * -a N : デバイスごとに事前確保するARPテーブルのエントリ数 @n
+ * -p N : 事前確保するパケットバッファ数 @n
+ * -H : パケットバッファをhugepageで確保する @n
+ * -q N : 近隣ノードごとの送信待ちキューの長さ @n
+ * -d tail|oldest : 送信待ちキューが一杯のとき, 新しいパケットと一番古いパケットのどちらを捨てるか @n
+ * -c full|incr : 転送時にIPヘッダのチェックサムを計算し直すか, 差分更新するか @n
+ * -T : 受信したIPヘッダのチェックサムを検証しない(NICや前段で検証済みの場合) @n
+ * -l 0|1|2 : デバッグ出力のレベル(出力しない, 起動・エラー・ARPテーブルの変化まで, パケットごとの処理まで(デフォルト)) @n
+ * -x file : パケットごとのトレースをスレッドごとのリングに記録し, 書き出しスレッドでファイルに出力する("-"なら標準エラー出力) @n
+ * -R file : 経路ファイルから経路表を作る(省略時はデバイスの直接接続の経路と, NextRouterへのデフォルト経路). SIGHUPで読み直す @n
+ * -i dev[,dev...] : 使用するネットワークインターフェース(デフォルトは eth0,eth1. 最大 DEVICE_MAX 個) @n
+ * -s usec : 受信後, 受信のない時間がusecになるまで眠らずにスピンで受信を待つ. ソケットにはSO_BUSY_POLLを設定する @n
+ * -L : 受信(カーネルの受信時刻)から送出までの転送遅延を記録し, 終了時とSIGUSR1でp50/p99/p999を出力する @n
+ * -G : PACKET_VNET_HDRを使い, GROでまとめられたフレームを1回の経路検索で転送してGSOで送る(-r read -t write のみ) @n
+ * -b : PACKET_QDISC_BYPASSを有効にする
+ *
+ * @param argc : 引数の数
+ * @param argv : 引数
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int ParseParam(int argc, char *argv[])
+{
+    int c;
 
-    // 送信待ちバッファ処理用のスレッド起動
-    pthread_attr_init(&attr);
-    if ((status = pthread_create(&BufTid, &attr, BufThread, NULL)) != 0)
+    while ((c = getopt(argc, argv, "r:t:bn:w:f:a:p:Hq:d:c:Tl:x:R:i:s:LG")) != -1)
     {
-        DebugPrintf("pthread_create:%s\n", strerror(status));
-        // return -1;
-    }
-    // シグナルハンドラの設定
-    signal(SIGINT, EndSignal);
-    signal(SIGTERM, EndSignal);
+        switch (c)
+        {
+        case 'r':
+            if (strcmp(optarg, "read") == 0)
+            {
+                Param.RxMode = RX_MODE_READ;
+            }
+            else if (strcmp(optarg, "ring") == 0)
+            {
+                Param.RxMode = RX_MODE_RING;
+            }
+            else if (strcmp(optarg, "mmsg") == 0)
+            {
+                Param.RxMode = RX_MODE_MMSG;
+            }
+            else if (strcmp(optarg, "xdp") == 0)
+            {
+                Param.RxMode = RX_MODE_XDP;
+            }
+            else if (strcmp(optarg, "uring") == 0)
+            {
+                Param.RxMode = RX_MODE_URING;
+            }
+            else
+            {
+                fprintf(stderr, "unknown rx mode: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 't':
+            if (strcmp(optarg, "write") == 0)
+            {
+                Param.TxMode = TX_MODE_WRITE;
+            }
+            else if (strcmp(optarg, "ring") == 0)
+            {
+                Param.TxMode = TX_MODE_RING;
+            }
+            else if (strcmp(optarg, "mmsg") == 0)
+            {
+                Param.TxMode = TX_MODE_MMSG;
+            }
+            else
+            {
+                fprintf(stderr, "unknown tx mode: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'b':
+            Param.QdiscBypass = 1;
+            break;
+        case 'n':
+            Param.BatchSize = atoi(optarg);
+            if (Param.BatchSize < 1 || Param.BatchSize > MMSG_BATCH_MAX)
+            {
+                fprintf(stderr, "batch size must be 1..%d\n", MMSG_BATCH_MAX);
+                return -1;
+            }
+            break;
+        case 'w':
+            Param.Workers = atoi(optarg);
+            if (Param.Workers < 1 || Param.Workers > RCU_READER_MAX)
+            { // ワーカーはすべて経路表の読み手として登録する
+                fprintf(stderr, "workers must be 1..%d\n", RCU_READER_MAX);
+                return -1;
+            }
+            break;
+        case 'f':
+            if (strcmp(optarg, "hash") == 0)
+            {
+                Param.FanoutMode = FANOUT_MODE_HASH;
+            }
+            else if (strcmp(optarg, "cpu") == 0)
+            {
+                Param.FanoutMode = FANOUT_MODE_CPU;
+            }
+            else
+            {
+                fprintf(stderr, "unknown fanout mode: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'a':
+            Param.ArpPrealloc = atoi(optarg);
+            break;
+        case 'p':
+            Param.PktPool = atoi(optarg);
+            break;
+        case 'H':
+            Param.HugePage = 1;
+            break;
+        case 'q':
+            Param.SendDepth = atoi(optarg);
+            if (Param.SendDepth < 1)
+            {
+                fprintf(stderr, "queue depth must be >= 1\n");
+                return -1;
+            }
+            break;
+        case 'd':
+            if (strcmp(optarg, "tail") == 0)
+            {
+                Param.SendDrop = SEND_DROP_TAIL;
+            }
+            else if (strcmp(optarg, "oldest") == 0)
+            {
+                Param.SendDrop = SEND_DROP_OLDEST;
+            }
+            else
+            {
+                fprintf(stderr, "unknown drop policy: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'c':
+            if (strcmp(optarg, "full") == 0)
+            {
+                Param.CsumMode = CSUM_MODE_FULL;
+            }
+            else if (strcmp(optarg, "incr") == 0)
+            {
+                Param.CsumMode = CSUM_MODE_INCR;
+            }
+            else
+            {
+                fprintf(stderr, "unknown checksum mode: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'T':
+            Param.TrustRxCsum = 1;
+            break;
+        case 'i':
+            Param.Devices = optarg;
+            break;
+        case 's':
+            Param.SpinUsec = atoi(optarg);
+            if (Param.SpinUsec < 0)
+            {
+                fprintf(stderr, "spin time must be >= 0\n");
+                return -1;
+            }
+            break;
+        case 'L':
+            Param.Latency = 1;
+            break;
+        case 'G':
+            Param.Vnet = 1;
+            break;
+        case 'R':
+            Param.RouteFile = optarg;
+            break;
+        case 'x':
+            Param.TraceFile = optarg;
+            break;
+        case 'l':
+            Param.DebugOut = atoi(optarg);
+            if (Param.DebugOut < DEBUG_LEVEL_NONE || Param.DebugOut > DEBUG_LEVEL_PKT)
+            {
+                fprintf(stderr, "debug level must be %d..%d\n", DEBUG_LEVEL_NONE, DEBUG_LEVEL_PKT);
+                return -1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r read|ring|mmsg|xdp|uring] [-t write|ring|mmsg] [-b] [-n batch] [-w workers] [-f hash|cpu] [-a arp_entries] [-p pkt_bufs] [-H] [-q depth] [-d tail|oldest] [-c full|incr] [-T] [-l level] [-x trace_file] [-R route_file] [-i dev,...] [-s spin_usec] [-L] [-G]\n", argv[0]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief デバイスの準備
+ * @details Param.Devices のネットワークインターフェースを順にデバイス番号0, 1, ...とし, @n
+ * 情報の取得とソケットの初期化を行う
+ *
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int InitDevices()
+{
+    char buf[80], *names, *name, *save;
+    DEVICE *dev;
+
+    if ((names = strdup(Param.Devices)) == NULL)
+    {
+        DebugPerror("strdup");
+        return -1;
+    }
+    for (name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save))
+    {
+        if (DeviceNum == DEVICE_MAX)
+        {
+            DebugPrintf("too many devices(max %d)\n", DEVICE_MAX);
+            return -1;
+        }
+        dev = &Device[DeviceNum];
+        dev->name = name;
+        if (GetDeviceInfo(name, dev->hwaddr, &dev->addr, &dev->subnet, &dev->netmask) == -1)
+        {
+            DebugPrintf("GetDeviceInfo:error:%s\n", name);
+            return -1;
+        }
+        if ((dev->soc = InitRawSocket(name, 0, 0, dev->hwaddr)) == -1)
+        {
+            DebugPrintf("InitRawSocket:error:%s\n", name);
+            return -1;
+        }
+        DebugPrintf("[%d] %s OK\n", DeviceNum, name);
+        DebugPrintf("hwaddr=%s\n", my_ether_ntoa_r(dev->hwaddr, buf, sizeof(buf)));
+        DebugPrintf("addr=%s\n", my_inet_ntoa_r(&dev->addr, buf, sizeof(buf)));
+        DebugPrintf("subnet=%s\n", my_inet_ntoa_r(&dev->subnet, buf, sizeof(buf)));
+        DebugPrintf("netmask=%s\n", my_inet_ntoa_r(&dev->netmask, buf, sizeof(buf)));
+        DeviceNum++;
+    }
+    if (DeviceNum == 0)
+    {
+        DebugPrintf("no device\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief ワーカーのポートを準備する
+ * @details ワーカー0はデバイスのソケットをそのまま使い, それ以外のワーカーは同じデバイスに別のソケットを作成する. @n
+ * 受信方式, 送信方式に応じてリングやバッチを設定し, ワーカーが複数の場合はPACKET_FANOUTグループに参加する. @n
+ * AF_XDPの場合はデバイスのソケットはARPなどの受信に使い, IPv4はAF_XDPソケットで送受信する. @n
+ * リングの準備に失敗した場合はread()/write()での送受信にフォールバックする
+ *
+ * @param w : ワーカー
+ * @param deviceNo : デバイス番号
+ * @param device : ネットワークインターフェース名
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int InitPort(WORKER *w, int deviceNo, char *device)
+{
+    IO_PORT *port = &w->port[deviceNo];
+
+    memset(port, 0, sizeof(IO_PORT));
+    if (w->no == 0)
+    {
+        port->soc = Device[deviceNo].soc;
+    }
+    else if ((port->soc = InitRawSocket(device, 0, 0, Device[deviceNo].hwaddr)) == -1)
+    {
+        DebugPrintf("InitRawSocket:error:%s\n", device);
+        return -1;
+    }
+
+    // 受信リングや送信リングより先に設定する
+    if (Param.Vnet && SetVnetHdr(port->soc) == -1)
+    {
+        DebugPrintf("SetVnetHdr:error:%s\n", device);
+        return -1;
+    }
+
+    if (Param.RxMode == RX_MODE_XDP)
+    {
+        if (XskOpen(&port->xsk, &XskUmem, device, Device[deviceNo].hwaddr) == -1)
+        {
+            DebugPrintf("XskOpen:error:%s\n", device);
+            return -1;
+        }
+        DebugPrintf("%s AF_XDP %uframes x %ubytes\n", device, XSK_RING_SIZE, XSK_FRAME_SIZE);
+    }
+    if (Param.RxMode == RX_MODE_RING)
+    {
+        if (InitRxRing(port->soc, &port->rx, Param.SpinUsec > 0 ? RX_RING_RETIRE_TOV_SPIN : RX_RING_RETIRE_TOV) == -1)
+        {
+            DebugPrintf("InitRxRing:error:%s, fallback to read()\n", device);
+        }
+        else
+        {
+            DebugPrintf("%s rx ring %ublocks x %ubytes\n", device, port->rx.blockNr, port->rx.blockSize);
+        }
+    }
+    if (Param.RxMode == RX_MODE_MMSG && InitMmsgBatch(&port->rxm, Param.BatchSize) == -1)
+    {
+        DebugPrintf("InitMmsgBatch:error:%s, fallback to read()\n", device);
+    }
+    if (Param.TxMode == TX_MODE_MMSG && InitMmsgBatch(&port->txm, Param.BatchSize) == -1)
+    {
+        DebugPrintf("InitMmsgBatch:error:%s, fallback to write()\n", device);
+    }
+    if (Param.TxMode == TX_MODE_RING)
+    {
+        if (InitTxRing(device, &port->tx, Param.QdiscBypass) == -1)
+        {
+            DebugPrintf("InitTxRing:error:%s, fallback to write()\n", device);
+        }
+        else
+        {
+            DebugPrintf("%s tx ring %uframes x %ubytes\n", device, port->tx.frameNr, port->tx.frameSize);
+        }
+    }
+    if (Param.SpinUsec > 0)
+    { // ドライバが対応していれば, 受信待ちでもNAPIをポーリングさせる
+        SetBusyPoll(port->soc, Param.SpinUsec);
+    }
+    if (Param.Latency && port->rx.map == NULL)
+    { // 受信リングのフレームには常に受信時刻が付く
+        SetRxTimestamp(port->soc);
+    }
+    if (Param.QdiscBypass && port->tx.map == NULL)
+    { // write()で送信する場合も受信用ソケットでqdiscを迂回する
+        SetQdiscBypass(port->soc);
+    }
+    if (port->tx.map != NULL || Param.Workers > 1)
+    { // 送信専用ソケットや他のワーカーが送ったフレームを拾わないようにする
+        SetIgnoreOutgoing(port->soc);
+    }
+    if (Param.Workers > 1)
+    { // デバイスごとのグループに参加(リングの設定後に行う)
+        if (JoinFanout(port->soc, (getpid() + deviceNo) & 0xFFFF, Param.FanoutMode) == -1)
+        {
+            DebugPrintf("JoinFanout:error:%s\n", device);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief ワーカーのポートの解放
+ *
+ * @param w : ワーカー
+ * @param deviceNo : デバイス番号
+ * @return 0 : 正常終了
+ */
+int FreePort(WORKER *w, int deviceNo)
+{
+    IO_PORT *port = &w->port[deviceNo];
+
+    XskClose(&port->xsk);
+    URingFreeBufs(&port->rxb);
+    FreeRxRing(&port->rx);
+    FreeTxRing(&port->tx);
+    FreeMmsgBatch(&port->rxm);
+    FreeMmsgBatch(&port->txm);
+    if (w->no != 0 && port->soc > 0)
+    {
+        close(port->soc);
+    }
+    return 0;
+}
+
+/**
+ * @brief ワーカーの準備
+ * @details ワーカーを Param.Workers 個確保し, それぞれのポートを準備してepollに登録する. @n
+ * ワーカーが複数の場合は, ワーカー番号順にCPUを割り当てる. @n
+ * AF_XDPの場合は, デバイスごとに受信用と送信用のフレームを確保できる大きさのUMEMを作る. @n
+ * PACKET_VNET_HDRの場合は, ワーカーごとにGROでまとめられたフレームが収まる受信バッファを確保する
+ *
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int InitWorkers()
+{
+    struct epoll_event ev;
+    int i, no, ncpu;
+
+    if (Param.Vnet && (Param.RxMode != RX_MODE_READ || Param.TxMode != TX_MODE_WRITE))
+    {
+        DebugPrintf("PACKET_VNET_HDR supports only -r read -t write\n");
+        return -1;
+    }
+    if (Param.RxMode == RX_MODE_XDP)
+    {
+        if (Param.Workers > 1)
+        {
+            DebugPrintf("AF_XDP supports only 1 worker\n");
+            return -1;
+        }
+        if (XskUmemInit(&XskUmem, (DeviceNum * 3 + 1) * XSK_RING_SIZE) == -1)
+        {
+            return -1;
+        }
+    }
+
+    if (posix_memalign((void **)&Worker, 64, sizeof(WORKER) * Param.Workers) != 0)
+    {
+        DebugPrintf("posix_memalign:error\n");
+        return -1;
+    }
+    memset(Worker, 0, sizeof(WORKER) * Param.Workers);
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    for (i = 0; i < Param.Workers; i++)
+    {
+        Worker[i].no = i;
+        if (Param.Vnet && (Worker[i].vnetBuf = (u_char *)malloc(VNET_HDR_SIZE + VNET_FRAME_MAX)) == NULL)
+        {
+            DebugPerror("malloc");
+            return -1;
+        }
+        Worker[i].cpu = (Param.Workers > 1 && ncpu > 0) ? i % ncpu : -1;
+        if ((Worker[i].efd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        {
+            DebugPerror("epoll_create1");
+            return -1;
+        }
+        for (no = 0; no < DeviceNum; no++)
+        {
+            if (InitPort(&Worker[i], no, Device[no].name) == -1)
+            {
+                return -1;
+            }
+            ev.events = EPOLLIN;
+            ev.data.u32 = no;
+            if (epoll_ctl(Worker[i].efd, EPOLL_CTL_ADD, Worker[i].port[no].soc, &ev) == -1)
+            {
+                DebugPerror("epoll_ctl");
+                return -1;
+            }
+            ev.data.u32 = DEVICE_MAX + no;
+            if (Worker[i].port[no].xsk.fd > 0 && epoll_ctl(Worker[i].efd, EPOLL_CTL_ADD, Worker[i].port[no].xsk.fd, &ev) == -1)
+            {
+                DebugPerror("epoll_ctl");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 経路表の準備
+ * @details 経路ファイルが指定されていればそれを読み込む. @n
+ * なければ各デバイスの直接接続の経路と, NextRouterへのデフォルト経路を登録する. @n
+ * NextRouterへは, そのアドレスを含むサブネットのデバイスから(どれにも含まれなければ最後のデバイスから)送る
+ *
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int InitFib()
+{
+    char *devices[DEVICE_MAX];
+    int i, dev = DeviceNum - 1;
+
+    if (FibInit() == -1)
+    {
+        return -1;
+    }
+    if (Param.RouteFile != NULL)
+    {
+        for (i = 0; i < DeviceNum; i++)
+        {
+            devices[i] = Device[i].name;
+        }
+        if (FibLoad(Param.RouteFile, devices, DeviceNum) == -1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        for (i = 0; i < DeviceNum; i++)
+        {
+            FibAdd(Device[i].subnet.s_addr, __builtin_popcount(Device[i].netmask.s_addr), 0, i);
+            if ((NextRouter.s_addr & Device[i].netmask.s_addr) == Device[i].subnet.s_addr)
+            {
+                dev = i;
+            }
+        }
+        FibAdd(0, 0, NextRouter.s_addr, dev);
+    }
+    return FibBuild();
+}
+
+/**
+ * @brief 全ワーカーの転送遅延を合わせてp50/p99/p999を出力する
+ * @details 転送中のワーカーのヒストグラムも止めずに読む
+ *
+ * @return 0 : 正常終了
+ */
+int LatencyReportAll()
+{
+    LAT_HIST *all;
+    char name[16];
+    int i;
+
+    if (!Param.Latency)
+    {
+        return 0;
+    }
+    if ((all = (LAT_HIST *)calloc(1, sizeof(LAT_HIST))) == NULL)
+    {
+        DebugPerror("calloc");
+        return -1;
+    }
+    for (i = 0; i < Param.Workers; i++)
+    {
+        if (Param.Workers > 1)
+        {
+            snprintf(name, sizeof(name), "%d", i);
+            LatencyReport(name, &Worker[i].lat);
+        }
+        LatencyMerge(all, &Worker[i].lat);
+    }
+    LatencyReport("all", all);
+    free(all);
+    return 0;
+}
+
+/**
+ * @brief 経路表を入れ替える制御スレッド
+ * @details SIGHUPを受けたら経路表を作り直して公開する. ワーカーは止めずに転送を続ける. @n
+ * 作り直せなかった場合はそれまでの経路表を使い続ける. @n
+ * SIGUSR1を受けたら転送遅延を出力する
+ *
+ */
+void *ControlThread(void *arg)
+{
+    while (EndFlag == 0)
+    {
+        poll(NULL, 0, 100);
+        if (LatencyFlag)
+        {
+            LatencyFlag = 0;
+            LatencyReportAll();
+        }
+        if (ReloadFlag)
+        {
+            ReloadFlag = 0;
+            DebugPrintf("reload routes\n");
+            if (InitFib() == -1)
+            {
+                DebugPrintf("InitFib:error, keep current routes\n");
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief メイン処理
+ *
+ * @param argv
+ * @param envp
+ * @return int
+ */
+int main(int argc, char *argv[], char *envp[])
+{
+    char buf[80];
+    pthread_attr_t attr;
+    int status, i, no;
+    unsigned long rx, tx;
+
+    if (ParseParam(argc, argv) == -1)
+    {
+        return -1;
+    }
+    DebugLevel = Param.DebugOut;
+
+    inet_aton(Param.NextRouter, &NextRouter);
+    DebugPrintf("NextRouter=%s\n", my_inet_ntoa_r(&NextRouter, buf, sizeof(buf)));
+    // デバイスの情報取得とディスクリプタの初期化
+    if (InitDevices() == -1)
+    {
+        return -1;
+    }
+
+    // ARPテーブルの準備
+    for (i = 0; i < DeviceNum; i++)
+    {
+        if (Ip2MacInit(i, Param.ArpPrealloc) == -1)
+        {
+            DebugPrintf("Ip2MacInit:error\n");
+            return -1;
+        }
+    }
+    SendQueueInit(Param.SendDepth, Param.SendDrop);
+    if (PktPoolInit(Param.PktPool, Param.HugePage) == -1)
+    {
+        DebugPrintf("PktPoolInit:error\n");
+        return -1;
+    }
+    if (InitFib() == -1)
+    {
+        DebugPrintf("InitFib:error\n");
+        return -1;
+    }
+
+    // ワーカーの準備
+    if (InitWorkers() == -1)
+    {
+        return -1;
+    }
+    DebugPrintf("workers=%d\n", Param.Workers);
+    if (Param.TraceFile != NULL && TraceInit(Param.TraceFile) == -1)
+    {
+        DebugPrintf("TraceInit:error\n");
+        return -1;
+    }
+
+    // IPフォワーディングの無効化
+    DisableIpForward();
+
+    // 送信待ちバッファ処理用のスレッド起動(io_uringの場合はワーカー0が処理する)
+    pthread_attr_init(&attr);
+    if (Param.RxMode != RX_MODE_URING && (status = pthread_create(&BufTid, &attr, BufThread, NULL)) != 0)
+    {
+        DebugPrintf("pthread_create:%s\n", strerror(status));
+        // return -1;
+    }
+    // シグナルハンドラの設定
+    signal(SIGINT, EndSignal);
+    signal(SIGTERM, EndSignal);
     signal(SIGQUIT, EndSignal);
+    signal(SIGHUP, ReloadSignal);
+    signal(SIGUSR1, LatencySignal);
 
     signal(SIGPIPE, SIG_IGN);
     signal(SIGTTIN, SIG_IGN);
     signal(SIGTTOU, SIG_IGN);
 
+    // 経路表を入れ替える制御スレッド起動
+    if ((status = pthread_create(&ControlTid, &attr, ControlThread, NULL)) != 0)
+    {
+        DebugPrintf("pthread_create:%s\n", strerror(status));
+        return -1;
+    }
+
     DebugPrintf("router start\n");
-    Router();
+    // ワーカー1以降は別スレッド, ワーカー0はメインスレッドで実行
+    for (i = 1; i < Param.Workers; i++)
+    {
+        if ((status = pthread_create(&Worker[i].tid, &attr, WorkerThread, &Worker[i])) != 0)
+        {
+            DebugPrintf("pthread_create:%s\n", strerror(status));
+            EndFlag = 1;
+            Param.Workers = i;
+            break;
+        }
+    }
+    WorkerThread(&Worker[0]);
+    for (i = 1; i < Param.Workers; i++)
+    {
+        pthread_join(Worker[i].tid, NULL);
+    }
     DebugPrintf("router end\n");
 
-    pthread_join(BufTid, NULL);
+    if (Param.RxMode != RX_MODE_URING)
+    {
+        pthread_join(BufTid, NULL);
+    }
+    pthread_join(ControlTid, NULL);
+    TraceEnd();
 
-    close(Device[0].soc);
-    close(Device[1].soc);
+    rx = tx = 0;
+    for (i = 0; i < Param.Workers; i++)
+    {
+        DebugPrintf("worker[%d]:cpu=%d rx=%lu tx=%lu gso=%lu\n", i, Worker[i].cpu, Worker[i].stats.rxPackets, Worker[i].stats.txPackets, Worker[i].stats.gsoPackets);
+        rx += Worker[i].stats.rxPackets;
+        tx += Worker[i].stats.txPackets + (i == 0 ? BufStats.txPackets : 0);
+        for (no = 0; no < DeviceNum; no++)
+        {
+            FreePort(&Worker[i], no);
+        }
+        close(Worker[i].efd);
+        free(Worker[i].vnetBuf);
+    }
+    DebugPrintf("total:rx=%lu tx=%lu(buffered=%lu)\n", rx, tx, BufStats.txPackets);
+    LatencyReportAll();
+    free(Worker);
+    XskUmemFree(&XskUmem);
+    for (i = 0; i < DeviceNum; i++)
+    {
+        close(Device[i].soc);
+    }
 
     return 0;
 }
\ No newline at end of file
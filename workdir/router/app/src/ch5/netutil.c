@@ -4,32 +4,112 @@
  *
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <endian.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <linux/if.h>
 #include <net/ethernet.h>
 #include <netinet/ip.h>
-#include <netpacket/packet.h>
+#include <netinet/udp.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <linux/virtio_net.h>
 #include <netinet/if_ether.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSUM_X86
+#endif
+#include "netutil.h"
 
 extern int DebugPrintf(char *fmt, ...);
 extern int DebugPerror(char *msg);
+extern int DeviceWrite(int deviceNo, u_char *data, int size);
+
+#define ROUTER_FILTER_LEN 14 // ルーター用BPFフィルタの命令数
+#define MMSG_CTRL_SIZE 64    // recvmmsg()の1フレームあたりの補助データ領域(受信タイムスタンプ用)
+
+__thread u_int64_t RxStamp; // 自スレッドが最後に受信したフレームのカーネルの受信時刻(CLOCK_REALTIME, ns). 0なら不明
+
+/**
+ * @brief 補助データから受信タイムスタンプ(SO_TIMESTAMPNS)を取り出す
+ *
+ * @param [in] msg : 受信したメッセージヘッダ
+ * @return 受信時刻(ns), 0 : タイムスタンプなし
+ */
+static u_int64_t CmsgStamp(struct msghdr *msg)
+{
+    struct cmsghdr *cmsg;
+    struct timespec ts;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief ルーターが扱うフレームだけを通すBPFフィルタを作る
+ * @details 宛先が自分のMACアドレスのARPとIPv4, ブロードキャストのARPだけを通す. @n
+ * 他ホスト宛てのユニキャストやIPv6, LLDP, 自分が送信したフレームはカーネル内で捨てられ, ユーザー空間にコピーされない
+ *
+ * @param [in] hwaddr : デバイスのMACアドレス
+ * @param [out] code : 命令列(ROUTER_FILTER_LEN 個)
+ */
+static void MakeRouterFilter(u_char hwaddr[6], struct sock_filter code[ROUTER_FILTER_LEN])
+{
+    u_int32_t hi = (u_int32_t)hwaddr[0] << 24 | hwaddr[1] << 16 | hwaddr[2] << 8 | hwaddr[3];
+    u_int32_t lo = hwaddr[4] << 8 | hwaddr[5];
+    struct sock_filter prog[ROUTER_FILTER_LEN] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),                 // 0: 宛先MACアドレスの上位4バイト
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, hi, 0, 2),         // 1: 自分宛ての候補なら2, 違えば4へ
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),                 // 2: 宛先MACアドレスの下位2バイト
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, lo, 5, 8),         // 3: 自分宛てなら9へ, 違えば破棄
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xFFFFFFFF, 0, 7), // 4: ブロードキャストでなければ破棄
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),                 // 5
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xFFFF, 0, 5),     // 6
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),                // 7: ブロードキャストはARPだけ通す
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_ARP, 4, 3),  // 8
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),                // 9: 自分宛てはARPとIPv4を通す
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_ARP, 2, 0),  // 10
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 1, 0),   // 11
+        BPF_STMT(BPF_RET | BPF_K, 0),                          // 12: 破棄
+        BPF_STMT(BPF_RET | BPF_K, 0x40000),                    // 13: フレーム全体を受け取る
+    };
+
+    memcpy(code, prog, sizeof(prog));
+}
 
 /**
  * @brief RAWソケットの準備
  * @details 1. ソケットのファイルディスクリプタを作成 @n
- * 2. ネットワークインターフェースのインデックス番号を取得 @n
- * 3. ソケットにネットワークインターフェースをバインド @n
+ * 2. 受信フィルタを設定(filterHwaddrを指定した場合) @n
+ * 3. ネットワークインターフェースのインデックス番号を取得 @n
+ * 4. ソケットにネットワークインターフェースとプロトコルをバインド @n
+ * ソケットはプロトコル0で作成してバインドまで受信を止めておき, フィルタはバインドより前に設定する. @n
+ * これにより他のインターフェースのフレームやフィルタ設定前のフレームがソケットに溜まらない. @n
+ * フィルタを設定できなかった場合はフィルタなしで続ける(受信側でも宛先を確認すること)
  *
  * @param [in] device : ネットワークインターフェース名
  * @param [in] promiscFlag : プロミスキャスモードにするかどうかのフラグ
  * @param [in] ipOnly : IPパケットのみを対象とするかどうかのフラグ
+ * @param [in] filterHwaddr : このMACアドレス宛てのARP, IPv4とブロードキャストのARPだけを受信する(NULLならすべて)
  * @return soc : ソケットのファイルディスクリプタ
  */
-int InitRawSocket(char *device, int promiscFlag, int ipOnly)
+int InitRawSocket(char *device, int promiscFlag, int ipOnly, u_char *filterHwaddr)
 {
     // ifreq 構造体 : ネットワークインターフェースの情報を格納する構造体 (net/if.h で定義)
     // struct ifreq
@@ -65,23 +145,27 @@ int InitRawSocket(char *device, int promiscFlag, int ipOnly)
     //     unsigned char sll_addr[8];   /* ハードウェアアドレス */
     // };
     struct sockaddr_ll sa;
+    struct sock_filter code[ROUTER_FILTER_LEN];
+    struct sock_fprog fprog;
     int soc;
     // ソケット soc のファイルディスクリプタを作成
     // データリンク層のパケットを扱うために第一引数(プロトコルファミリー)に PF_PACKET を指定, 第二引数(通信方式)に SOCK_RAW を指定
-    if (ipOnly)
-    { // IPパケットのみを対象とする場合は, 第三引数(プロトコル)に ETH_P_IP を指定
-        if ((soc = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_IP))) < 0)
-        {
-            DebugPerror("socket");
-            return -1;
-        }
+    // 第三引数(プロトコル)を 0 にすると bind するまでフレームを受信しない
+    // 対象のプロトコルは bind で指定する
+    if ((soc = socket(PF_PACKET, SOCK_RAW, 0)) < 0)
+    {
+        DebugPerror("socket");
+        return -1;
     }
-    else
-    { // すべてのパケットを対象とする場合は, 第三引数(プロトコル)に ETH_P_ALL を指定
-        if ((soc = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0)
+    // 受信フィルタの設定
+    if (filterHwaddr != NULL)
+    {
+        MakeRouterFilter(filterHwaddr, code);
+        fprog.len = ROUTER_FILTER_LEN;
+        fprog.filter = code;
+        if (setsockopt(soc, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0)
         {
-            DebugPerror("socket");
-            return -1;
+            DebugPerror("setsockopt:SO_ATTACH_FILTER");
         }
     }
     // ifreq のメモリ領域をクリア
@@ -138,6 +222,728 @@ int InitRawSocket(char *device, int promiscFlag, int ipOnly)
     return soc;
 }
 
+/**
+ * @brief PACKET_MMAP(TPACKET_V3)の受信リングの準備
+ * @details InitRawSocket()で作成したソケットに受信リングを設定する @n
+ * 1. PACKET_VERSION で TPACKET_V3 を指定 @n
+ * 2. PACKET_RX_RING でブロック単位のリングを作成 @n
+ * 3. リングをユーザ空間にmmapする @n
+ * 以降はカーネルが受信したフレームをリングに直接書き込むため, read()が不要になる
+ *
+ * @param [in] soc : InitRawSocket()で作成したソケット
+ * @param [out] ring : 受信リング
+ * @param [in] retireTov : ブロックを満杯でなくてもユーザに渡すまでの時間(ms). 小さいほど遅延が小さい
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int InitRxRing(int soc, RX_RING *ring, int retireTov)
+{
+    struct tpacket_req3 req;
+    int version = TPACKET_V3;
+
+    if (setsockopt(soc, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+    {
+        DebugPerror("setsockopt:PACKET_VERSION");
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = RX_RING_BLOCK_SIZE;
+    req.tp_block_nr = RX_RING_BLOCK_NR;
+    req.tp_frame_size = RX_RING_FRAME_SIZE;
+    req.tp_frame_nr = (RX_RING_BLOCK_SIZE / RX_RING_FRAME_SIZE) * RX_RING_BLOCK_NR;
+    req.tp_retire_blk_tov = retireTov;
+    if (setsockopt(soc, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+    {
+        DebugPerror("setsockopt:PACKET_RX_RING");
+        return -1;
+    }
+
+    ring->mapSize = (size_t)req.tp_block_size * req.tp_block_nr;
+    ring->map = mmap(NULL, ring->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, soc, 0);
+    if (ring->map == MAP_FAILED)
+    { // MAP_LOCKEDが使えない環境(RLIMIT_MEMLOCK)ではロックなしで再試行
+        ring->map = mmap(NULL, ring->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, soc, 0);
+    }
+    if (ring->map == MAP_FAILED)
+    {
+        DebugPerror("mmap:PACKET_RX_RING");
+        ring->map = NULL;
+        return -1;
+    }
+    ring->blockSize = req.tp_block_size;
+    ring->blockNr = req.tp_block_nr;
+    ring->blockNo = 0;
+
+    return 0;
+}
+
+/**
+ * @brief 受信リングのうちユーザ側に渡されたブロックを順に処理する
+ * @details ブロック内のフレームをコピーせずにそのまま func に渡し, 処理後にブロックをカーネルに返却する. @n
+ * func はフレームをその場で書き換えてよいが, ブロック返却後も保持したい場合はコピーする必要がある. @n
+ * ブロックの状態を読むだけでシステムコールを使わないので, 受信を待たずに繰り返し呼び出してもよい. @n
+ * func の呼び出し中は RxStamp がフレームの受信時刻になる
+ *
+ * @param [in] ring : 受信リング
+ * @param [in] deviceNo : デバイス番号(funcにそのまま渡す)
+ * @param [in] func : フレームごとに呼び出す関数
+ * @return 処理したフレーム数
+ */
+int RxRingWalk(RX_RING *ring, int deviceNo, int (*func)(int deviceNo, u_char *data, int size))
+{
+    struct tpacket_block_desc *bd;
+    struct tpacket3_hdr *ph;
+    unsigned int i, num;
+    int total = 0;
+
+    while (1)
+    {
+        bd = (struct tpacket_block_desc *)(ring->map + (size_t)ring->blockNo * ring->blockSize);
+        if ((__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0)
+        { // まだカーネルが使用中のブロック
+            break;
+        }
+
+        num = bd->hdr.bh1.num_pkts;
+        ph = (struct tpacket3_hdr *)((u_char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+        for (i = 0; i < num; i++)
+        {
+            RxStamp = (u_int64_t)ph->tp_sec * 1000000000ULL + ph->tp_nsec;
+            func(deviceNo, (u_char *)ph + ph->tp_mac, ph->tp_snaplen);
+            ph = (struct tpacket3_hdr *)((u_char *)ph + ph->tp_next_offset);
+        }
+        total += num;
+
+        // ブロックをカーネルに返却
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        ring->blockNo = (ring->blockNo + 1) % ring->blockNr;
+    }
+
+    return total;
+}
+
+/**
+ * @brief 受信リングの解放
+ *
+ * @param [in] ring : 受信リング
+ * @return 0 : 正常終了
+ */
+int FreeRxRing(RX_RING *ring)
+{
+    if (ring->map != NULL)
+    {
+        munmap(ring->map, ring->mapSize);
+        ring->map = NULL;
+    }
+    return 0;
+}
+
+/**
+ * @brief recvmmsg()/sendmmsg()用のバッチの準備
+ * @details フレームバッファとメッセージヘッダを起動時にまとめて確保し, 以降は再利用する
+ *
+ * @param [out] batch : バッチ
+ * @param [in] size : バッチの最大フレーム数
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int InitMmsgBatch(MMSG_BATCH *batch, int size)
+{
+    int i;
+
+    memset(batch, 0, sizeof(MMSG_BATCH));
+    batch->msgs = (struct mmsghdr *)calloc(size, sizeof(struct mmsghdr));
+    batch->iov = (struct iovec *)calloc(size, sizeof(struct iovec));
+    batch->buf = (u_char *)malloc((size_t)size * MMSG_FRAME_SIZE);
+    batch->ctrl = (u_char *)malloc((size_t)size * MMSG_CTRL_SIZE);
+    if (batch->msgs == NULL || batch->iov == NULL || batch->buf == NULL || batch->ctrl == NULL)
+    {
+        DebugPerror("malloc");
+        FreeMmsgBatch(batch);
+        return -1;
+    }
+    for (i = 0; i < size; i++)
+    {
+        batch->iov[i].iov_base = batch->buf + (size_t)i * MMSG_FRAME_SIZE;
+        batch->iov[i].iov_len = MMSG_FRAME_SIZE;
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    batch->size = size;
+    batch->count = 0;
+    pthread_mutex_init(&batch->mutex, NULL);
+
+    return 0;
+}
+
+/**
+ * @brief recvmmsg()で受信済みのフレームをまとめて読み込み, 順に処理する
+ * @details 1回のシステムコールで最大 batch->size フレームを受信し, 各フレームを func に渡す. @n
+ * ソケットに SetRxTimestamp() してあれば, func の呼び出し中は RxStamp がフレームの受信時刻になる
+ *
+ * @param [in] soc : ソケット
+ * @param [in] batch : バッチ
+ * @param [in] deviceNo : デバイス番号(funcにそのまま渡す)
+ * @param [in] func : フレームごとに呼び出す関数
+ * @return 処理したフレーム数, -1 : 異常終了
+ */
+int RxMmsgRead(int soc, MMSG_BATCH *batch, int deviceNo, int (*func)(int deviceNo, u_char *data, int size))
+{
+    int i, n;
+
+    for (i = 0; i < batch->size; i++)
+    { // 前回の受信で短くなったバッファ長と補助データ長を戻す
+        batch->iov[i].iov_len = MMSG_FRAME_SIZE;
+        batch->msgs[i].msg_hdr.msg_control = batch->ctrl + (size_t)i * MMSG_CTRL_SIZE;
+        batch->msgs[i].msg_hdr.msg_controllen = MMSG_CTRL_SIZE;
+    }
+    if ((n = recvmmsg(soc, batch->msgs, batch->size, MSG_DONTWAIT, NULL)) < 0)
+    {
+        if (errno != EAGAIN)
+        {
+            DebugPerror("recvmmsg");
+        }
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        RxStamp = CmsgStamp(&batch->msgs[i].msg_hdr);
+        func(deviceNo, batch->iov[i].iov_base, batch->msgs[i].msg_len);
+    }
+    return n;
+}
+
+/**
+ * @brief 送信バッチに積まれたフレームをsendmmsg()でまとめて送信する(ロックは呼び出し側で取得する)
+ *
+ * @param [in] soc : ソケット
+ * @param [in] batch : バッチ
+ * @return 送信したフレーム数
+ */
+static int TxMmsgFlushLocked(int soc, MMSG_BATCH *batch)
+{
+    int sent, n;
+
+    for (sent = 0; sent < batch->count; sent += n)
+    {
+        if ((n = sendmmsg(soc, batch->msgs + sent, batch->count - sent, 0)) <= 0)
+        { // 送信できなかった残りは破棄する
+            DebugPerror("sendmmsg");
+            break;
+        }
+    }
+    batch->count = 0;
+
+    return sent;
+}
+
+/**
+ * @brief 送信バッチにフレームを積む
+ * @details バッチが満杯になった場合のみ, ロックを持ったままその場で送信する. @n
+ * ロックを外すと別のスレッドがバッチを埋め直すことがあるため
+ *
+ * @param [in] soc : ソケット
+ * @param [in] batch : バッチ
+ * @param [in] data : フレーム
+ * @param [in] size : フレーム長
+ * @return 0 : 正常終了, -1 : 異常終了(バッファに収まらない)
+ */
+int TxMmsgSend(int soc, MMSG_BATCH *batch, u_char *data, int size)
+{
+    if (size > MMSG_FRAME_SIZE)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&batch->mutex);
+    if (batch->count >= batch->size)
+    {
+        TxMmsgFlushLocked(soc, batch);
+    }
+    memcpy(batch->iov[batch->count].iov_base, data, size);
+    batch->iov[batch->count].iov_len = size;
+    batch->count++;
+    pthread_mutex_unlock(&batch->mutex);
+
+    return 0;
+}
+
+/**
+ * @brief 送信バッチに積まれたフレームをsendmmsg()でまとめて送信する
+ *
+ * @param [in] soc : ソケット
+ * @param [in] batch : バッチ
+ * @return 送信したフレーム数, -1 : 異常終了
+ */
+int TxMmsgFlush(int soc, MMSG_BATCH *batch)
+{
+    int sent;
+
+    pthread_mutex_lock(&batch->mutex);
+    sent = TxMmsgFlushLocked(soc, batch);
+    pthread_mutex_unlock(&batch->mutex);
+
+    return sent;
+}
+
+/**
+ * @brief recvmmsg()/sendmmsg()用のバッチの解放
+ *
+ * @param [in] batch : バッチ
+ * @return 0 : 正常終了
+ */
+int FreeMmsgBatch(MMSG_BATCH *batch)
+{
+    if (batch->size > 0)
+    {
+        pthread_mutex_destroy(&batch->mutex);
+    }
+    free(batch->msgs);
+    free(batch->iov);
+    free(batch->buf);
+    free(batch->ctrl);
+    memset(batch, 0, sizeof(MMSG_BATCH));
+    return 0;
+}
+
+/**
+ * @brief PACKET_FANOUTグループへの参加
+ * @details 同じグループに参加したソケットの間で, 受信フレームがカーネルにより分配される. @n
+ * FANOUT_MODE_HASH ではフローのハッシュで分配するので, 同じフローのフレームは常に同じソケットに届く. @n
+ * フラグメントは再構築せずそのまま転送する(ハッシュはアドレスだけで取られ, 同じデータグラムの断片は同じソケットに届く)
+ *
+ * @param [in] soc : バインド済みのPF_PACKETソケット
+ * @param [in] groupId : グループID(16bit)
+ * @param [in] mode : FANOUT_MODE_HASH または FANOUT_MODE_CPU
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int JoinFanout(int soc, int groupId, int mode)
+{
+    int type = (mode == FANOUT_MODE_CPU) ? PACKET_FANOUT_CPU : PACKET_FANOUT_HASH;
+    int val = (groupId & 0xFFFF) | (type << 16);
+
+    if (setsockopt(soc, SOL_PACKET, PACKET_FANOUT, &val, sizeof(val)) < 0)
+    {
+        DebugPerror("setsockopt:PACKET_FANOUT");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief PACKET_QDISC_BYPASSの設定
+ * @details 送信時にqdisc(トラフィック制御)層を経由せず, 直接ドライバに渡す. @n
+ * キューイングやシェーピングが効かなくなる代わりに遅延が小さくなる
+ *
+ * @param [in] soc : PF_PACKETソケット
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int SetQdiscBypass(int soc)
+{
+    int one = 1;
+
+    if (setsockopt(soc, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one)) < 0)
+    {
+        DebugPerror("setsockopt:PACKET_QDISC_BYPASS");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief SO_BUSY_POLLの設定
+ * @details 受信キューが空のとき, 割り込みを待たずにドライバのNAPIポーリングを指定時間まわして受信を待つ. @n
+ * 対応していないドライバやカーネルでは効果がないだけなので, 失敗しても動作は続けられる
+ *
+ * @param [in] soc : ソケット
+ * @param [in] usec : ポーリングする時間(us)
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int SetBusyPoll(int soc, int usec)
+{
+#ifdef SO_PREFER_BUSY_POLL
+    int one = 1;
+#endif
+
+    if (setsockopt(soc, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0)
+    {
+        DebugPerror("setsockopt:SO_BUSY_POLL");
+        return -1;
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    if (setsockopt(soc, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) < 0)
+    {
+        DebugPerror("setsockopt:SO_PREFER_BUSY_POLL");
+    }
+#endif
+    return 0;
+}
+
+/**
+ * @brief SO_TIMESTAMPNSの設定
+ * @details 受信したフレームにカーネルの受信時刻を補助データとして付ける. 受信リングでは常に付く
+ *
+ * @param [in] soc : ソケット
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int SetRxTimestamp(int soc)
+{
+    int one = 1;
+
+    if (setsockopt(soc, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) < 0)
+    {
+        DebugPerror("setsockopt:SO_TIMESTAMPNS");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 1フレームを受信し, 受信時刻を RxStamp に入れる
+ * @details 受信がなければ待たずに戻る
+ *
+ * @param [in] soc : SetRxTimestamp() したソケット
+ * @param [out] buf : 受信バッファ
+ * @param [in] size : 受信バッファのサイズ
+ * @return 受信したバイト数, -1 : 異常終了(受信なしを含む)
+ */
+int RecvStamp(int soc, u_char *buf, int size)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    u_char ctrl[MMSG_CTRL_SIZE];
+    int len;
+
+    iov.iov_base = buf;
+    iov.iov_len = size;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    if ((len = recvmsg(soc, &msg, MSG_DONTWAIT)) >= 0)
+    {
+        RxStamp = CmsgStamp(&msg);
+    }
+    return len;
+}
+
+/**
+ * @brief PACKET_VNET_HDRの設定
+ * @details 送受信するフレームの前に struct virtio_net_hdr (VNET_HDR_SIZE バイト)を付ける. @n
+ * 受信ではGROでまとめられたフレームやチェックサム未計算のフレームがそのまま渡され, ヘッダにセグメントの大きさや @n
+ * チェックサムの位置が入る. 送信ではヘッダに従ってカーネル(またはNIC)がセグメント分割とチェックサム計算を行う. @n
+ * 受信リングや送信リングを設定する前に呼び出すこと
+ *
+ * @param [in] soc : PF_PACKETソケット
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int SetVnetHdr(int soc)
+{
+    int one = 1;
+
+    if (sizeof(struct virtio_net_hdr) != VNET_HDR_SIZE)
+    {
+        DebugPrintf("SetVnetHdr:unexpected virtio_net_hdr size %d\n", (int)sizeof(struct virtio_net_hdr));
+        return -1;
+    }
+    if (setsockopt(soc, SOL_PACKET, PACKET_VNET_HDR, &one, sizeof(one)) < 0)
+    {
+        DebugPerror("setsockopt:PACKET_VNET_HDR");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief virtio_net_hdrがセグメント分割(GSO)を指示しているかどうか
+ *
+ * @param [in] hdr : virtio_net_hdr
+ * @return 1 : GSOのフレーム, 0 : 通常のフレーム
+ */
+int VnetIsGso(u_char *hdr)
+{
+    return ((struct virtio_net_hdr *)hdr)->gso_type != VIRTIO_NET_HDR_GSO_NONE;
+}
+
+/**
+ * @brief virtio_net_hdrで計算を任されたL4チェックサムをソフトウェアで計算する
+ * @details ヘッダを付けずに送る(送信待ちキューに入れる)前に呼び出す. @n
+ * VIRTIO_NET_HDR_F_NEEDS_CSUM のフレームは csum_start 以降の和が csum_start+csum_offset に入っていないので, @n
+ * 擬似ヘッダの和が入ったままのその位置を含めて和を取り, 書き込む. GSOのフレームは分割しないと送れないので扱わない
+ *
+ * @param [in,out] hdr : virtio_net_hdr
+ * @param [in,out] data : フレーム
+ * @param [in] size : フレーム長
+ * @return 0 : 正常終了, -1 : GSOのフレーム, またはチェックサムの位置が不正
+ */
+int VnetFinishCsum(u_char *hdr, u_char *data, int size)
+{
+    struct virtio_net_hdr *vh = (struct virtio_net_hdr *)hdr;
+    int start, offset;
+    u_int16_t sum;
+
+    if (vh->gso_type != VIRTIO_NET_HDR_GSO_NONE)
+    {
+        return -1;
+    }
+    if (vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+    {
+        start = le16toh(vh->csum_start);
+        offset = le16toh(vh->csum_offset);
+        if (start + offset + 2 > size)
+        {
+            return -1;
+        }
+        sum = checksum(data + start, size - start);
+        if (offset == offsetof(struct udphdr, check) && sum == 0)
+        { // UDPでは0は「チェックサムなし」を表すので, 計算結果が0なら0xFFFFを入れる(RFC 768)
+            sum = 0xFFFF;
+        }
+        memcpy(data + start + offset, &sum, 2);
+        vh->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    }
+    return 0;
+}
+
+/**
+ * @brief PACKET_VNET_HDRを設定したソケットへのフレーム送信
+ * @details withHdr なら data の直前にある受信時のvirtio_net_hdrをそのまま付けて1回のwrite()で送る. @n
+ * GROでまとめられたフレームはGSOとして, チェックサム未計算のフレームはチェックサム計算を任せて送られる. @n
+ * そうでなければ0で埋めたヘッダをwritev()で付ける
+ *
+ * @param [in] soc : SetVnetHdr() したソケット
+ * @param [in] data : フレーム
+ * @param [in] size : フレーム長
+ * @param [in] withHdr : data の直前に virtio_net_hdr があるかどうか
+ * @return 送信したフレームのバイト数, -1 : 異常終了
+ */
+int VnetWrite(int soc, u_char *data, int size, int withHdr)
+{
+    struct virtio_net_hdr zero, *vh;
+    struct iovec iov[2];
+    int len;
+
+    if (withHdr)
+    {
+        vh = (struct virtio_net_hdr *)(data - VNET_HDR_SIZE);
+        // 受信時の「検証済み」は送信では意味を持たない
+        vh->flags &= ~VIRTIO_NET_HDR_F_DATA_VALID;
+        len = write(soc, vh, VNET_HDR_SIZE + size);
+    }
+    else
+    {
+        memset(&zero, 0, sizeof(zero));
+        iov[0].iov_base = &zero;
+        iov[0].iov_len = VNET_HDR_SIZE;
+        iov[1].iov_base = data;
+        iov[1].iov_len = size;
+        len = writev(soc, iov, 2);
+    }
+    if (len == -1)
+    {
+        DebugPerror("write(vnet)");
+        return -1;
+    }
+    return len - VNET_HDR_SIZE;
+}
+
+/**
+ * @brief PACKET_IGNORE_OUTGOINGの設定
+ * @details ETH_P_ALLでバインドしたソケットは, 別のソケットから送信したフレームも受信してしまう. @n
+ * 送信専用ソケットを使う場合に, 自分の送信フレームを受信しないようにする
+ *
+ * @param [in] soc : PF_PACKETソケット
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int SetIgnoreOutgoing(int soc)
+{
+    int one = 1;
+
+    if (setsockopt(soc, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one)) < 0)
+    {
+        DebugPerror("setsockopt:PACKET_IGNORE_OUTGOING");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief PACKET_MMAP(TPACKET_V2)の送信リングの準備
+ * @details 受信リング(TPACKET_V3)とはPACKET_VERSIONが異なるため, 送信専用のソケットを別に作成する. @n
+ * プロトコルに0を指定してバインドするので, このソケットはフレームを受信しない
+ *
+ * @param [in] device : ネットワークインターフェース名
+ * @param [out] ring : 送信リング
+ * @param [in] qdiscBypass : PACKET_QDISC_BYPASSを設定するかどうかのフラグ
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int InitTxRing(char *device, TX_RING *ring, int qdiscBypass)
+{
+    struct ifreq ifreq;
+    struct sockaddr_ll sa;
+    struct tpacket_req req;
+    int version = TPACKET_V2;
+
+    if ((ring->soc = socket(PF_PACKET, SOCK_RAW, 0)) < 0)
+    {
+        DebugPerror("socket");
+        return -1;
+    }
+    memset(&ifreq, 0, sizeof(struct ifreq));
+    strncpy(ifreq.ifr_name, device, sizeof(ifreq.ifr_name) - 1);
+    if (ioctl(ring->soc, SIOCGIFINDEX, &ifreq) < 0)
+    {
+        DebugPerror("ioctl:SIOCGIFINDEX");
+        close(ring->soc);
+        return -1;
+    }
+
+    if (setsockopt(ring->soc, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+    {
+        DebugPerror("setsockopt:PACKET_VERSION");
+        close(ring->soc);
+        return -1;
+    }
+    if (qdiscBypass)
+    {
+        SetQdiscBypass(ring->soc);
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = TX_RING_BLOCK_SIZE;
+    req.tp_block_nr = TX_RING_BLOCK_NR;
+    req.tp_frame_size = TX_RING_FRAME_SIZE;
+    req.tp_frame_nr = (TX_RING_BLOCK_SIZE / TX_RING_FRAME_SIZE) * TX_RING_BLOCK_NR;
+    if (setsockopt(ring->soc, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)
+    {
+        DebugPerror("setsockopt:PACKET_TX_RING");
+        close(ring->soc);
+        return -1;
+    }
+
+    ring->mapSize = (size_t)req.tp_block_size * req.tp_block_nr;
+    ring->map = mmap(NULL, ring->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, ring->soc, 0);
+    if (ring->map == MAP_FAILED)
+    {
+        DebugPerror("mmap:PACKET_TX_RING");
+        ring->map = NULL;
+        close(ring->soc);
+        return -1;
+    }
+
+    // 送信先のインターフェースをバインド(プロトコル0なので受信はしない)
+    memset(&sa, 0, sizeof(sa));
+    sa.sll_family = PF_PACKET;
+    sa.sll_protocol = 0;
+    sa.sll_ifindex = ifreq.ifr_ifindex;
+    if (bind(ring->soc, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+    {
+        DebugPerror("bind");
+        munmap(ring->map, ring->mapSize);
+        ring->map = NULL;
+        close(ring->soc);
+        return -1;
+    }
+
+    ring->frameSize = req.tp_frame_size;
+    ring->frameNr = req.tp_frame_nr;
+    ring->frameNo = 0;
+    ring->pending = 0;
+    pthread_mutex_init(&ring->mutex, NULL);
+
+    return 0;
+}
+
+/**
+ * @brief 送信リングにフレームを書き込む
+ * @details 空きスロットにフレームをコピーして送信要求の状態にするだけで, システムコールは発行しない. @n
+ * 実際の送信は TxRingFlush() でまとめて行う. リングが満杯の場合のみ, その場でカーネルに送信させて空きを待つ
+ *
+ * @param [in] ring : 送信リング
+ * @param [in] data : フレーム
+ * @param [in] size : フレーム長
+ * @return 0 : 正常終了, -1 : 異常終了(スロットに収まらない, または空きがない)
+ */
+int TxRingSend(TX_RING *ring, u_char *data, int size)
+{
+    struct tpacket2_hdr *hdr;
+    unsigned int off = TPACKET_ALIGN(sizeof(struct tpacket2_hdr));
+
+    if (size > ring->frameSize - off)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&ring->mutex);
+    hdr = (struct tpacket2_hdr *)(ring->map + (size_t)ring->frameNo * ring->frameSize);
+    if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE)
+    { // リングが満杯の場合, 送信済みスロットが返却されるまで待つ
+        send(ring->soc, NULL, 0, 0);
+        ring->pending = 0;
+        if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE)
+        {
+            pthread_mutex_unlock(&ring->mutex);
+            return -1;
+        }
+    }
+
+    memcpy((u_char *)hdr + off, data, size);
+    hdr->tp_len = size;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+    ring->frameNo = (ring->frameNo + 1) % ring->frameNr;
+    ring->pending++;
+    pthread_mutex_unlock(&ring->mutex);
+
+    return 0;
+}
+
+/**
+ * @brief 送信リングに書き込んだフレームをまとめて送信する
+ * @details 1回のsend()でリング上の送信要求をすべてカーネルに処理させる
+ *
+ * @param [in] ring : 送信リング
+ * @return 送信を要求したフレーム数, -1 : 異常終了
+ */
+int TxRingFlush(TX_RING *ring)
+{
+    unsigned int pending;
+
+    pthread_mutex_lock(&ring->mutex);
+    pending = ring->pending;
+    ring->pending = 0;
+    pthread_mutex_unlock(&ring->mutex);
+
+    if (pending == 0)
+    {
+        return 0;
+    }
+    if (send(ring->soc, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN)
+    {
+        DebugPerror("send:PACKET_TX_RING");
+        return -1;
+    }
+    return pending;
+}
+
+/**
+ * @brief 送信リングの解放
+ *
+ * @param [in] ring : 送信リング
+ * @return 0 : 正常終了
+ */
+int FreeTxRing(TX_RING *ring)
+{
+    if (ring->map != NULL)
+    {
+        send(ring->soc, NULL, 0, 0);
+        munmap(ring->map, ring->mapSize);
+        ring->map = NULL;
+        close(ring->soc);
+        pthread_mutex_destroy(&ring->mutex);
+    }
+    return 0;
+}
+
 /**
  * @brief ネットワークインターフェースのMACアドレス, ユニキャストアドレス, サブネット, ネットマスクを取得
  *
@@ -299,115 +1105,261 @@ int PrintEtherHeader(struct ether_header *eh, FILE *fp)
 }
 
 /**
- * @brief チェックサム計算関数
- * @details チェックサムを計算する @n
- * 1. 対象のパケットに対して, 16ビットごとの1の補数和を計算 @n
- * 2. 計算結果の1の補数を取る @n
+ * @brief 1の補数和の計算(64ビット整数, 8バイトずつ)
+ * @details 2^16 ≡ 1 (mod 0xFFFF) なので, 32ビット単位で64ビットに足し込んでから16ビットに畳んでも @n
+ * 16ビットずつ足した場合と同じ値になる. 桁あふれの確認はループの外で1回だけ行う
  *
- * @param [in] data : パケットデータ
- * @param [in] len : パケットデータ長
- * @return チェックサム
+ * @param [in] data : データ
+ * @param [in] len : データ長
+ * @return 畳む前の和
  */
-u_int16_t checksum(u_char *data, int len)
+static u_int64_t csumScalar(const u_char *data, int len)
 {
-    register u_int32_t sum;
-    register u_int16_t *ptr;
-    register int c;
+    u_int64_t sum = 0, q;
+    u_int32_t w;
+    u_int16_t h;
 
-    sum = 0;
-    ptr = (u_int16_t *)data;
-    // 2byte(16bit)ずつ加算
-    for (c = len; c > 1; c -= 2)
+    for (; len >= 8; data += 8, len -= 8)
     {
-        sum += (*ptr);
-        if (sum & 0x80000000)
-        {
-            sum = (sum & 0xFFFF) + (sum >> 16);
-        }
-        ptr++;
+        memcpy(&q, data, sizeof(q));
+        sum += (q & 0xFFFFFFFF) + (q >> 32);
     }
-    // cが奇数byteだと, 8bit分を0埋めして16bitにして加算
-    if (c == 1)
+    if (len >= 4)
     {
-        u_int16_t val;
-        val = 0;
-        memcpy(&val, ptr, sizeof(u_int8_t));
-        sum += val;
+        memcpy(&w, data, sizeof(w));
+        sum += w;
+        data += 4;
+        len -= 4;
     }
-    while (sum >> 16)
+    if (len >= 2)
     {
-        sum = (sum & 0xFFFF) + (sum >> 16);
+        memcpy(&h, data, sizeof(h));
+        sum += h;
+        data += 2;
+        len -= 2;
     }
-    return ~sum;
+    if (len == 1)
+    { // 奇数byteだと, 8bit分を0埋めして16bitにして加算
+        h = 0;
+        memcpy(&h, data, sizeof(u_int8_t));
+        sum += h;
+    }
+    return sum;
 }
 
+#ifdef CSUM_X86
 /**
- * @brief 2つのデータ data1 と data2 のチェックサム計算関数
+ * @brief 1の補数和の計算(SSE2, 16バイトずつ)
+ * @details 32ビットの4レーンを64ビットに広げて2つのアキュムレータに足し込む
  *
- * @param [in] data1 : パケットデータ1
- * @param [in] len1 : パケットデータ1長
- * @param [in] data2 : パケットデータ2
- * @param [in] len2 : パケットデータ2長
- * @return チェックサム
+ * @param [in] data : データ
+ * @param [in] len : データ長
+ * @return 畳む前の和
  */
-u_int16_t checksum2(u_char *data1, int len1, u_char *data2, int len2)
+__attribute__((target("sse2"))) static u_int64_t csumSse2(const u_char *data, int len)
 {
-    register u_int32_t sum;
-    register u_int16_t *ptr;
-    register int c;
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero, v;
+    u_int64_t lane[2];
 
-    sum = 0;
-    ptr = (u_int16_t *)data1;
-    // 2byte(16bit)ずつ加算
-    for (c = len1; c > 1; c -= 2)
+    if (len < 16)
     {
-        sum += (*ptr);
-        if (sum & 0x80000000)
-        {
-            sum = (sum & 0xFFFF) + (sum >> 16);
-        }
-        ptr++;
-    }
-    if (c == 1)
-    { // data1が奇数byte長の場合, data2の先頭1byteを16bitにして加算
-        u_int16_t val;
-        val = ((*ptr) << 8) + (*data2);
-        sum += val;
-        if (sum & 0x80000000)
-        {
-            sum = (sum & 0xFFFF) + (sum >> 16);
-        }
-        ptr = (u_int16_t *)(data2 + 1);
-        len2--;
+        return csumScalar(data, len);
     }
-    else
+    for (; len >= 16; data += 16, len -= 16)
     {
-        ptr = (u_int16_t *)data2;
+        v = _mm_loadu_si128((const __m128i *)data);
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v, zero));
     }
-    // 残りのdata2を16bitごとに加算
-    for (c = len2; c > 1; c -= 2)
+    _mm_storeu_si128((__m128i *)lane, _mm_add_epi64(acc0, acc1));
+    return lane[0] + lane[1] + csumScalar(data, len);
+}
+
+/**
+ * @brief 1の補数和の計算(AVX2, 32バイトずつ)
+ *
+ * @param [in] data : データ
+ * @param [in] len : データ長
+ * @return 畳む前の和
+ */
+__attribute__((target("avx2"))) static u_int64_t csumAvx2(const u_char *data, int len)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero, v;
+    u_int64_t lane[4];
+
+    if (len < 32)
+    {
+        return csumScalar(data, len);
+    }
+    for (; len >= 32; data += 32, len -= 32)
     {
-        sum += (*ptr);
-        if (sum & 0x80000000)
+        v = _mm256_loadu_si256((const __m256i *)data);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+    }
+    _mm256_storeu_si256((__m256i *)lane, _mm256_add_epi64(acc0, acc1));
+    return lane[0] + lane[1] + lane[2] + lane[3] + csumScalar(data, len);
+}
+#endif
+
+// 1の補数和の計算に使う関数. 起動時にCPUに合わせて選ぶ
+static u_int64_t (*CsumKernel)(const u_char *data, int len) = csumScalar;
+static int CsumKernelNo = CSUM_KERNEL_SCALAR;
+
+/**
+ * @brief 1の補数和の計算に使う関数を選ぶ
+ *
+ * @param [in] kernel : CSUM_KERNEL_SCALAR, CSUM_KERNEL_SSE2, CSUM_KERNEL_AVX2
+ * @return 0 : 正常終了, -1 : このCPUでは使えない
+ */
+int checksumSelect(int kernel)
+{
+    switch (kernel)
+    {
+    case CSUM_KERNEL_SCALAR:
+        CsumKernel = csumScalar;
+        break;
+#ifdef CSUM_X86
+    case CSUM_KERNEL_SSE2:
+        if (!__builtin_cpu_supports("sse2"))
         {
-            sum = (sum & 0xFFFF) + (sum >> 16);
+            return -1;
         }
-        ptr++;
+        CsumKernel = csumSse2;
+        break;
+    case CSUM_KERNEL_AVX2:
+        if (!__builtin_cpu_supports("avx2"))
+        {
+            return -1;
+        }
+        CsumKernel = csumAvx2;
+        break;
+#endif
+    default:
+        return -1;
     }
-    if (c == 1)
+    CsumKernelNo = kernel;
+    return 0;
+}
+
+/**
+ * @brief 選ばれている1の補数和の計算関数の名前
+ *
+ * @return 名前
+ */
+const char *checksumKernelName()
+{
+    static const char *names[] = {"scalar", "sse2", "avx2"};
+
+    return names[CsumKernelNo];
+}
+
+/**
+ * @brief 起動時にCPUIDを調べ, 使える中で最も速い計算関数を選ぶ
+ *
+ */
+__attribute__((constructor)) static void checksumInit()
+{
+#ifdef CSUM_X86
+    __builtin_cpu_init();
+#endif
+    if (checksumSelect(CSUM_KERNEL_AVX2) == -1 && checksumSelect(CSUM_KERNEL_SSE2) == -1)
     {
-        u_int16_t val;
-        val = 0;
-        memcpy(&val, ptr, sizeof(u_int8_t));
-        sum += val;
+        checksumSelect(CSUM_KERNEL_SCALAR);
     }
+}
+
+/**
+ * @brief 1の補数和を16ビットに畳む
+ *
+ * @param [in] sum : 畳む前の和
+ * @return 16ビットの1の補数和
+ */
+static u_int16_t csumFold(u_int64_t sum)
+{
     while (sum >> 16)
     {
         sum = (sum & 0xFFFF) + (sum >> 16);
     }
+    return sum;
+}
+
+/**
+ * @brief チェックサム計算関数
+ * @details チェックサムを計算する @n
+ * 1. 対象のパケットに対して, 16ビットごとの1の補数和を計算 @n
+ * 2. 計算結果の1の補数を取る @n
+ * 和の計算は checksumSelect() で選ばれた関数で行う
+ *
+ * @param [in] data : パケットデータ
+ * @param [in] len : パケットデータ長
+ * @return チェックサム
+ */
+u_int16_t checksum(u_char *data, int len)
+{
+    return ~csumFold(CsumKernel(data, len));
+}
+
+/**
+ * @brief 2つのデータ data1 と data2 のチェックサム計算関数
+ * @details data1 と data2 をつなげたデータの checksum() と同じ値を返す. @n
+ * data1が奇数byte長の場合, data2は16ビット語の途中から始まるので, data2の和のバイトを入れ替えて足す
+ *
+ * @param [in] data1 : パケットデータ1
+ * @param [in] len1 : パケットデータ1長
+ * @param [in] data2 : パケットデータ2
+ * @param [in] len2 : パケットデータ2長
+ * @return チェックサム
+ */
+u_int16_t checksum2(u_char *data1, int len1, u_char *data2, int len2)
+{
+    u_int16_t sum2 = csumFold(CsumKernel(data2, len2));
+
+    if (len1 & 1)
+    {
+        sum2 = (sum2 << 8) | (sum2 >> 8);
+    }
+    return ~csumFold(CsumKernel(data1, len1) + sum2);
+}
+
+/**
+ * @brief チェックサムの差分更新(RFC 1624)
+ * @details 16ビットの1語を old から new に書き換えたときのチェックサムを, @n
+ * HC' = ~(~HC + ~m + m') で求める. ヘッダ全体を読み直す必要がない
+ *
+ * @param [in] check : 書き換え前のチェックサム
+ * @param [in] old : 書き換え前の16ビット値
+ * @param [in] new : 書き換え後の16ビット値
+ * @return 書き換え後のチェックサム
+ */
+u_int16_t checksumAdjust(u_int16_t check, u_int16_t old, u_int16_t new)
+{
+    u_int32_t sum;
+
+    sum = (u_int16_t)~check + (u_int16_t)~old + new;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
     return ~sum;
 }
 
+/**
+ * @brief TTLを1減らし, IPヘッダのチェックサムを差分更新する
+ * @details TTLはプロトコル番号と同じ16ビット語にあるので, その語だけを checksumAdjust() する
+ *
+ * @param [in,out] iphdr : IPヘッダ
+ */
+void ipDecrementTtl(struct iphdr *iphdr)
+{
+    u_int16_t old, new;
+
+    memcpy(&old, &iphdr->ttl, sizeof(u_int16_t));
+    iphdr->ttl--;
+    memcpy(&new, &iphdr->ttl, sizeof(u_int16_t));
+    iphdr->check = checksumAdjust(iphdr->check, old, new);
+}
+
 /**
  * @brief IPヘッダのチェックサム計算関数
  *
@@ -418,14 +1370,11 @@ u_int16_t checksum2(u_char *data1, int len1, u_char *data2, int len2)
  */
 int checkIPchecksum(struct iphdr *iphdr, u_char *option, int optionLen)
 {
-    struct iphdr iptmp;
     unsigned short sum;
 
-    memcpy(&iptmp, iphdr, sizeof(struct iphdr));
-
     if (optionLen == 0)
     {
-        sum = checksum((u_char *)&iptmp, sizeof(struct iphdr));
+        sum = checksum((u_char *)iphdr, sizeof(struct iphdr));
         if (sum == 0 || sum == 0xFFFF)
         {
             return 1;
@@ -437,7 +1386,7 @@ int checkIPchecksum(struct iphdr *iphdr, u_char *option, int optionLen)
     }
     else
     {
-        sum = checksum2((u_char *)&iptmp, sizeof(struct iphdr), option, optionLen);
+        sum = checksum2((u_char *)iphdr, sizeof(struct iphdr), option, optionLen);
         if (sum == 0 || sum == 0xFFFF)
         {
             return 1;
@@ -458,14 +1407,14 @@ typedef struct
 /**
  * @brief ARPリクエスト送信関数
  *
- * @param[in] soc : ソケット
+ * @param[in] deviceNo : 送信するデバイス番号
  * @param[in] target_ip : ターゲットIPアドレス
  * @param[in] target_mac : ターゲットMACアドレス
  * @param[in] my_ip : 自分のIPアドレス
  * @param[in] my_mac : 自分のMACアドレス
  * @return 0 : 正常終了
  */
-int SendArpRequestB(int soc, in_addr_t target_ip, u_char target_mac[6], in_addr_t my_ip, u_char my_mac[6])
+int SendArpRequestB(int deviceNo, in_addr_t target_ip, u_char target_mac[6], in_addr_t my_ip, u_char my_mac[6])
 {
     PACKET_ARP arp;
     int total;
@@ -527,7 +1476,7 @@ int SendArpRequestB(int soc, in_addr_t target_ip, u_char target_mac[6], in_addr_
     p += sizeof(struct ether_arp);
     total = p - buf;
 
-    write(soc, buf, total);
+    DeviceWrite(deviceNo, buf, total);
 
     return 0;
 }
\ No newline at end of file
@@ -1,10 +1,249 @@
+// PACKET_MMAP(TPACKET_V3)受信リングのパラメータ
+#define RX_RING_BLOCK_SIZE (1 << 20) // 1ブロックのサイズ(PAGE_SIZEの倍数)
+#define RX_RING_BLOCK_NR 64          // ブロック数
+#define RX_RING_FRAME_SIZE 2048      // フレームサイズの目安(TPACKET_V3では可変長)
+#define RX_RING_RETIRE_TOV 10        // ブロックを満杯でなくてもユーザに渡すまでの時間(ms)
+#define RX_RING_RETIRE_TOV_SPIN 1    // スピンで受信を待つ場合のRX_RING_RETIRE_TOV(ms, 最小値)
+
+/**
+ * @brief PACKET_MMAP(TPACKET_V3)の受信リング
+ *
+ */
+typedef struct
+{
+    u_char *map;            // mmapしたリングの先頭アドレス
+    size_t mapSize;         // mmapしたサイズ
+    unsigned int blockSize; // 1ブロックのサイズ
+    unsigned int blockNr;   // ブロック数
+    unsigned int blockNo;   // 次に読むブロック番号
+} RX_RING;
+
+// PACKET_MMAP(TPACKET_V2)送信リングのパラメータ
+#define TX_RING_BLOCK_SIZE (1 << 16) // 1ブロックのサイズ(PAGE_SIZEの倍数)
+#define TX_RING_BLOCK_NR 32          // ブロック数
+#define TX_RING_FRAME_SIZE 2048      // 1フレームのスロットサイズ(ヘッダを含む)
+
+/**
+ * @brief PACKET_MMAP(TPACKET_V2)の送信リング
+ * @details 複数スレッドから書き込まれるため mutex で保護する
+ *
+ */
+typedef struct
+{
+    int soc;                 // 送信専用ソケット(何も受信しない)
+    u_char *map;             // mmapしたリングの先頭アドレス
+    size_t mapSize;          // mmapしたサイズ
+    unsigned int frameSize;  // 1フレームのスロットサイズ
+    unsigned int frameNr;    // フレーム数
+    unsigned int frameNo;    // 次に書き込むフレーム番号
+    unsigned int pending;    // 書き込み済みでカーネルに未通知のフレーム数
+    pthread_mutex_t mutex;
+} TX_RING;
+
+// PACKET_VNET_HDRのパラメータ
+#define VNET_HDR_SIZE 10                  // struct virtio_net_hdr のサイズ
+#define VNET_FRAME_MAX (14 + 65535)       // GROでまとめられたフレームの最大長(Ethernetヘッダ+IPの最大長)
+
+// recvmmsg()/sendmmsg()のバッチのパラメータ
+#define MMSG_BATCH_MAX 256     // 1回のシステムコールで扱う最大フレーム数
+#define MMSG_FRAME_SIZE 2048   // 1フレームのバッファサイズ
+
+/**
+ * @brief recvmmsg()/sendmmsg()用のフレームのバッチ
+ * @details 送信側は複数スレッドから書き込まれるため mutex で保護する
+ *
+ */
+typedef struct
+{
+    struct mmsghdr *msgs; // 各フレームのメッセージヘッダ
+    struct iovec *iov;    // 各フレームのバッファ
+    u_char *buf;          // フレームバッファ(MMSG_FRAME_SIZE x size)
+    u_char *ctrl;         // 受信側: 補助データの領域(受信タイムスタンプ用)
+    int size;             // バッチの最大フレーム数
+    int count;            // 送信側: 積まれているフレーム数
+    pthread_mutex_t mutex;
+} MMSG_BATCH;
+
+// AF_XDPのパラメータ
+#define XSK_FRAME_SIZE 2048 // UMEMの1フレームのサイズ(2のべき乗)
+#define XSK_RING_SIZE 1024  // 各リングのエントリ数(2のべき乗)
+#define XSK_BATCH 64        // 1回に受信ディスクリプタを取り出す最大数
+
+/**
+ * @brief AF_XDPのリング(受信, 送信, フィルリング, 完了リングで共通)
+ * @details producer, consumer はカーネルと共有するインデックス. 自分が進める側は local に持ち, まとめて公開する
+ *
+ */
+typedef struct
+{
+    u_int32_t *producer; // 書き込み側のインデックス
+    u_int32_t *consumer; // 読み出し側のインデックス
+    void *desc;          // エントリの配列(struct xdp_desc または u_int64_t)
+    u_int32_t mask;      // エントリ数-1
+    u_int32_t local;     // 自分が進める側のインデックス(未公開の分を含む)
+    void *map;           // mmapした先頭アドレス
+    size_t mapSize;      // mmapしたサイズ
+} XSK_RING;
+
+/**
+ * @brief AF_XDPのUMEM(全デバイスで共有するフレームプール)
+ * @details 受信したフレームは別のデバイスの送信リングにそのまま載せられるので, 転送でコピーが発生しない. @n
+ * 空きフレームはスタックで管理する. UMEMを使うのはワーカー0だけなのでロックは取らない
+ *
+ */
+typedef struct
+{
+    u_char *area;      // フレーム領域の先頭
+    size_t size;       // フレーム領域のサイズ
+    u_int64_t *free;   // 空きフレームのオフセットのスタック
+    int freeNo;        // 空きフレーム数
+    int fd;            // UMEMを登録したソケット(-1なら未登録)
+    u_int64_t rxFrame; // 処理中の受信フレームのオフセット(XskRxWalk()の中だけ有効)
+    int rxTaken;       // 処理中の受信フレームを送信リングに載せたかどうか
+} XSK_UMEM;
+
+/**
+ * @brief AF_XDPでデバイスを送受信するための状態
+ * @details XDPプログラムが自分宛てのIPv4フレームだけをこのソケットに渡し, ARPなどはPF_PACKETソケットで受信する
+ *
+ */
+typedef struct
+{
+    int fd;               // AF_XDPソケット(0なら未使用)
+    XSK_UMEM *umem;       // 共有するUMEM
+    XSK_RING rx;          // 受信リング
+    XSK_RING tx;          // 送信リング
+    XSK_RING fill;        // フィルリング(受信用の空きフレームをカーネルに渡す)
+    XSK_RING comp;        // 完了リング(送信が終わったフレームが返る)
+    unsigned int pending; // 送信リングに書き込み済みでカーネルに未通知のフレーム数
+    int progFd;           // XDPプログラム
+    int mapFd;            // XSKMAP
+    int linkFd;           // XDPプログラムとデバイスのリンク(閉じるとデタッチされる)
+} XSK_PORT;
+
+// io_uringのパラメータ
+#define URING_ENTRIES 1024  // SQのエントリ数(CQはその4倍)
+#define URING_BUF_NR 1024   // デバイスごとの受信バッファ数(2のべき乗)
+#define URING_BUF_SIZE 2048 // 1受信バッファのサイズ
+
+// io_uringの要求の種類(user_dataの上位に入れる)
+#define URING_OP_RECV 1    // マルチショット受信
+#define URING_OP_SEND 2    // 受信バッファからの送信
+#define URING_OP_TIMEOUT 3 // ARPテーブルのタイマ
+#define URING_OP_EVENT 4   // BufferSend()の処理待ちリストのeventfd
+
+#define URING_UD(op, deviceNo, bid) ((u_int64_t)(op) << 48 | (u_int64_t)(deviceNo) << 32 | (u_int32_t)(bid))
+#define URING_UD_OP(ud) ((int)((ud) >> 48))
+#define URING_UD_DEVICE(ud) ((int)(((ud) >> 32) & 0xFFFF))
+#define URING_UD_BID(ud) ((int)((ud) & 0xFFFFFFFF))
+
+/**
+ * @brief io_uringの提供バッファリング(デバイスごとの受信バッファ)
+ * @details カーネルはマルチショット受信のたびにここからバッファを1つ取り, 使ったバッファ番号をCQEで返す
+ *
+ */
+typedef struct
+{
+    void *ring;          // struct io_uring_buf_ring
+    size_t ringSize;     // ringのmmapサイズ
+    u_char *bufs;        // バッファ領域(URING_BUF_SIZE x URING_BUF_NR)
+    u_int16_t tail;      // 次にバッファを返す位置(未公開の分を含む)
+    int bgid;            // バッファグループ番号
+} URING_BUFS;
+
+/**
+ * @brief io_uringのリング
+ * @details SQEは溜めておき, URingEnter() で完了待ちと一緒にまとめて投入する
+ *
+ */
+typedef struct
+{
+    int fd;                // io_uringのファイルディスクリプタ(0なら未使用)
+    u_int32_t *sqHead;     // SQの先頭(カーネルが進める)
+    u_int32_t *sqTail;     // SQの末尾(ユーザが進める)
+    u_int32_t sqMask;
+    u_int32_t sqLocal;     // SQの末尾(未公開の分を含む)
+    void *sqes;            // SQEの配列
+    u_int32_t *cqHead;     // CQの先頭(ユーザが進める)
+    u_int32_t *cqTail;     // CQの末尾(カーネルが進める)
+    u_int32_t cqMask;
+    void *cqes;            // CQEの配列
+    void *sqMap, *cqMap;   // mmapしたリング
+    size_t sqMapSize, cqMapSize, sqesSize;
+    void *lastSend;        // 最後に積んだ送信のSQE(リンクをつなぐため)
+    u_char *rxData;        // 処理中の受信バッファ(RouterUring()の受信完了の処理中だけ有効, URingSend()はここから送信できる)
+    int rxDevice;          // 処理中の受信バッファのデバイス番号
+    int rxBid;             // 処理中の受信バッファの番号
+    int rxTaken;           // 処理中の受信バッファを送信に使ったかどうか
+    long long timeout[2];  // タイマの間隔(struct __kernel_timespec)
+    u_int64_t event;       // eventfdの読み込み先
+} URING;
+
+// PACKET_FANOUTの分配方式
+#define FANOUT_MODE_HASH 0 // フローのハッシュで分配(同じフローは同じワーカー)
+#define FANOUT_MODE_CPU 1  // 受信したCPUで分配(NICのRSSに従う)
+
+// チェックサムの1の補数和の計算方式
+#define CSUM_KERNEL_SCALAR 0 // 64ビット整数で8バイトずつ
+#define CSUM_KERNEL_SSE2 1   // SSE2で16バイトずつ
+#define CSUM_KERNEL_AVX2 2   // AVX2で32バイトずつ
+
 char *my_ether_ntoa_r(u_char *hwaddr, char *buf, socklen_t size);
 char *my_inet_ntoa_r(struct in_addr *addr, char *buf, socklen_t size);
 char *in_addr_t2str(in_addr_t addr, char *buf, socklen_t size);
 int GetDeviceInfo(char *device, u_char hwaddr[6], struct in_addr *uaddr, struct in_addr *subnet, struct in_addr *mask);
 int PrintEtherHeader(struct ether_header *eh, FILE *fp);
-int InitRawSocket(char *device, int promiscFlag, int ipOnly);
+extern __thread u_int64_t RxStamp; // 最後に受信したフレームのカーネルの受信時刻(RxRingWalk(), RxMmsgRead(), RecvStamp()が設定)
+
+int InitRawSocket(char *device, int promiscFlag, int ipOnly, u_char *filterHwaddr);
+int InitRxRing(int soc, RX_RING *ring, int retireTov);
+int RxRingWalk(RX_RING *ring, int deviceNo, int (*func)(int deviceNo, u_char *data, int size));
+int FreeRxRing(RX_RING *ring);
+int InitTxRing(char *device, TX_RING *ring, int qdiscBypass);
+int TxRingSend(TX_RING *ring, u_char *data, int size);
+int TxRingFlush(TX_RING *ring);
+int FreeTxRing(TX_RING *ring);
+int InitMmsgBatch(MMSG_BATCH *batch, int size);
+int RxMmsgRead(int soc, MMSG_BATCH *batch, int deviceNo, int (*func)(int deviceNo, u_char *data, int size));
+int TxMmsgSend(int soc, MMSG_BATCH *batch, u_char *data, int size);
+int TxMmsgFlush(int soc, MMSG_BATCH *batch);
+int FreeMmsgBatch(MMSG_BATCH *batch);
+int XskUmemInit(XSK_UMEM *umem, int frameNr);
+void XskUmemFree(XSK_UMEM *umem);
+int XskOpen(XSK_PORT *port, XSK_UMEM *umem, char *device, u_char hwaddr[6]);
+int XskRxWalk(XSK_PORT *port, int deviceNo, int (*func)(int deviceNo, u_char *data, int size));
+int XskSend(XSK_PORT *port, u_char *data, int size);
+int XskFlush(XSK_PORT *port);
+int XskClose(XSK_PORT *port);
+int URingInit(URING *u);
+int URingInitBufs(URING *u, URING_BUFS *b, int bgid);
+void URingReturnBuf(URING_BUFS *b, int bid);
+void URingPublishBufs(URING_BUFS *b);
+int URingRecv(URING *u, int soc, URING_BUFS *b, int deviceNo);
+int URingSend(URING *u, int soc, u_char *data, int size);
+int URingTimeout(URING *u, int ms);
+int URingReadEvent(URING *u, int efd);
+int URingEnter(URING *u, int wait);
+int URingPeek(URING *u, u_int64_t *userData, int *res, u_int32_t *flags);
+int URingBufId(u_int32_t flags);
+int URingMore(u_int32_t flags);
+int URingFreeBufs(URING_BUFS *b);
+int URingFree(URING *u);
+int JoinFanout(int soc, int groupId, int mode);
+int SetQdiscBypass(int soc);
+int SetIgnoreOutgoing(int soc);
+int SetBusyPoll(int soc, int usec);
+int SetRxTimestamp(int soc);
+int SetVnetHdr(int soc);
+int VnetIsGso(u_char *hdr);
+int VnetFinishCsum(u_char *hdr, u_char *data, int size);
+int VnetWrite(int soc, u_char *data, int size, int withHdr);
+int RecvStamp(int soc, u_char *buf, int size);
+int checksumSelect(int kernel);
+const char *checksumKernelName();
 u_int16_t checksum(unsigned char *data, int len);
 u_int16_t checksum2(unsigned char *data1, int len1, unsigned char *data2, int len2);
+u_int16_t checksumAdjust(u_int16_t check, u_int16_t old, u_int16_t new);
+void ipDecrementTtl(struct iphdr *iphdr);
 int checkIPchecksum(struct iphdr *iphdr, unsigned char *option, int optionLen);
-int SendArpRequestB(int soc, in_addr_t target_ip, unsigned char target_mac[6], in_addr_t my_ip, unsigned char my_mac[6]);
+int SendArpRequestB(int deviceNo, in_addr_t target_ip, unsigned char target_mac[6], in_addr_t my_ip, unsigned char my_mac[6]);
@@ -0,0 +1,114 @@
+/**
+ * @file rcu.c
+ * @brief 読み手がロックを取らない表の更新(QSBR)
+ * @details 更新側は新しい表を作ってポインタを差し替え, RcuSynchronize() で全ての読み手が @n
+ * 一度静止状態を通ったことを確かめてから古い表を解放する. @n
+ * 読み手は表を参照していない時点(受信待ちに入る前)で RcuOffline() を, 受信待ちから戻ったら RcuOnline() を呼ぶ. @n
+ * 読み手の処理はロックもアトミックな読み書きの繰り返しも必要としない
+ *
+ */
+#include <stdio.h>
+#include <poll.h>
+#include "rcu.h"
+
+extern int DebugPrintf(char *fmt, ...);
+
+#define RCU_WAIT_MS 1     // 読み手の静止状態を待つ間隔(ms)
+
+/**
+ * @brief 読み手ごとの状態. 読み手同士が同じキャッシュラインを共有しないようにアラインする
+ *
+ */
+typedef struct
+{
+    unsigned long epoch; // 最後に静止状態を通ったときの世代. 0なら表を参照していない
+} __attribute__((aligned(64))) RCU_READER;
+
+static RCU_READER RcuReaders[RCU_READER_MAX];
+static int RcuReaderNo;            // 登録された読み手の数
+static unsigned long RcuEpoch = 1; // 現在の世代. RcuSynchronize() のたびに進める
+
+static __thread RCU_READER *RcuSelf; // 自スレッドの状態
+
+/**
+ * @brief 自スレッドを読み手として登録する(登録後は参照中の状態になる)
+ *
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int RcuRegister()
+{
+    int no = __atomic_fetch_add(&RcuReaderNo, 1, __ATOMIC_SEQ_CST);
+
+    if (no >= RCU_READER_MAX)
+    {
+        DebugPrintf("RcuRegister:too many readers\n");
+        return -1;
+    }
+    RcuSelf = &RcuReaders[no];
+    RcuOnline();
+    return 0;
+}
+
+/**
+ * @brief 自スレッドの登録を解除する. 以後は表を参照しない状態のままになる
+ *
+ */
+void RcuUnregister()
+{
+    if (RcuSelf != NULL)
+    {
+        RcuOffline();
+        RcuSelf = NULL;
+    }
+}
+
+/**
+ * @brief 表の参照を始める
+ * @details 世代の書き込みより後の表のポインタの読み込みが先に行われないよう, フェンスを置く
+ *
+ */
+void RcuOnline()
+{
+    if (RcuSelf != NULL)
+    {
+        __atomic_store_n(&RcuSelf->epoch, __atomic_load_n(&RcuEpoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * @brief 表の参照を終える(静止状態). それまでに得た表やエントリへのポインタは使わない
+ *
+ */
+void RcuOffline()
+{
+    if (RcuSelf != NULL)
+    {
+        __atomic_store_n(&RcuSelf->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief 呼び出し前に参照を始めていた読み手が全て静止状態を通るまで待つ
+ * @details 表のポインタを差し替えた後に呼び出し, 戻ったら古い表を解放してよい
+ *
+ */
+void RcuSynchronize()
+{
+    unsigned long target, epoch;
+    int i, n;
+
+    target = __atomic_add_fetch(&RcuEpoch, 1, __ATOMIC_SEQ_CST);
+    n = __atomic_load_n(&RcuReaderNo, __ATOMIC_ACQUIRE);
+    if (n > RCU_READER_MAX)
+    {
+        n = RCU_READER_MAX;
+    }
+    for (i = 0; i < n; i++)
+    {
+        while ((epoch = __atomic_load_n(&RcuReaders[i].epoch, __ATOMIC_ACQUIRE)) != 0 && epoch < target)
+        {
+            poll(NULL, 0, RCU_WAIT_MS);
+        }
+    }
+}
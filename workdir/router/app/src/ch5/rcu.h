@@ -0,0 +1,13 @@
+/**
+ * @file rcu.h
+ * @brief 読み手がロックを取らない表の更新(QSBR)
+ *
+ */
+
+#define RCU_READER_MAX 64 // 登録できる読み手の最大数
+
+int RcuRegister();
+void RcuUnregister();
+void RcuOnline();
+void RcuOffline();
+void RcuSynchronize();
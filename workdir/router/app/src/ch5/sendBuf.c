@@ -11,20 +11,308 @@
 #include <net/ethernet.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <sys/mman.h>
 #include <pthread.h>
 #include "netutil.h"
 #include "base.h"
 #include "ip2mac.h"
+#include "sendBuf.h"
+#include "debug.h"
+#include "trace.h"
 
 extern int DebugPrintf(char *fmt, ...);
 extern int DebugPerror(char *msg);
 
-#define MAX_BUCKET_SIZE (1024 * 1024) // 送信待ちバッファの最大サイズ
+#define SEND_QUEUE_DEPTH 64 // 近隣ノードごとの送信待ちキューの長さ(デフォルト)
+
+// プールを広げる単位(hugepage 1枚分)
+#define PKT_POOL_CHUNK_SIZE (2 * 1024 * 1024)
+// スレッドごとの空きリストに置く最大数. 超えたら PKT_CACHE_BATCH 個を共有の空きリストに戻す
+#define PKT_CACHE_MAX 256
+// スレッドごとの空きリストと共有の空きリストの間で一度に移すスロット数
+#define PKT_CACHE_BATCH 64
+
+/**
+ * @brief パケットバッファプールのスロット
+ * @details ヘッダ部のDATA_BUFと, PKT_BUF_SIZEバイトのデータ領域からなる
+ *
+ */
+typedef struct
+{
+    DATA_BUF hdr;
+    u_char data[PKT_BUF_SIZE];
+} __attribute__((aligned(64))) PKT_BUF;
+
+/**
+ * @brief 全スレッドで共有する空きリスト
+ * @details スロットは PKT_POOL_CHUNK_SIZE 単位でmmap()し, 解放しない
+ *
+ */
+struct
+{
+    DATA_BUF *top;
+    int freeNo;           // 空きスロット数
+    int total;            // 確保したスロット数
+    int hugepage;         // hugepageで確保するかどうか
+    pthread_mutex_t mutex;
+} PktPool = {NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * @brief スレッドごとの空きリスト. 通常の確保と解放はロックを取らずにここで済ませる
+ *
+ */
+static __thread struct
+{
+    DATA_BUF *top;
+    int freeNo;
+} PktCache;
+
+// 自スレッドが受信に使っているバッファ. AppendSendData()がコピーせずに引き取る
+static __thread DATA_BUF *RxBuf;
+
+/**
+ * @brief 送信待ちキューの設定
+ *
+ */
+struct
+{
+    unsigned int depth; // キューの長さ(2のべき乗)
+    int policy;         // 一杯のときの破棄方式
+} SendQueue = {SEND_QUEUE_DEPTH, SEND_DROP_TAIL};
+
+/**
+ * @brief プールにスロットを追加する(PktPool.mutexは呼び出し側で取得する)
+ *
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+static int PktPoolGrow()
+{
+    PKT_BUF *chunk = MAP_FAILED;
+    int i, n = PKT_POOL_CHUNK_SIZE / sizeof(PKT_BUF);
+
+    if (PktPool.hugepage)
+    {
+        chunk = mmap(NULL, PKT_POOL_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (chunk == MAP_FAILED)
+        { // hugepageが予約されていない場合は通常のページで確保
+            DebugPerror("mmap(MAP_HUGETLB)");
+            PktPool.hugepage = 0;
+        }
+    }
+    if (chunk == MAP_FAILED)
+    {
+        chunk = mmap(NULL, PKT_POOL_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (chunk == MAP_FAILED)
+    {
+        DebugPerror("mmap");
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        chunk[i].hdr.data = chunk[i].data;
+        chunk[i].hdr.next = PktPool.top;
+        PktPool.top = &chunk[i].hdr;
+    }
+    PktPool.freeNo += n;
+    PktPool.total += n;
+    return 0;
+}
+
+/**
+ * @brief パケットバッファプールの初期化
+ * @details 起動時にスロットを確保しておき, 転送中にmmap()が起きないようにする
+ *
+ * @param[in] count : 事前に確保するスロット数
+ * @param[in] hugepage : 1 ならhugepageで確保する(できなければ通常のページ)
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int PktPoolInit(int count, int hugepage)
+{
+    pthread_mutex_lock(&PktPool.mutex);
+    PktPool.hugepage = hugepage;
+    while (PktPool.total < count)
+    {
+        if (PktPoolGrow() == -1)
+        {
+            pthread_mutex_unlock(&PktPool.mutex);
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&PktPool.mutex);
+
+    DebugPrintf("PktPoolInit:%d slots x %zubytes%s\n", PktPool.total, sizeof(PKT_BUF), PktPool.hugepage ? " (hugepage)" : "");
+
+    return 0;
+}
+
+/**
+ * @brief パケットバッファを1つ確保する
+ * @details スレッドごとの空きリストから取り出す. 空の場合だけ共有の空きリストから PKT_CACHE_BATCH 個まとめて移す
+ *
+ * @return パケットバッファ, NULL : 異常終了
+ */
+DATA_BUF *PktBufAlloc()
+{
+    DATA_BUF *d;
+
+    if (PktCache.top == NULL)
+    {
+        pthread_mutex_lock(&PktPool.mutex);
+        if (PktPool.top == NULL && PktPoolGrow() == -1)
+        {
+            pthread_mutex_unlock(&PktPool.mutex);
+            return NULL;
+        }
+        while (PktPool.top != NULL && PktCache.freeNo < PKT_CACHE_BATCH)
+        {
+            d = PktPool.top;
+            PktPool.top = d->next;
+            PktPool.freeNo--;
+            d->next = PktCache.top;
+            PktCache.top = d;
+            PktCache.freeNo++;
+        }
+        pthread_mutex_unlock(&PktPool.mutex);
+    }
+    d = PktCache.top;
+    PktCache.top = d->next;
+    PktCache.freeNo--;
+    d->next = NULL;
+    return d;
+}
+
+/**
+ * @brief パケットバッファを解放する
+ * @details 確保したスレッドと別のスレッドから解放してもよい. @n
+ * スレッドごとの空きリストが PKT_CACHE_MAX を超えたら, PKT_CACHE_BATCH 個を共有の空きリストに戻す
+ *
+ * @param[in] d : パケットバッファ
+ */
+void PktBufFree(DATA_BUF *d)
+{
+    d->next = PktCache.top;
+    PktCache.top = d;
+    if (++PktCache.freeNo <= PKT_CACHE_MAX)
+    {
+        return;
+    }
+    pthread_mutex_lock(&PktPool.mutex);
+    while (PktCache.freeNo > PKT_CACHE_MAX - PKT_CACHE_BATCH)
+    {
+        d = PktCache.top;
+        PktCache.top = d->next;
+        PktCache.freeNo--;
+        d->next = PktPool.top;
+        PktPool.top = d;
+        PktPool.freeNo++;
+    }
+    pthread_mutex_unlock(&PktPool.mutex);
+}
+
+/**
+ * @brief 自スレッドの受信バッファを得る
+ * @details read()で受信するときに使う. 受信したフレームを AppendSendData() が送信待ちにした場合は @n
+ * バッファごと引き取られるので, 次の呼び出しで新しいバッファを返す
+ *
+ * @return 受信バッファのデータ領域(PKT_BUF_SIZEバイト), NULL : 異常終了
+ */
+u_char *PktBufRx()
+{
+    if (RxBuf == NULL && (RxBuf = PktBufAlloc()) == NULL)
+    {
+        return NULL;
+    }
+    return RxBuf->data;
+}
+
+/**
+ * @brief 送信待ちキューの設定
+ * @details エントリを追加する前, 起動時に1回だけ呼び出す
+ *
+ * @param[in] depth : 近隣ノードごとのキューの長さ(2のべき乗に切り上げる)
+ * @param[in] policy : 一杯のときの破棄方式(SEND_DROP_TAIL, SEND_DROP_OLDEST)
+ * @return 0 : 正常終了
+ */
+int SendQueueInit(int depth, int policy)
+{
+    for (SendQueue.depth = 1; SendQueue.depth < depth; SendQueue.depth *= 2)
+        ;
+    SendQueue.policy = policy;
+
+    DebugPrintf("SendQueueInit:depth=%u policy=%s\n", SendQueue.depth, policy == SEND_DROP_OLDEST ? "oldest" : "tail");
+
+    return 0;
+}
+
+/**
+ * @brief 送信待ちキューのミューテックスの初期化
+ * @details エントリの格納領域を確保したときに1回だけ呼ばれる. @n
+ * エントリを再利用するときは初期化し直さない(別スレッドがロック中の可能性がある)
+ *
+ * @param[in] sd : 送信待ちキュー
+ */
+void InitSendDataMutex(SEND_DATA *sd)
+{
+    pthread_mutex_init(&sd->prodMutex, NULL);
+    pthread_mutex_init(&sd->consMutex, NULL);
+}
+
+/**
+ * @brief 送信待ちキューの初期化
+ * @details エントリを登録するたびに呼ばれる. 確保済みのリングとミューテックスはそのまま使う
+ *
+ * @param[in] sd : 送信待ちキュー
+ */
+void InitSendData(SEND_DATA *sd)
+{
+    sd->head = sd->tail = 0;
+    sd->drops = 0;
+}
+
+/**
+ * @brief 送信待ちキューの先頭を取り出す(consMutexは呼び出し側で取得する)
+ *
+ * @param[in] sd : 送信待ちキュー
+ * @return 送信待ちデータ, NULL : データなし
+ */
+static DATA_BUF *SendDataPop(SEND_DATA *sd)
+{
+    unsigned int head = sd->head;
+    DATA_BUF *d;
+
+    if (head == __atomic_load_n(&sd->tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    d = sd->ring[head & (SendQueue.depth - 1)];
+    __atomic_store_n(&sd->head, head + 1, __ATOMIC_RELEASE);
+    return d;
+}
+
+/**
+ * @brief キューが空になったときに IP2MAC.pending を下ろす(consMutexは呼び出し側で取得する)
+ * @details 下ろした直後に追加されていた場合は立て直し, 追加したデータが取り残されないようにする
+ *
+ * @param[in] ip2mac : IP2MAC構造体
+ * @param[in] sd : 送信待ちキュー
+ */
+static void SendDataIdle(IP2MAC *ip2mac, SEND_DATA *sd)
+{
+    __atomic_store_n(&ip2mac->pending, 0, __ATOMIC_SEQ_CST);
+    if (sd->head != __atomic_load_n(&sd->tail, __ATOMIC_SEQ_CST))
+    {
+        __atomic_store_n(&ip2mac->pending, 1, __ATOMIC_SEQ_CST);
+    }
+}
 
 /**
  * @brief IP2MAC内の送信待ちバッファにデータを追加
  * @details APTテーブルでMACアドレスの解決ができない場合に, main.cのAnalyzePacket()から呼ばれる. @n
- * 送信待ちバッファにデータを追加する
+ * 送信待ちバッファにデータを追加する. @n
+ * dataが PktBufRx() の受信バッファならバッファごと引き取り, そうでなければプールのバッファにコピーする. @n
+ * キューが一杯の場合, SEND_DROP_TAIL なら追加せずにエラーを返し, SEND_DROP_OLDEST なら一番古いデータを捨てて追加する. @n
+ * 既にMACアドレスが解決済みの場合は, BufferSend() に送信を依頼する
  *
  * @param[in] ip2mac : IP2MAC構造体
  * @param[in] deviceNo : デバイス番号
@@ -35,114 +323,118 @@ extern int DebugPerror(char *msg);
  */
 int AppendSendData(IP2MAC *ip2mac, int deviceNo, in_addr_t addr, u_char *data, int size)
 {
-    SEND_DATA *sd = &ip2mac->sd;
+    SEND_DATA *sd = Ip2MacSendData(ip2mac);
     DATA_BUF *d;
+    unsigned int tail;
     int status;
     char buf[80];
 
-    if (sd->inBucketSize > MAX_BUCKET_SIZE)
+    if (size > PKT_BUF_SIZE)
     {
-        DebugPrintf("AppendSendData:Bucket overflow\n");
+        DebugPkt("AppendSendData:too big(%d)\n", size);
         return -1;
     }
 
-    d = (DATA_BUF *)malloc(sizeof(DATA_BUF));
-    if (d == NULL)
+    if ((status = pthread_mutex_lock(&sd->prodMutex)) != 0)
     {
-        DebugPerror("malloc");
+        DebugInfo("AppendSendData:pthread_mutex_lock:%s\n", strerror(status));
         return -1;
     }
-
-    d->data = (u_char *)malloc(size);
-    if (d->data == NULL)
+    if (sd->ring == NULL && (sd->ring = (DATA_BUF **)malloc(SendQueue.depth * sizeof(DATA_BUF *))) == NULL)
     {
         DebugPerror("malloc");
-        free(d);
+        pthread_mutex_unlock(&sd->prodMutex);
         return -1;
     }
+    tail = sd->tail;
+    if (tail - __atomic_load_n(&sd->head, __ATOMIC_ACQUIRE) >= SendQueue.depth)
+    { // キューが一杯の場合
+        if (SendQueue.policy == SEND_DROP_OLDEST && pthread_mutex_trylock(&sd->consMutex) == 0)
+        { // 取り出し中でなければ, 一番古いデータを捨てる
+            if ((d = SendDataPop(sd)) != NULL)
+            {
+                DebugPkt("AppendSendData:drop oldest(%ldsec)\n", (long)(time(NULL) - d->t));
+                Trace(TRACE_EV_QUEUE_DROP, deviceNo, SEND_DROP_OLDEST, 0, addr, d->size);
+                PktBufFree(d);
+                sd->drops++;
+            }
+            pthread_mutex_unlock(&sd->consMutex);
+        }
+        else
+        {
+            sd->drops++;
+            pthread_mutex_unlock(&sd->prodMutex);
+            DebugPkt("AppendSendData:queue full(drops=%lu)\n", sd->drops);
+            Trace(TRACE_EV_QUEUE_DROP, deviceNo, SEND_DROP_TAIL, 0, addr, size);
+            return -1;
+        }
+    }
 
-    d->next = d->before = NULL;
-    d->t = time(NULL);
-    d->size = size;
-    memcpy(d->data, data, size);
-
-    if ((status = pthread_mutex_lock(&sd->mutex)) != 0)
-    {
-        DebugPrintf("AppendSendData:pthread_mutex_lock:%s\n", strerror(status));
-        free(d->data);
-        free(d);
-        return -1;
+    if (RxBuf != NULL && data == RxBuf->data)
+    { // 受信バッファをそのまま送信待ちにする
+        d = RxBuf;
+        RxBuf = NULL;
     }
-    if (sd->bottom == NULL)
+    else if ((d = PktBufAlloc()) == NULL)
     {
-        sd->top = sd->bottom = d;
+        DebugPkt("AppendSendData:PktBufAlloc:error\n");
+        pthread_mutex_unlock(&sd->prodMutex);
+        return -1;
     }
     else
     {
-        sd->bottom->next = d;
-        d->before = sd->bottom;
-        sd->bottom = d;
+        memcpy(d->data, data, size);
     }
+    d->t = time(NULL);
+    d->size = size;
 
-    sd->dno++;
-    sd->inBucketSize += size;
-    pthread_mutex_unlock(&sd->mutex);
+    sd->ring[tail & (SendQueue.depth - 1)] = d;
+    __atomic_store_n(&sd->tail, tail + 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ip2mac->pending, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&sd->prodMutex);
 
-    DebugPrintf("AppendSendData:[%d]%s:%dbytes(Total=%lu:%lubytes)\n", deviceNo, in_addr_t2str(addr, buf, sizeof(buf)), size, sd->dno, sd->inBucketSize);
+    DebugPkt("AppendSendData:[%d]%s:%dbytes(Total=%u)\n", deviceNo, in_addr_t2str(addr, buf, sizeof(buf)), size, tail + 1 - sd->head);
+
+    if (ip2mac->flag == FLAG_OK)
+    { // 解決済みのエントリで前のデータを送信中の場合, 送信し残さないよう依頼し直す
+        AppendSendReqData(ip2mac->deviceNo, ip2mac->no);
+    }
 
     return 0;
 }
 
 /**
- * @brief Get the Send Data object
+ * @brief 送信待ちバッファの先頭のデータを取り出す
+ * @details 取り出したデータは, 送信後に呼び出し側で PktBufFree() する
  *
  * @param[in] ip2mac : IP2MAC構造体
- * @param[in] size : 送信データサイズ
- * @param[in] data : 送信データ
- * @return 0 : 正常終了, -1 : 異常終了
+ * @return 送信待ちデータ, NULL : データなし
  */
-int GetSendData(IP2MAC *ip2mac, int *size, u_char **data)
+DATA_BUF *GetSendData(IP2MAC *ip2mac)
 {
-    SEND_DATA *sd = &ip2mac->sd;
+    SEND_DATA *sd = Ip2MacSendData(ip2mac);
     DATA_BUF *d;
     int status;
 
     char buf[80];
 
-    if (sd->top == NULL)
+    if ((status = pthread_mutex_lock(&sd->consMutex)) != 0)
     {
-        return -1;
+        DebugInfo("GetSendData:pthread_mutex_lock:%s\n", strerror(status));
+        return NULL;
     }
-
-    if ((status = pthread_mutex_lock(&sd->mutex)) != 0)
+    if ((d = SendDataPop(sd)) == NULL)
     {
-        DebugPrintf("GetSendData:pthread_mutex_lock:%s\n", strerror(status));
-        return -1;
+        SendDataIdle(ip2mac, sd);
     }
+    pthread_mutex_unlock(&sd->consMutex);
 
-    d = sd->top;
-    sd->top = d->next;
-    if (sd->top == NULL)
-    {
-        sd->bottom = NULL;
-    }
-    else
+    if (d != NULL)
     {
-        sd->top->before = NULL;
+        DebugPkt("GetSendData:[%d] %s:%dbytes\n", ip2mac->deviceNo, in_addr_t2str(ip2mac->addr, buf, sizeof(buf)), d->size);
     }
-    sd->dno--;
-    sd->inBucketSize -= d->size;
-
-    pthread_mutex_unlock(&sd->mutex);
-
-    *size = d->size;
-    *data = d->data;
-
-    free(d);
-
-    DebugPrintf("GetSendData:[%d] %s:%dbytes\n", ip2mac->deviceNo, in_addr_t2str(ip2mac->addr, buf, sizeof(buf)), *size);
 
-    return 0;
+    return d;
 }
 
 /**
@@ -154,34 +446,33 @@ int GetSendData(IP2MAC *ip2mac, int *size, u_char **data)
  */
 int FreeSendData(IP2MAC *ip2mac)
 {
-    SEND_DATA *sd = &ip2mac->sd;
-    DATA_BUF *ptr;
+    SEND_DATA *sd = Ip2MacSendData(ip2mac);
+    DATA_BUF *d;
     int status;
 
     char buf[80];
 
-    if (sd->top == NULL)
+    if (sd->ring == NULL)
     {
         return 0;
     }
 
-    if ((status = pthread_mutex_lock(&sd->mutex)) != 0)
+    if ((status = pthread_mutex_lock(&sd->consMutex)) != 0)
     {
-        DebugPrintf("FreeSendData:pthread_mutex_lock:%s\n", strerror(status));
+        DebugInfo("FreeSendData:pthread_mutex_lock:%s\n", strerror(status));
         return -1;
     }
 
-    for (ptr = sd->top; ptr != NULL; ptr = ptr->next)
+    while ((d = SendDataPop(sd)) != NULL)
     {
-        DebugPrintf("FreeSendData:%s:%lubytes\n", in_addr_t2str(ip2mac->addr, buf, sizeof(buf)), sd->inBucketSize);
-        free(ptr->data);
+        DebugPkt("FreeSendData:%s:%dbytes\n", in_addr_t2str(ip2mac->addr, buf, sizeof(buf)), d->size);
+        PktBufFree(d);
     }
+    SendDataIdle(ip2mac, sd);
 
-    sd->top = sd->bottom = NULL;
+    pthread_mutex_unlock(&sd->consMutex);
 
-    pthread_mutex_unlock(&sd->mutex);
-
-    DebugPrintf("FreeSendData:[%d]\n", ip2mac->deviceNo);
+    DebugInfo("FreeSendData:[%d] drops=%lu\n", ip2mac->deviceNo, sd->drops);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,4 +1,11 @@
+int PktPoolInit(int count, int hugepage);
+DATA_BUF *PktBufAlloc();
+void PktBufFree(DATA_BUF *d);
+unsigned char *PktBufRx();
+int SendQueueInit(int depth, int policy);
+void InitSendDataMutex(SEND_DATA *sd);
+void InitSendData(SEND_DATA *sd);
 int AppendSendData(IP2MAC *ip2mac, int deviceNo, in_addr_t addr, unsigned char *data, int size);
-int GetSendData(IP2MAC *ip2mac, int *size, unsigned char **data);
+DATA_BUF *GetSendData(IP2MAC *ip2mac);
 int FreeSendData(IP2MAC *ip2mac);
 int BufferSend();
@@ -0,0 +1,292 @@
+/**
+ * @file trace.c
+ * @brief パケットごとのトレース記録
+ * @details スレッドごとに固定長レコードのリングを持ち, 記録はロックを取らずに書き込むだけで済ませる. @n
+ * 書き出しスレッドが定期的に全スレッドのリングを読み, テキストにしてファイルに出力する. @n
+ * 書き出しが追いつかない場合は古いレコードから上書きし, 転送処理を待たせない. 失われた数は終了時に出力する
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <pthread.h>
+#include "netutil.h"
+#include "base.h"
+#include "debug.h"
+#include "trace.h"
+
+extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+extern int EndFlag;
+
+// スレッドごとのリングのレコード数(2のべき乗)
+#define TRACE_RING_SIZE 4096
+// 書き出しスレッドがリングを読む間隔(ms)
+#define TRACE_DRAIN_MS 100
+
+/**
+ * @brief スレッドごとのトレースリング
+ * @details headは書き込むスレッドだけが, tailは書き出しスレッドだけが更新する
+ *
+ */
+typedef struct trace_ring
+{
+    TRACE_REC *rec;
+    unsigned int head;       // 次に書き込む番号
+    unsigned int tail;       // 次に読む番号
+    unsigned long lost;      // 上書きされて読めなかったレコード数
+    int no;                  // リング番号(登録順)
+    struct trace_ring *next; // 登録済みリングのリスト
+} TRACE_RING;
+
+int TraceOn = 0;
+
+static __thread TRACE_RING *TraceCur; // 自スレッドのリング
+
+/**
+ * @brief 登録済みリングと書き出し先
+ *
+ */
+static struct
+{
+    TRACE_RING *top;
+    int ringNo;
+    FILE *fp;
+    pthread_t tid;
+    pthread_mutex_t mutex;
+} TraceOut = {NULL, 0, NULL, 0, PTHREAD_MUTEX_INITIALIZER};
+
+static char *TraceEvName[] = {"?", "ARP", "FWD", "ARP_WAIT", "BUF_SEND", "QUEUE_DROP", "DROP", "TIME_EXCEEDED"};
+static char *TraceDropName[] = {"?", "short", "ihl", "csum", "ttl", "no_arp", "no_route"};
+
+/**
+ * @brief 自スレッドのリングを確保して登録する
+ *
+ * @return リング, NULL : 異常終了
+ */
+static TRACE_RING *TraceAttach()
+{
+    TRACE_RING *r;
+
+    if ((r = (TRACE_RING *)calloc(1, sizeof(TRACE_RING))) == NULL)
+    {
+        return NULL;
+    }
+    if ((r->rec = (TRACE_REC *)calloc(TRACE_RING_SIZE, sizeof(TRACE_REC))) == NULL)
+    {
+        free(r);
+        return NULL;
+    }
+    pthread_mutex_lock(&TraceOut.mutex);
+    r->no = TraceOut.ringNo++;
+    r->next = TraceOut.top;
+    TraceOut.top = r;
+    pthread_mutex_unlock(&TraceOut.mutex);
+
+    TraceCur = r;
+    return r;
+}
+
+/**
+ * @brief トレースを1レコード記録する
+ * @details 書き込み中はseqを0にしておき, 書き出しスレッドが途中のレコードを読まないようにする. @n
+ * 直接呼ばずに Trace() マクロを使う
+ *
+ * @param[in] event : TRACE_EV_*
+ * @param[in] deviceNo : デバイス番号
+ * @param[in] arg : イベントごとの補足情報
+ * @param[in] saddr : 送信元IPアドレス
+ * @param[in] daddr : 宛先IPアドレス
+ * @param[in] size : フレーム長
+ */
+void TraceWrite(int event, int deviceNo, int arg, in_addr_t saddr, in_addr_t daddr, int size)
+{
+    TRACE_RING *r = TraceCur;
+    TRACE_REC *rec;
+    struct timespec ts;
+    unsigned int head;
+
+    if (r == NULL && (r = TraceAttach()) == NULL)
+    {
+        return;
+    }
+    head = r->head;
+    rec = &r->rec[head & (TRACE_RING_SIZE - 1)];
+
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec->ns = (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    rec->event = event;
+    rec->deviceNo = deviceNo;
+    rec->arg = arg;
+    rec->saddr = saddr;
+    rec->daddr = daddr;
+    rec->size = size;
+
+    __atomic_store_n(&rec->seq, head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 1レコードをテキストで出力する
+ *
+ * @param[in] r : リング
+ * @param[in] rec : レコード
+ */
+static void TracePrint(TRACE_RING *r, TRACE_REC *rec)
+{
+    char buf1[80], buf2[80];
+
+    fprintf(TraceOut.fp, "%llu.%09llu t%d [%d] %s", (unsigned long long)(rec->ns / 1000000000), (unsigned long long)(rec->ns % 1000000000),
+            r->no, rec->deviceNo, rec->event < sizeof(TraceEvName) / sizeof(TraceEvName[0]) ? TraceEvName[rec->event] : "?");
+    switch (rec->event)
+    {
+    case TRACE_EV_DROP:
+        fprintf(TraceOut.fp, "(%s)", rec->arg < sizeof(TraceDropName) / sizeof(TraceDropName[0]) ? TraceDropName[rec->arg] : "?");
+        break;
+    case TRACE_EV_QUEUE_DROP:
+        fprintf(TraceOut.fp, "(%s)", rec->arg == SEND_DROP_OLDEST ? "oldest" : "tail");
+        break;
+    case TRACE_EV_FWD:
+    case TRACE_EV_ARP_WAIT:
+        fprintf(TraceOut.fp, "->[%d]", rec->arg);
+        break;
+    case TRACE_EV_ARP:
+        fprintf(TraceOut.fp, "(op=%d)", rec->arg);
+        break;
+    }
+    fprintf(TraceOut.fp, " %s > %s %ubytes\n", in_addr_t2str(rec->saddr, buf1, sizeof(buf1)), in_addr_t2str(rec->daddr, buf2, sizeof(buf2)), rec->size);
+}
+
+/**
+ * @brief 全スレッドのリングから未読のレコードを読んで出力する
+ * @details 読み込みの前後でseqを確かめ, 読んでいる間に上書きされたレコードは捨てる
+ *
+ */
+static void TraceDrain()
+{
+    TRACE_RING *r;
+    TRACE_REC *rec, copy;
+    unsigned int head, i;
+
+    pthread_mutex_lock(&TraceOut.mutex);
+    for (r = TraceOut.top; r != NULL; r = r->next)
+    {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (head - r->tail > TRACE_RING_SIZE)
+        { // 読む前に上書きされた分
+            r->lost += head - TRACE_RING_SIZE - r->tail;
+            r->tail = head - TRACE_RING_SIZE;
+        }
+        for (i = r->tail; i != head; i++)
+        {
+            rec = &r->rec[i & (TRACE_RING_SIZE - 1)];
+            if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != i + 1)
+            {
+                r->lost++;
+                continue;
+            }
+            copy = *rec;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != i + 1)
+            {
+                r->lost++;
+                continue;
+            }
+            TracePrint(r, &copy);
+        }
+        r->tail = head;
+    }
+    pthread_mutex_unlock(&TraceOut.mutex);
+    fflush(TraceOut.fp);
+}
+
+/**
+ * @brief トレースの書き出しスレッド
+ * @details 終了フラグが立つまで一定間隔でリングを読み, 最後にもう一度読んでから終わる
+ *
+ */
+static void *TraceThread(void *arg)
+{
+    while (EndFlag == 0)
+    {
+        poll(NULL, 0, TRACE_DRAIN_MS);
+        TraceDrain();
+    }
+    TraceDrain();
+    return NULL;
+}
+
+/**
+ * @brief トレースを開始する
+ *
+ * @param[in] path : 書き出し先のファイル名("-"なら標準エラー出力)
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int TraceInit(char *path)
+{
+    int status;
+
+    if (strcmp(path, "-") == 0)
+    {
+        TraceOut.fp = stderr;
+    }
+    else if ((TraceOut.fp = fopen(path, "w")) == NULL)
+    {
+        DebugPerror(path);
+        return -1;
+    }
+    if ((status = pthread_create(&TraceOut.tid, NULL, TraceThread, NULL)) != 0)
+    {
+        DebugPrintf("pthread_create:%s\n", strerror(status));
+        if (TraceOut.fp != stderr)
+        {
+            fclose(TraceOut.fp);
+        }
+        TraceOut.fp = NULL;
+        return -1;
+    }
+    TraceOn = 1;
+    DebugPrintf("TraceInit:%s %d records/thread\n", path, TRACE_RING_SIZE);
+    return 0;
+}
+
+/**
+ * @brief トレースを終了する
+ * @details 全スレッドの記録が終わった後(終了フラグを立てて各スレッドを待った後)に呼び出す
+ *
+ * @return 0 : 正常終了
+ */
+int TraceEnd()
+{
+    TRACE_RING *r;
+
+    if (TraceOut.fp == NULL)
+    {
+        return 0;
+    }
+    TraceOn = 0;
+    pthread_join(TraceOut.tid, NULL);
+
+    while ((r = TraceOut.top) != NULL)
+    {
+        DebugPrintf("trace[t%d]:records=%u lost=%lu\n", r->no, r->head, r->lost);
+        TraceOut.top = r->next;
+        free(r->rec);
+        free(r);
+    }
+    if (TraceOut.fp != stderr)
+    {
+        fclose(TraceOut.fp);
+    }
+    TraceOut.fp = NULL;
+    return 0;
+}
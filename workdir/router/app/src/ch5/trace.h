@@ -0,0 +1,59 @@
+/**
+ * @file trace.h
+ * @brief パケットごとのトレース記録
+ * @details debug.h の後にインクルードする
+ *
+ */
+
+#define TRACE_EV_ARP 1           // ARPを受信(arg : ARPオペレーション)
+#define TRACE_EV_FWD 2           // 転送(arg : 送信先デバイス番号)
+#define TRACE_EV_ARP_WAIT 3      // ARP解決待ちで送信待ちキューに格納(arg : 送信先デバイス番号)
+#define TRACE_EV_BUF_SEND 4      // 送信待ちキューから送信
+#define TRACE_EV_QUEUE_DROP 5    // 送信待ちキューで破棄(arg : SEND_DROP_*)
+#define TRACE_EV_DROP 6          // 受信パケットを破棄(arg : TRACE_DROP_*)
+#define TRACE_EV_TIME_EXCEEDED 7 // ICMP Time Exceededを送信
+
+#define TRACE_DROP_SHORT 1    // ヘッダより短い
+#define TRACE_DROP_IHL 2      // IPヘッダ長が不正
+#define TRACE_DROP_CSUM 3     // IPヘッダのチェックサムが不正
+#define TRACE_DROP_TTL 4      // TTLが0になる
+#define TRACE_DROP_NO_ARP 5   // ARPテーブルに空きがない
+#define TRACE_DROP_NO_ROUTE 6 // 経路がない
+
+/**
+ * @brief トレースの1レコード(32バイト固定長)
+ * @details アドレスはネットワークバイトオーダーのまま記録し, 文字列化は書き出しスレッドで行う
+ *
+ */
+typedef struct
+{
+    u_int64_t ns;       // 記録時刻(CLOCK_MONOTONIC, ns)
+    u_int32_t seq;      // 書き込み番号+1. 書き込み中は0
+    u_int16_t event;    // TRACE_EV_*
+    u_int8_t deviceNo;  // 受信(送信)デバイス番号
+    u_int8_t arg;       // イベントごとの補足情報
+    in_addr_t saddr;    // 送信元IPアドレス
+    in_addr_t daddr;    // 宛先IPアドレス
+    u_int32_t size;     // フレーム長
+    u_int32_t reserved;
+} TRACE_REC;
+
+extern int TraceOn; // トレースを記録するかどうか
+
+/**
+ * @brief トレースを1レコード記録する
+ * @details トレースが無効なら引数は評価されない. DEBUG_LEVEL_MAX がパケットごとの出力を含まない場合はコンパイル時に取り除かれる
+ *
+ */
+#define Trace(event, deviceNo, arg, saddr, daddr, size)                                     \
+    do                                                                                      \
+    {                                                                                       \
+        if (DEBUG_LEVEL_MAX >= DEBUG_LEVEL_PKT && __builtin_expect(TraceOn, 0))             \
+        {                                                                                   \
+            TraceWrite((event), (deviceNo), (arg), (saddr), (daddr), (size));               \
+        }                                                                                   \
+    } while (0)
+
+void TraceWrite(int event, int deviceNo, int arg, in_addr_t saddr, in_addr_t daddr, int size);
+int TraceInit(char *path);
+int TraceEnd();
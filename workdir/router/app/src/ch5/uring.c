@@ -0,0 +1,500 @@
+/**
+ * @file uring.c
+ * @brief io_uringによる送受信
+ * @details ワーカーごとに1つのio_uringを持ち, 受信・送信・タイマ・BufferSend()の起床をすべて同じ完了キューで待つ. @n
+ * 受信はデバイスごとの提供バッファリングを使ったマルチショット受信で, 1回の要求で受信し続ける. @n
+ * 転送するフレームは受信バッファのままIORING_OP_SENDで送り, 送信の完了時にバッファをリングに返す. @n
+ * SQEは溜めておき, 完了待ちの io_uring_enter() と一緒にまとめて投入する. liburingは使わず, システムコールで直接操作する
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <linux/io_uring.h>
+#include "netutil.h"
+
+extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+
+/**
+ * @brief io_uring_setup()システムコール
+ *
+ */
+static int URingSetup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(SYS_io_uring_setup, entries, p);
+}
+
+/**
+ * @brief io_uring_register()システムコール
+ *
+ */
+static int URingRegister(int fd, unsigned opcode, void *arg, unsigned nrArgs)
+{
+    return syscall(SYS_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+/**
+ * @brief io_uringを作成してリングをmmapする
+ * @details 単一スレッドからしか投入しないので, 可能ならSINGLE_ISSUERとDEFER_TASKRUNを指定し, @n
+ * 完了処理を io_uring_enter() の中でまとめて行わせる. 古いカーネルではこれらを外して作り直す. @n
+ * 使用するスレッドから呼び出すこと
+ *
+ * @param [out] u : io_uring
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int URingInit(URING *u)
+{
+    struct io_uring_params p;
+    u_int32_t *array;
+    unsigned i;
+    int fd;
+
+    memset(u, 0, sizeof(URING));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = URING_ENTRIES * 4;
+    if ((fd = URingSetup(URING_ENTRIES, &p)) == -1 && errno == EINVAL)
+    {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_ENTRIES * 4;
+        fd = URingSetup(URING_ENTRIES, &p);
+    }
+    if (fd == -1)
+    {
+        DebugPerror("io_uring_setup");
+        return -1;
+    }
+    u->fd = fd;
+
+    u->sqMapSize = p.sq_off.array + p.sq_entries * sizeof(u_int32_t);
+    u->cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (u->cqMapSize > u->sqMapSize)
+        {
+            u->sqMapSize = u->cqMapSize;
+        }
+        u->cqMapSize = 0;
+    }
+    u->sqMap = mmap(NULL, u->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (u->sqMap == MAP_FAILED)
+    {
+        DebugPerror("mmap:io_uring sq");
+        u->sqMap = NULL;
+        URingFree(u);
+        return -1;
+    }
+    if (u->cqMapSize == 0)
+    {
+        u->cqMap = u->sqMap;
+    }
+    else
+    {
+        u->cqMap = mmap(NULL, u->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (u->cqMap == MAP_FAILED)
+        {
+            DebugPerror("mmap:io_uring cq");
+            u->cqMap = NULL;
+            URingFree(u);
+            return -1;
+        }
+    }
+    u->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+    {
+        DebugPerror("mmap:io_uring sqes");
+        u->sqes = NULL;
+        URingFree(u);
+        return -1;
+    }
+
+    u->sqHead = (u_int32_t *)((u_char *)u->sqMap + p.sq_off.head);
+    u->sqTail = (u_int32_t *)((u_char *)u->sqMap + p.sq_off.tail);
+    u->sqMask = *(u_int32_t *)((u_char *)u->sqMap + p.sq_off.ring_mask);
+    u->sqLocal = *u->sqTail;
+    u->cqHead = (u_int32_t *)((u_char *)u->cqMap + p.cq_off.head);
+    u->cqTail = (u_int32_t *)((u_char *)u->cqMap + p.cq_off.tail);
+    u->cqMask = *(u_int32_t *)((u_char *)u->cqMap + p.cq_off.ring_mask);
+    u->cqes = (u_char *)u->cqMap + p.cq_off.cqes;
+
+    // SQEの位置とSQの位置を1対1に対応させておく
+    array = (u_int32_t *)((u_char *)u->sqMap + p.sq_off.array);
+    for (i = 0; i < p.sq_entries; i++)
+    {
+        array[i] = i;
+    }
+
+    DebugPrintf("io_uring:fd=%d,sq=%u,cq=%u,flags=0x%x,features=0x%x\n", fd, p.sq_entries, p.cq_entries, p.flags, p.features);
+
+    return 0;
+}
+
+/**
+ * @brief デバイスの受信バッファを確保し, 提供バッファリングとして登録する
+ *
+ * @param [in] u : io_uring
+ * @param [out] b : 提供バッファリング
+ * @param [in] bgid : バッファグループ番号(デバイス番号)
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int URingInitBufs(URING *u, URING_BUFS *b, int bgid)
+{
+    struct io_uring_buf_reg reg;
+    int i;
+
+    memset(b, 0, sizeof(URING_BUFS));
+    b->bgid = bgid;
+    b->ringSize = URING_BUF_NR * sizeof(struct io_uring_buf);
+    b->ring = mmap(NULL, b->ringSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (b->ring == MAP_FAILED)
+    {
+        DebugPerror("mmap:io_uring buf ring");
+        b->ring = NULL;
+        return -1;
+    }
+    b->bufs = mmap(NULL, (size_t)URING_BUF_SIZE * URING_BUF_NR, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (b->bufs == MAP_FAILED)
+    {
+        DebugPerror("mmap:io_uring bufs");
+        b->bufs = NULL;
+        URingFreeBufs(b);
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (u_int64_t)(unsigned long)b->ring;
+    reg.ring_entries = URING_BUF_NR;
+    reg.bgid = bgid;
+    if (URingRegister(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        DebugPerror("io_uring_register:IORING_REGISTER_PBUF_RING");
+        URingFreeBufs(b);
+        return -1;
+    }
+
+    for (i = 0; i < URING_BUF_NR; i++)
+    {
+        URingReturnBuf(b, i);
+    }
+    URingPublishBufs(b);
+
+    return 0;
+}
+
+/**
+ * @brief 受信バッファをリングに返す. カーネルから見えるのは URingPublishBufs() の後
+ *
+ * @param [in] b : 提供バッファリング
+ * @param [in] bid : バッファ番号
+ */
+void URingReturnBuf(URING_BUFS *b, int bid)
+{
+    struct io_uring_buf *buf;
+
+    // 先頭のエントリの予約領域はリングの末尾と重なるので, addr,len,bid以外は書かない
+    buf = &((struct io_uring_buf_ring *)b->ring)->bufs[b->tail & (URING_BUF_NR - 1)];
+    buf->addr = (u_int64_t)(unsigned long)(b->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    b->tail++;
+}
+
+/**
+ * @brief 返した受信バッファをまとめてカーネルに公開する
+ *
+ * @param [in] b : 提供バッファリング
+ */
+void URingPublishBufs(URING_BUFS *b)
+{
+    struct io_uring_buf_ring *ring = (struct io_uring_buf_ring *)b->ring;
+
+    if (ring != NULL && ring->tail != b->tail)
+    {
+        __atomic_store_n(&ring->tail, b->tail, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief 空きSQEを1つ取り出す. SQが一杯なら溜まっている分を投入してから取り出す
+ *
+ * @param [in] u : io_uring
+ * @return SQE, NULL : 空きなし
+ */
+static struct io_uring_sqe *URingGetSqe(URING *u)
+{
+    struct io_uring_sqe *sqe;
+
+    if (u->sqLocal - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) > u->sqMask)
+    {
+        URingEnter(u, 0);
+        if (u->sqLocal - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) > u->sqMask)
+        {
+            return NULL;
+        }
+    }
+    sqe = &((struct io_uring_sqe *)u->sqes)[u->sqLocal & u->sqMask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    u->sqLocal++;
+
+    return sqe;
+}
+
+/**
+ * @brief マルチショット受信を要求する
+ * @details 受信のたびにバッファグループからバッファを取り, 完了がIORING_CQE_F_MOREなしで返るまで受信し続ける
+ *
+ * @param [in] u : io_uring
+ * @param [in] soc : ソケット
+ * @param [in] b : 提供バッファリング
+ * @param [in] deviceNo : デバイス番号
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int URingRecv(URING *u, int soc, URING_BUFS *b, int deviceNo)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = URingGetSqe(u)) == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = soc;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = b->bgid;
+    sqe->user_data = URING_UD(URING_OP_RECV, deviceNo, 0);
+
+    return 0;
+}
+
+/**
+ * @brief 処理中の受信バッファにあるフレームを送信する
+ * @details 受信バッファはコピーせずにそのまま送り, 送信の完了時にリングに返す. @n
+ * 続けて積んだ送信はIOSQE_IO_HARDLINKでつなぎ, 積んだ順に送られるようにする. @n
+ * 受信バッファ以外のデータや, 既に送信に使った受信バッファは扱わない(呼び出し側でwrite()する)
+ *
+ * @param [in] u : io_uring
+ * @param [in] soc : ソケット
+ * @param [in] data : データ
+ * @param [in] size : サイズ
+ * @return 0 : 正常終了, -1 : 扱えない
+ */
+int URingSend(URING *u, int soc, u_char *data, int size)
+{
+    struct io_uring_sqe *sqe, *prev;
+
+    if (u->rxData == NULL || u->rxTaken || data < u->rxData || data + size > u->rxData + URING_BUF_SIZE)
+    {
+        return -1;
+    }
+    if ((sqe = URingGetSqe(u)) == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = soc;
+    sqe->addr = (u_int64_t)(unsigned long)data;
+    sqe->len = size;
+    sqe->user_data = URING_UD(URING_OP_SEND, u->rxDevice, u->rxBid);
+
+    // 直前のSQEがまだ投入していない送信ならリンクする
+    prev = &((struct io_uring_sqe *)u->sqes)[(u->sqLocal - 2) & u->sqMask];
+    if (u->lastSend == prev)
+    {
+        prev->flags |= IOSQE_IO_HARDLINK;
+    }
+    u->lastSend = sqe;
+    u->rxTaken = 1;
+
+    return 0;
+}
+
+/**
+ * @brief タイマを要求する. 指定時間後に-ETIMEで完了する
+ *
+ * @param [in] u : io_uring
+ * @param [in] ms : 時間(ms)
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int URingTimeout(URING *u, int ms)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = URingGetSqe(u)) == NULL)
+    {
+        return -1;
+    }
+    u->timeout[0] = ms / 1000;
+    u->timeout[1] = (long long)(ms % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (u_int64_t)(unsigned long)u->timeout;
+    sqe->len = 1;
+    sqe->user_data = URING_UD(URING_OP_TIMEOUT, 0, 0);
+
+    return 0;
+}
+
+/**
+ * @brief eventfdの読み込みを要求する. 通知があると完了する
+ *
+ * @param [in] u : io_uring
+ * @param [in] efd : eventfd
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int URingReadEvent(URING *u, int efd)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = URingGetSqe(u)) == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = efd;
+    sqe->addr = (u_int64_t)(unsigned long)&u->event;
+    sqe->len = sizeof(u->event);
+    sqe->off = (u_int64_t)-1;
+    sqe->user_data = URING_UD(URING_OP_EVENT, 0, 0);
+
+    return 0;
+}
+
+/**
+ * @brief 溜まっているSQEを投入し, 必要なら完了を1つ以上待つ
+ * @details 待たない場合も完了処理は行わせるので, 繰り返し呼び出して完了をスピンで待てる
+ * (DEFER_TASKRUNの完了処理はGETEVENTSを指定した io_uring_enter() の中でしか行われない)
+ *
+ * @param [in] u : io_uring
+ * @param [in] wait : 1なら完了を待つ
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int URingEnter(URING *u, int wait)
+{
+    u_int32_t toSubmit;
+    int ret;
+
+    __atomic_store_n(u->sqTail, u->sqLocal, __ATOMIC_RELEASE);
+    toSubmit = u->sqLocal - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE);
+    u->lastSend = NULL;
+    ret = syscall(SYS_io_uring_enter, u->fd, toSubmit, wait ? 1 : 0, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret == -1 && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+    {
+        DebugPerror("io_uring_enter");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief 完了を1つ取り出す
+ *
+ * @param [in] u : io_uring
+ * @param [out] userData : 要求のuser_data
+ * @param [out] res : 結果
+ * @param [out] flags : フラグ
+ * @return 1 : 取り出した, 0 : 完了なし
+ */
+int URingPeek(URING *u, u_int64_t *userData, int *res, u_int32_t *flags)
+{
+    struct io_uring_cqe *cqe;
+    u_int32_t head = *u->cqHead;
+
+    if (head == __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+    cqe = &((struct io_uring_cqe *)u->cqes)[head & u->cqMask];
+    *userData = cqe->user_data;
+    *res = cqe->res;
+    *flags = cqe->flags;
+    __atomic_store_n(u->cqHead, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/**
+ * @brief 完了のフラグから受信バッファの番号を取り出す
+ *
+ * @param [in] flags : 完了のフラグ
+ * @return バッファ番号, -1 : バッファなし
+ */
+int URingBufId(u_int32_t flags)
+{
+    if (!(flags & IORING_CQE_F_BUFFER))
+    {
+        return -1;
+    }
+    return flags >> IORING_CQE_BUFFER_SHIFT;
+}
+
+/**
+ * @brief 完了のフラグから, 同じ要求の完了がまだ続くかどうかを調べる(マルチショット受信)
+ *
+ * @param [in] flags : 完了のフラグ
+ * @return 1 : 続く, 0 : 要求は終了した
+ */
+int URingMore(u_int32_t flags)
+{
+    return (flags & IORING_CQE_F_MORE) ? 1 : 0;
+}
+
+/**
+ * @brief 受信バッファを解放する. 登録はio_uringを閉じると解除される
+ *
+ * @param [in] b : 提供バッファリング
+ * @return 0 : 正常終了
+ */
+int URingFreeBufs(URING_BUFS *b)
+{
+    if (b->bufs != NULL)
+    {
+        munmap(b->bufs, (size_t)URING_BUF_SIZE * URING_BUF_NR);
+        b->bufs = NULL;
+    }
+    if (b->ring != NULL)
+    {
+        munmap(b->ring, b->ringSize);
+        b->ring = NULL;
+    }
+    return 0;
+}
+
+/**
+ * @brief io_uringを閉じる
+ *
+ * @param [in] u : io_uring
+ * @return 0 : 正常終了
+ */
+int URingFree(URING *u)
+{
+    if (u->sqes != NULL)
+    {
+        munmap(u->sqes, u->sqesSize);
+    }
+    if (u->cqMap != NULL && u->cqMap != u->sqMap)
+    {
+        munmap(u->cqMap, u->cqMapSize);
+    }
+    if (u->sqMap != NULL)
+    {
+        munmap(u->sqMap, u->sqMapSize);
+    }
+    if (u->fd > 0)
+    {
+        close(u->fd);
+    }
+    memset(u, 0, sizeof(URING));
+
+    return 0;
+}
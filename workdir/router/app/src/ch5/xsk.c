@@ -0,0 +1,553 @@
+/**
+ * @file xsk.c
+ * @brief AF_XDPによる送受信
+ * @details デバイスごとに小さなXDPプログラムを読み込み, 自分宛てのIPv4フレームをAF_XDPソケットに渡す. @n
+ * ARPなどそれ以外のフレームはカーネルに渡し, これまでどおりPF_PACKETソケットで受信する. @n
+ * 全デバイスのソケットで1つのUMEMを共有するため, 受信したフレームをコピーせずに別のデバイスの送信リングに載せられる. @n
+ * XDPプログラムは汎用(SKB)モードで読み込むので, vethでも動作する. libbpfは使わず, bpf()システムコールで直接操作する
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include "netutil.h"
+
+extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+
+#define XSK_NO_FRAME ((u_int64_t)-1) // 処理中の受信フレームなし
+#define XSK_PROG_LOG_SIZE 65536      // 検証器のログのサイズ
+
+// eBPF命令の組み立て
+#define INSN(c, d, s, o, i) ((struct bpf_insn){.code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i)})
+#define LDX_MEM(size, dst, src, off) INSN(BPF_LDX | BPF_MEM | (size), dst, src, off, 0)
+#define MOV64_REG(dst, src) INSN(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0)
+#define MOV64_IMM(dst, imm) INSN(BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm)
+#define ADD64_IMM(dst, imm) INSN(BPF_ALU64 | BPF_ADD | BPF_K, dst, 0, 0, imm)
+#define JGT_REG(dst, src, off) INSN(BPF_JMP | BPF_JGT | BPF_X, dst, src, off, 0)
+#define JNE32_IMM(dst, imm, off) INSN(BPF_JMP32 | BPF_JNE | BPF_K, dst, 0, off, imm)
+#define LD_MAP_FD(dst, fd) INSN(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd), INSN(0, 0, 0, 0, 0)
+#define CALL(func) INSN(BPF_JMP | BPF_CALL, 0, 0, 0, func)
+#define EXIT() INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/**
+ * @brief bpf()システムコール
+ *
+ */
+static int Bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(SYS_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+/**
+ * @brief 自分宛てのIPv4フレームをAF_XDPソケットに渡すXDPプログラムを読み込む
+ * @details 宛先MACアドレスとタイプが一致したフレームを, 受信キュー番号をキーにXSKMAPへリダイレクトする. @n
+ * 一致しないフレームや, ソケットのないキューで受信したフレームはカーネルに渡す(XDP_PASS)
+ *
+ * @param [in] mapFd : XSKMAP
+ * @param [in] hwaddr : デバイスのMACアドレス
+ * @return プログラムのファイルディスクリプタ, -1 : 異常終了
+ */
+static int XskLoadProg(int mapFd, u_char hwaddr[6])
+{
+    u_int32_t macHi;
+    u_int16_t macLo, type = htons(ETHERTYPE_IP);
+    union bpf_attr attr;
+    char *log;
+    int fd;
+
+    // パケットから読んだ値と比べるので, ホストのバイトオーダーのまま並べる
+    memcpy(&macHi, hwaddr, 4);
+    memcpy(&macLo, hwaddr + 4, 2);
+    struct bpf_insn prog[] = {
+        LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data)),     // 0
+        LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end)), // 1
+        MOV64_REG(BPF_REG_4, BPF_REG_2),                                         // 2
+        ADD64_IMM(BPF_REG_4, sizeof(struct ether_header)),                       // 3
+        JGT_REG(BPF_REG_4, BPF_REG_3, 12),                                       // 4: Ethernetヘッダより短い
+        LDX_MEM(BPF_W, BPF_REG_4, BPF_REG_2, 0),                                 // 5: 宛先MACアドレス
+        JNE32_IMM(BPF_REG_4, macHi, 10),                                         // 6
+        LDX_MEM(BPF_H, BPF_REG_4, BPF_REG_2, 4),                                 // 7
+        JNE32_IMM(BPF_REG_4, macLo, 8),                                          // 8
+        LDX_MEM(BPF_H, BPF_REG_4, BPF_REG_2, 12),                                // 9: タイプ
+        JNE32_IMM(BPF_REG_4, type, 6),                                           // 10
+        LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, rx_queue_index)), // 11
+        LD_MAP_FD(BPF_REG_1, mapFd),                                             // 12, 13
+        MOV64_IMM(BPF_REG_3, XDP_PASS),                                          // 14: ソケットがなければXDP_PASS
+        CALL(BPF_FUNC_redirect_map),                                             // 15
+        EXIT(),                                                                  // 16
+        MOV64_IMM(BPF_REG_0, XDP_PASS),                                          // 17
+        EXIT(),                                                                  // 18
+    };
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = (u_int64_t)(unsigned long)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (u_int64_t)(unsigned long)"GPL";
+    if ((fd = Bpf(BPF_PROG_LOAD, &attr)) >= 0)
+    {
+        return fd;
+    }
+    // 失敗した場合は検証器のログを取って表示する
+    DebugPerror("bpf:BPF_PROG_LOAD");
+    if ((log = (char *)calloc(1, XSK_PROG_LOG_SIZE)) != NULL)
+    {
+        attr.log_buf = (u_int64_t)(unsigned long)log;
+        attr.log_size = XSK_PROG_LOG_SIZE;
+        attr.log_level = 1;
+        Bpf(BPF_PROG_LOAD, &attr);
+        DebugPrintf("%s\n", log);
+        free(log);
+    }
+    return -1;
+}
+
+/**
+ * @brief リングをmmapしてインデックスとエントリの位置を求める
+ *
+ * @param [in] fd : AF_XDPソケット
+ * @param [out] ring : リング
+ * @param [in] off : XDP_MMAP_OFFSETSで得たオフセット
+ * @param [in] pgoff : mmapのオフセット(XDP_PGOFF_*)
+ * @param [in] entrySize : 1エントリのサイズ
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+static int XskMapRing(int fd, XSK_RING *ring, struct xdp_ring_offset *off, off_t pgoff, size_t entrySize)
+{
+    ring->mapSize = off->desc + XSK_RING_SIZE * entrySize;
+    ring->map = mmap(NULL, ring->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED)
+    {
+        DebugPerror("mmap:AF_XDP ring");
+        ring->map = NULL;
+        return -1;
+    }
+    ring->producer = (u_int32_t *)((u_char *)ring->map + off->producer);
+    ring->consumer = (u_int32_t *)((u_char *)ring->map + off->consumer);
+    ring->desc = (u_char *)ring->map + off->desc;
+    ring->mask = XSK_RING_SIZE - 1;
+    ring->local = 0;
+    return 0;
+}
+
+/**
+ * @brief 書き込み側のリングの空きエントリ数
+ *
+ */
+static u_int32_t XskRingFree(XSK_RING *ring)
+{
+    return XSK_RING_SIZE - (ring->local - __atomic_load_n(ring->consumer, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * @brief 読み出し側のリングの読めるエントリ数
+ *
+ */
+static u_int32_t XskRingAvail(XSK_RING *ring)
+{
+    return __atomic_load_n(ring->producer, __ATOMIC_ACQUIRE) - ring->local;
+}
+
+/**
+ * @brief 送信が終わったフレームを完了リングから空きフレームに戻す
+ *
+ * @param [in] port : ポート
+ */
+static void XskComplete(XSK_PORT *port)
+{
+    XSK_UMEM *umem = port->umem;
+    u_int32_t n = XskRingAvail(&port->comp);
+
+    while (n-- > 0)
+    {
+        umem->free[umem->freeNo++] = ((u_int64_t *)port->comp.desc)[port->comp.local++ & port->comp.mask] & ~(u_int64_t)(XSK_FRAME_SIZE - 1);
+    }
+    __atomic_store_n(port->comp.consumer, port->comp.local, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 空きフレームをフィルリングに補充し, カーネルが受信に使えるようにする
+ *
+ * @param [in] port : ポート
+ */
+static void XskRefill(XSK_PORT *port)
+{
+    XSK_UMEM *umem = port->umem;
+    u_int32_t n = XskRingFree(&port->fill);
+
+    if (n == 0)
+    {
+        return;
+    }
+    while (n-- > 0 && umem->freeNo > 0)
+    {
+        ((u_int64_t *)port->fill.desc)[port->fill.local++ & port->fill.mask] = umem->free[--umem->freeNo];
+    }
+    __atomic_store_n(port->fill.producer, port->fill.local, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief UMEMの準備
+ * @details フレーム領域を確保し, すべてのフレームを空きにする. ソケットへの登録は最初の XskOpen() で行う
+ *
+ * @param [out] umem : UMEM
+ * @param [in] frameNr : フレーム数
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int XskUmemInit(XSK_UMEM *umem, int frameNr)
+{
+    int i;
+
+    memset(umem, 0, sizeof(XSK_UMEM));
+    umem->fd = -1;
+    umem->rxFrame = XSK_NO_FRAME;
+    umem->size = (size_t)frameNr * XSK_FRAME_SIZE;
+    umem->area = mmap(NULL, umem->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (umem->area == MAP_FAILED)
+    {
+        DebugPerror("mmap:UMEM");
+        umem->area = NULL;
+        return -1;
+    }
+    if ((umem->free = (u_int64_t *)malloc(frameNr * sizeof(u_int64_t))) == NULL)
+    {
+        DebugPerror("malloc");
+        munmap(umem->area, umem->size);
+        umem->area = NULL;
+        return -1;
+    }
+    for (i = 0; i < frameNr; i++)
+    {
+        umem->free[i] = (u_int64_t)(frameNr - 1 - i) * XSK_FRAME_SIZE;
+    }
+    umem->freeNo = frameNr;
+    return 0;
+}
+
+/**
+ * @brief UMEMの解放(全てのポートを XskClose() した後に呼ぶ)
+ *
+ * @param [in] umem : UMEM
+ */
+void XskUmemFree(XSK_UMEM *umem)
+{
+    if (umem->area != NULL)
+    {
+        munmap(umem->area, umem->size);
+        umem->area = NULL;
+    }
+    free(umem->free);
+    umem->free = NULL;
+}
+
+/**
+ * @brief デバイスのAF_XDPソケットの準備
+ * @details 1. AF_XDPソケットを作成し, UMEMを登録(2つ目以降のデバイスは最初のソケットのUMEMを共有) @n
+ * 2. 受信, 送信, フィルリング, 完了リングを作成してmmap @n
+ * 3. デバイスのキュー0にバインド(汎用モードではコピーモード) @n
+ * 4. XSKMAPとXDPプログラムを作り, ソケットを登録してからデバイスにアタッチ @n
+ * キュー0以外で受信したフレームはXDPプログラムがカーネルに渡すので, PF_PACKETソケットで受信される
+ *
+ * @param [out] port : ポート
+ * @param [in] umem : 共有するUMEM
+ * @param [in] device : ネットワークインターフェース名
+ * @param [in] hwaddr : デバイスのMACアドレス
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int XskOpen(XSK_PORT *port, XSK_UMEM *umem, char *device, u_char hwaddr[6])
+{
+    struct xdp_umem_reg reg;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp sxdp;
+    union bpf_attr attr;
+    socklen_t optlen;
+    int size = XSK_RING_SIZE, ifindex, key = 0;
+
+    memset(port, 0, sizeof(XSK_PORT));
+    port->umem = umem;
+    port->progFd = port->mapFd = port->linkFd = -1;
+    if ((ifindex = if_nametoindex(device)) == 0)
+    {
+        DebugPerror("if_nametoindex");
+        return -1;
+    }
+    if ((port->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0)
+    {
+        DebugPerror("socket:AF_XDP");
+        port->fd = 0;
+        return -1;
+    }
+    if (umem->fd == -1)
+    { // 最初のデバイスでUMEMを登録
+        memset(&reg, 0, sizeof(reg));
+        reg.addr = (u_int64_t)(unsigned long)umem->area;
+        reg.len = umem->size;
+        reg.chunk_size = XSK_FRAME_SIZE;
+        if (setsockopt(port->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0)
+        {
+            DebugPerror("setsockopt:XDP_UMEM_REG");
+            XskClose(port);
+            return -1;
+        }
+    }
+    // フィルリング, 完了リングはUMEMを共有してもデバイス(キュー)ごとに持つ
+    if (setsockopt(port->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(port->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(port->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(port->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0)
+    {
+        DebugPerror("setsockopt:AF_XDP ring");
+        XskClose(port);
+        return -1;
+    }
+    optlen = sizeof(off);
+    if (getsockopt(port->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+    {
+        DebugPerror("getsockopt:XDP_MMAP_OFFSETS");
+        XskClose(port);
+        return -1;
+    }
+    if (XskMapRing(port->fd, &port->rx, &off.rx, XDP_PGOFF_RX_RING, sizeof(struct xdp_desc)) == -1 ||
+        XskMapRing(port->fd, &port->tx, &off.tx, XDP_PGOFF_TX_RING, sizeof(struct xdp_desc)) == -1 ||
+        XskMapRing(port->fd, &port->fill, &off.fr, XDP_UMEM_PGOFF_FILL_RING, sizeof(u_int64_t)) == -1 ||
+        XskMapRing(port->fd, &port->comp, &off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(u_int64_t)) == -1)
+    {
+        XskClose(port);
+        return -1;
+    }
+    // バインドの前にフィルリングを満たしておく
+    XskRefill(port);
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifindex;
+    sxdp.sxdp_queue_id = 0;
+    if (umem->fd == -1)
+    {
+        sxdp.sxdp_flags = XDP_COPY;
+    }
+    else
+    {
+        sxdp.sxdp_flags = XDP_SHARED_UMEM;
+        sxdp.sxdp_shared_umem_fd = umem->fd;
+    }
+    if (bind(port->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0)
+    {
+        DebugPerror("bind:AF_XDP");
+        XskClose(port);
+        return -1;
+    }
+    if (umem->fd == -1)
+    {
+        umem->fd = port->fd;
+    }
+
+    // XSKMAPにソケットを登録し, XDPプログラムをアタッチ
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(int);
+    attr.value_size = sizeof(int);
+    attr.max_entries = 1;
+    if ((port->mapFd = Bpf(BPF_MAP_CREATE, &attr)) < 0)
+    {
+        DebugPerror("bpf:BPF_MAP_CREATE");
+        XskClose(port);
+        return -1;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = port->mapFd;
+    attr.key = (u_int64_t)(unsigned long)&key;
+    attr.value = (u_int64_t)(unsigned long)&port->fd;
+    if (Bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+    {
+        DebugPerror("bpf:BPF_MAP_UPDATE_ELEM");
+        XskClose(port);
+        return -1;
+    }
+    if ((port->progFd = XskLoadProg(port->mapFd, hwaddr)) == -1)
+    {
+        XskClose(port);
+        return -1;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = port->progFd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+    if ((port->linkFd = Bpf(BPF_LINK_CREATE, &attr)) < 0)
+    {
+        DebugPerror("bpf:BPF_LINK_CREATE");
+        XskClose(port);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 受信リングのフレームを順に処理する
+ * @details フレームをUMEM上でそのまま func に渡す. func の中で XskSend() により送信リングに載せられたフレームはそのまま送信し, @n
+ * それ以外は処理後に空きフレームに戻す. 最後にフィルリングを補充する
+ *
+ * @param [in] port : ポート
+ * @param [in] deviceNo : デバイス番号(funcにそのまま渡す)
+ * @param [in] func : フレームごとに呼び出す関数
+ * @return 処理したフレーム数
+ */
+int XskRxWalk(XSK_PORT *port, int deviceNo, int (*func)(int deviceNo, u_char *data, int size))
+{
+    XSK_UMEM *umem = port->umem;
+    struct xdp_desc *desc;
+    u_int32_t n, i;
+
+    if ((n = XskRingAvail(&port->rx)) > XSK_BATCH)
+    {
+        n = XSK_BATCH;
+    }
+    for (i = 0; i < n; i++)
+    {
+        desc = &((struct xdp_desc *)port->rx.desc)[port->rx.local++ & port->rx.mask];
+        umem->rxFrame = desc->addr & ~(u_int64_t)(XSK_FRAME_SIZE - 1);
+        umem->rxTaken = 0;
+        func(deviceNo, umem->area + desc->addr, desc->len);
+        if (!umem->rxTaken)
+        {
+            umem->free[umem->freeNo++] = umem->rxFrame;
+        }
+    }
+    umem->rxFrame = XSK_NO_FRAME;
+    __atomic_store_n(port->rx.consumer, port->rx.local, __ATOMIC_RELEASE);
+    XskComplete(port);
+    XskRefill(port);
+    return n;
+}
+
+/**
+ * @brief フレームを送信リングに書き込む
+ * @details 処理中の受信フレームならUMEM上のまま送信リングに載せ(コピーなし), それ以外は空きフレームにコピーする. @n
+ * 実際の送信は XskFlush() で行う
+ *
+ * @param [in] port : ポート
+ * @param [in] data : フレーム
+ * @param [in] size : フレーム長
+ * @return 0 : 正常終了, -1 : 送信リングや空きフレームがない
+ */
+int XskSend(XSK_PORT *port, u_char *data, int size)
+{
+    XSK_UMEM *umem = port->umem;
+    struct xdp_desc *desc;
+    u_int64_t addr;
+
+    if (XskRingFree(&port->tx) == 0)
+    {
+        return -1;
+    }
+    if (umem->rxFrame != XSK_NO_FRAME && !umem->rxTaken &&
+        data >= umem->area + umem->rxFrame && data + size <= umem->area + umem->rxFrame + XSK_FRAME_SIZE)
+    { // 受信したフレームをそのまま送信
+        addr = data - umem->area;
+        umem->rxTaken = 1;
+    }
+    else
+    {
+        if (umem->freeNo == 0)
+        {
+            XskComplete(port);
+        }
+        if (umem->freeNo == 0 || size > XSK_FRAME_SIZE)
+        {
+            return -1;
+        }
+        addr = umem->free[--umem->freeNo];
+        memcpy(umem->area + addr, data, size);
+    }
+    desc = &((struct xdp_desc *)port->tx.desc)[port->tx.local++ & port->tx.mask];
+    desc->addr = addr;
+    desc->len = size;
+    desc->options = 0;
+    port->pending++;
+    return 0;
+}
+
+/**
+ * @brief XskSend()で書き込んだフレームをカーネルに通知して送信し, 送信が終わったフレームを回収する
+ * @details コピーモードでは1回のsendto()で送信されるフレーム数に上限があるため, 送信リングが空くまで繰り返す
+ *
+ * @param [in] port : ポート
+ * @return 0 : 正常終了, -1 : 異常終了
+ */
+int XskFlush(XSK_PORT *port)
+{
+    int retry;
+
+    if (port->pending > 0)
+    {
+        __atomic_store_n(port->tx.producer, port->tx.local, __ATOMIC_RELEASE);
+        port->pending = 0;
+        for (retry = 0; retry < XSK_RING_SIZE && __atomic_load_n(port->tx.consumer, __ATOMIC_ACQUIRE) != port->tx.local; retry++)
+        {
+            if (sendto(port->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+            {
+                DebugPerror("sendto:AF_XDP");
+                return -1;
+            }
+        }
+    }
+    XskComplete(port);
+    return 0;
+}
+
+/**
+ * @brief AF_XDPソケットとXDPプログラムの解放
+ * @details リンクを閉じるとXDPプログラムはデバイスからデタッチされる
+ *
+ * @param [in] port : ポート
+ * @return 0 : 正常終了
+ */
+int XskClose(XSK_PORT *port)
+{
+    XSK_RING *rings[] = {&port->rx, &port->tx, &port->fill, &port->comp};
+    int i;
+
+    if (port->linkFd >= 0)
+    {
+        close(port->linkFd);
+    }
+    if (port->progFd >= 0)
+    {
+        close(port->progFd);
+    }
+    if (port->mapFd >= 0)
+    {
+        close(port->mapFd);
+    }
+    for (i = 0; i < 4; i++)
+    {
+        if (rings[i]->map != NULL)
+        {
+            munmap(rings[i]->map, rings[i]->mapSize);
+            rings[i]->map = NULL;
+        }
+    }
+    if (port->fd > 0)
+    {
+        close(port->fd);
+    }
+    port->fd = 0;
+    port->linkFd = port->progFd = port->mapFd = -1;
+    return 0;
+}